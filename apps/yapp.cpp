@@ -37,6 +37,7 @@
 
 #include "tinyply.h"
 
+#include <algorithm>
 #include <fstream>
 
 namespace yapp {
@@ -773,6 +774,34 @@ std::vector<int4> make_trace_blocks(int w, int h, int bs) {
     return blocks;
 }
 
+std::vector<int4> rebalance_trace_blocks(const std::vector<int4>& blocks,
+    int w, const ytrace::pixel_stats* stats,
+    const ytrace::render_params& params) {
+    auto work = std::vector<std::pair<int, int4>>();
+    for (auto& block : blocks) {
+        auto bmin = ym::vec2i{block[0] + block[2], block[1] + block[3]};
+        auto bmax = ym::vec2i{block[0] - 1, block[1] - 1};
+        auto count = 0;
+        for (int j = block[1]; j < block[1] + block[3]; j++) {
+            for (int i = block[0]; i < block[0] + block[2]; i++) {
+                if (ytrace::is_pixel_converged(stats[j * w + i], params))
+                    continue;
+                bmin = {ym::min(bmin[0], i), ym::min(bmin[1], j)};
+                bmax = {ym::max(bmax[0], i), ym::max(bmax[1], j)};
+                count++;
+            }
+        }
+        if (!count) continue;
+        work.push_back({count, {bmin[0], bmin[1], bmax[0] - bmin[0] + 1,
+                                   bmax[1] - bmin[1] + 1}});
+    }
+    std::stable_sort(work.begin(), work.end(),
+        [](const auto& a, const auto& b) { return a.first > b.first; });
+    auto rebalanced = std::vector<int4>();
+    for (auto& item : work) rebalanced.push_back(item.second);
+    return rebalanced;
+}
+
 void save_image(const std::string& filename, int width, int height,
     const float4* hdr, float exposure, yimg::tonemap_type tonemap,
     float gamma) {
@@ -791,7 +820,8 @@ void save_image(const std::string& filename, int width, int height,
     }
 }
 
-ybvh::scene* make_bvh(const scene* scene) {
+ybvh::scene* make_bvh(const scene* scene,
+    const ybvh::build_params& params, const std::string& cache_dir) {
     auto scene_bvh = ybvh::make_scene((int)scene->shapes.size());
     auto sid = 0;
     for (auto shape : scene->shapes) {
@@ -818,10 +848,49 @@ ybvh::scene* make_bvh(const scene* scene) {
                 shape->radius.data());
         }
     }
-    ybvh::build_bvh(scene_bvh);
+    if (cache_dir.empty()) {
+        ybvh::build_bvh(scene_bvh, params);
+        return scene_bvh;
+    }
+
+    // load cached shape bvhs, building and saving the missing ones
+    for (auto i = 0; i < (int)scene->shapes.size(); i++) {
+        char key[32];
+        sprintf(key, "%016llx",
+            (unsigned long long)ybvh::hash_shape(scene_bvh, i, params));
+        auto filename = cache_dir + "/" + key + ".ybvh";
+        if (ybvh::load_bvh(scene_bvh, i, params, filename)) continue;
+        ybvh::build_bvh(scene_bvh, i, params);
+        if (!ybvh::save_bvh(scene_bvh, i, params, filename))
+            ycmd::log_msgf(ycmd::log_level_warning, "yapp",
+                "cannot save bvh cache %s", filename.c_str());
+    }
+    auto scene_params = params;
+    scene_params.do_shapes = false;
+    ybvh::build_bvh(scene_bvh, scene_params);
     return scene_bvh;
 }
 
+//
+// Intersects an array of rays with ybvh for the ytrace batch callbacks.
+//
+inline void intersect_trace_rays(const ybvh::scene* scene_bvh, int nrays,
+    const ytrace::float3* o, const ytrace::float3* d, const float* tmin,
+    const float* tmax, bool early_exit, ytrace::intersect_point* isecs) {
+    static thread_local auto hits = std::vector<ybvh::point>();
+    hits.resize(nrays);
+    ybvh::intersect_rays(
+        scene_bvh, nrays, o, d, tmin, tmax, early_exit, hits.data());
+    for (auto i = 0; i < nrays; i++) {
+        auto& isec = hits[i];
+        auto& ipt = isecs[i];
+        ipt.dist = isec.dist;
+        ipt.sid = isec.sid;
+        ipt.eid = isec.eid;
+        ipt.euv = {isec.euv[0], isec.euv[1], isec.euv[2]};
+    }
+}
+
 ytrace::scene* make_trace_scene(
     const scene* scene, const ybvh::scene* scene_bvh, int camera) {
     auto trace_scene = ytrace::make_scene((int)scene->cameras.size(),
@@ -910,6 +979,16 @@ ytrace::scene* make_trace_scene(
         [](auto ctx, auto o, auto d, auto tmin, auto tmax) {
             auto scene_bvh = (ybvh::scene*)ctx;
             return (bool)ybvh::intersect_ray(scene_bvh, o, d, tmin, tmax, true);
+        },
+        [](auto ctx, auto nrays, auto o, auto d, auto tmin, auto tmax,
+            auto isecs) {
+            intersect_trace_rays(
+                (ybvh::scene*)ctx, nrays, o, d, tmin, tmax, false, isecs);
+        },
+        [](auto ctx, auto nrays, auto o, auto d, auto tmin, auto tmax,
+            auto isecs) {
+            intersect_trace_rays(
+                (ybvh::scene*)ctx, nrays, o, d, tmin, tmax, true, isecs);
         });
 
     ytrace::set_logging_callbacks(trace_scene, nullptr, ycmd::log_msgfv);
@@ -919,8 +998,8 @@ ytrace::scene* make_trace_scene(
     return trace_scene;
 }
 
-ysym::scene* make_simulation_scene(
-    const scene* scene, ybvh::scene*& scene_bvh) {
+ysym::scene* make_simulation_scene(const scene* scene,
+    ybvh::scene*& scene_bvh, const ybvh::build_params& params) {
     // allocate scene
     auto simulation_scene = ysym::make_scene((int)scene->shapes.size());
 
@@ -939,7 +1018,7 @@ ysym::scene* make_simulation_scene(
     }
 
     // set up final bvh
-    scene_bvh = make_bvh(scene);
+    scene_bvh = make_bvh(scene, params);
 
     // setup collisions
     ysym::set_overlap_callbacks(simulation_scene, scene_bvh,
@@ -952,16 +1031,29 @@ ysym::scene* make_simulation_scene(
             auto scene_bvh = (ybvh::scene*)ctx;
             auto overlap =
                 ybvh::overlap_point(scene_bvh, sid, pt, max_dist, false);
-            return *(ysym::overlap_point*)&overlap;
+            auto opt = ysym::overlap_point();
+            opt.dist = overlap.dist;
+            opt.sid = overlap.sid;
+            opt.eid = overlap.eid;
+            opt.euv = overlap.euv;
+            return opt;
         },
         [](auto ctx, int sid1, int sid2, float max_dist,
             std::vector<std::pair<ysym::overlap_point, ysym::int2>>*
-                overlaps_) {
+                overlaps) {
             auto scene_bvh = (ybvh::scene*)ctx;
-            auto overlaps =
-                (std::vector<std::pair<ybvh::point, ybvh::int2>>*)overlaps_;
+            auto bvh_overlaps =
+                std::vector<std::pair<ybvh::point, ybvh::int2>>();
             ybvh::overlap_verts(scene_bvh, scene_bvh, sid1, sid2, true,
-                max_dist, true, overlaps);
+                max_dist, true, &bvh_overlaps);
+            for (auto& overlap : bvh_overlaps) {
+                auto opt = ysym::overlap_point();
+                opt.dist = overlap.first.dist;
+                opt.sid = overlap.first.sid;
+                opt.eid = overlap.first.eid;
+                opt.euv = overlap.first.euv;
+                overlaps->push_back({opt, overlap.second});
+            }
         },
         [](auto ctx, auto rigid_scene, int nshapes) {
             auto scene_bvh = (ybvh::scene*)ctx;
@@ -969,7 +1061,7 @@ ysym::scene* make_simulation_scene(
                 ybvh::set_shape_frame(scene_bvh, sid,
                     ysym::get_rigid_body_frame(rigid_scene, sid));
             }
-            ybvh::refit_bvh(scene_bvh);
+            ybvh::update_bvh(scene_bvh);
         });
 
     // initialize
@@ -999,7 +1091,16 @@ params* init_params(const std::string& help, int argc, char** argv,
         {"eye", (int)ytrace::shader_type::eyelight},
         {"direct", (int)ytrace::shader_type::direct},
         {"direct_ao", (int)ytrace::shader_type::direct_ao},
-        {"path", (int)ytrace::shader_type::pathtrace}};
+        {"path", (int)ytrace::shader_type::pathtrace},
+        {"wavefront", (int)ytrace::shader_type::wavefront}};
+    static auto htype_names = std::vector<std::pair<std::string, int>>{
+        {"default", (int)ybvh::heuristic_type::def},
+        {"equalnum", (int)ybvh::heuristic_type::equalnum},
+        {"equalsize", (int)ybvh::heuristic_type::equalsize},
+        {"sah", (int)ybvh::heuristic_type::sah},
+        {"binned_sah", (int)ybvh::heuristic_type::binned_sah},
+        {"morton", (int)ybvh::heuristic_type::morton},
+        {"sbvh", (int)ybvh::heuristic_type::sbvh}};
     static auto tmtype_names = std::vector<std::pair<std::string, int>>{
         {"default", (int)yimg::tonemap_type::def},
         {"linear", (int)yimg::tonemap_type::linear},
@@ -1066,6 +1167,25 @@ params* init_params(const std::string& help, int argc, char** argv,
             ycmd::parse_opt<int>(parser, "--batch_size", "", "batch size", 16);
         pars->render_params.nsamples =
             ycmd::parse_opti(parser, "--samples", "-s", "image samples", 256);
+        pars->render_params.adaptive_threshold = ycmd::parse_optf(parser,
+            "--adaptive_threshold", "",
+            "relative pixel error to stop sampling [0 for none]", 0);
+        pars->render_params.adaptive_min_samples =
+            ycmd::parse_opti(parser, "--adaptive_min_samples", "",
+                "min samples per pixel with adaptive sampling", 16);
+        pars->bvh_params.width = ycmd::parse_opti(
+            parser, "--bvh_width", "", "bvh node width [2, 4, 8]", 2);
+        pars->bvh_params.compressed = ycmd::parse_flag(parser,
+            "--bvh_compressed", "", "compress shape bvhs to save memory");
+        pars->bvh_params.triangle_packs =
+            ycmd::parse_opti(parser, "--bvh_triangle_packs", "",
+                "triangles per leaf pack [0 for none, 4, 8]", 0);
+        pars->bvh_params.line_pieces = ycmd::parse_opti(parser,
+            "--bvh_line_pieces", "", "max pieces per line [0 for none]", 0);
+        pars->bvh_cache = ycmd::parse_opts(parser, "--bvh_cache", "",
+            "directory of cached shape bvhs [empty for none]", "");
+        pars->heatmap = ycmd::parse_flag(parser, "--heatmap", "",
+            "also save a heatmap of the bvh traversal cost of each pixel");
 
         if (camera_lights) {
             pars->render_params.stype = ytrace::shader_type::eyelight;
@@ -1081,6 +1201,13 @@ params* init_params(const std::string& help, int argc, char** argv,
             parser, "--output", "-o", "output filename", "out.%04d.obj");
     }
 
+    if (trace_params || sym_params) {
+        pars->bvh_params.htype =
+            (ybvh::heuristic_type)ycmd::parse_opte(parser, "--bvh_heuristic",
+                "", "bvh build heuristic", (int)ybvh::heuristic_type::def,
+                htype_names);
+    }
+
     if (ui_params) {
         pars->no_ui =
             ycmd::parse_flag(parser, "--no-ui", "", "run without ui", false);
@@ -197,6 +197,15 @@ void save_scene(const std::string& filename, const scene* sc);
 //
 std::vector<int4> make_trace_blocks(int w, int h, int bs);
 
+//
+// Rebalance trace blocks for adaptive sampling by remaining work. Blocks are
+// shrunk to their pixels that have not converged, dropped if none is left,
+// and sorted by the number of such pixels, largest first.
+//
+std::vector<int4> rebalance_trace_blocks(const std::vector<int4>& blocks,
+    int w, const ytrace::pixel_stats* stats,
+    const ytrace::render_params& params);
+
 //
 // Save image
 //
@@ -204,9 +213,11 @@ void save_image(const std::string& filename, int width, int height,
     const float4* hdr, float exposure, yimg::tonemap_type tonemap, float gamma);
 
 //
-// Make a BVH
+// Make a BVH. If cache_dir is not empty, shape bvhs are loaded from cache
+// files in that directory, and the ones that are missing are built and saved.
 //
-ybvh::scene* make_bvh(const scene* scene);
+ybvh::scene* make_bvh(const scene* scene,
+    const ybvh::build_params& params = {}, const std::string& cache_dir = "");
 
 //
 // Initialize scene for rendering
@@ -217,7 +228,8 @@ ytrace::scene* make_trace_scene(
 //
 // Initialize a simulation scene
 //
-ysym::scene* make_simulation_scene(const scene* scene, ybvh::scene*& scene_bvh);
+ysym::scene* make_simulation_scene(const scene* scene,
+    ybvh::scene*& scene_bvh, const ybvh::build_params& params = {});
 
 //
 // Step one time
@@ -243,6 +255,9 @@ struct params {
     int block_size = 32;
     int batch_size = 16;
     int nthreads = 0;
+    ybvh::build_params bvh_params;
+    std::string bvh_cache;
+    bool heatmap = false;
 
     // simulation
     ysym::simulation_params simulation_params;
@@ -447,9 +447,9 @@ int main(int argc, char* argv[]) {
 
     // setting up rendering
     st->scene = yapp::load_scenes(pars->filenames, pars->scene_scale);
-    st->scene_bvh = yapp::make_bvh(st->scene);
-    st->simulation_scene =
-        yapp::make_simulation_scene(st->scene, st->scene_bvh);
+    st->scene_bvh = yapp::make_bvh(st->scene, pars->bvh_params);
+    st->simulation_scene = yapp::make_simulation_scene(
+        st->scene, st->scene_bvh, pars->bvh_params);
 
     // initialize simulation
     ysym::init_simulation(st->simulation_scene);
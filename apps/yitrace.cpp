@@ -353,7 +353,8 @@ int main(int argc, char* argv[]) {
         cam->aspect = (float)pars->width / (float)pars->height;
 
     // building bvh and trace scene
-    st->scene_bvh = yapp::make_bvh(st->scene);
+    st->scene_bvh =
+        yapp::make_bvh(st->scene, pars->bvh_params, pars->bvh_cache);
     st->trace_scene = yapp::make_trace_scene(
         st->scene, st->scene_bvh, pars->render_params.camera_id);
 
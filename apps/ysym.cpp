@@ -35,8 +35,9 @@ int main(int argc, char* argv[]) {
 
     // setting up rendering
     auto scene = yapp::load_scenes(pars->filenames, pars->scene_scale);
-    auto scene_bvh = yapp::make_bvh(scene);
-    auto simulation_scene = yapp::make_simulation_scene(scene, scene_bvh);
+    auto scene_bvh = yapp::make_bvh(scene, pars->bvh_params);
+    auto simulation_scene =
+        yapp::make_simulation_scene(scene, scene_bvh, pars->bvh_params);
 
     // initialize simulation
     ysym::init_simulation(simulation_scene);
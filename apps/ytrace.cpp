@@ -28,6 +28,24 @@
 
 #include "yapp.h"
 
+//
+// Traversal cost of a query, as nodes visited plus element tests.
+//
+inline uint64_t ray_cost(const ybvh::ray_stats& stats) {
+    return stats.nnodes + stats.npoint_tests + stats.nline_tests +
+           stats.ntriangle_tests + stats.ntetra_tests;
+}
+
+//
+// Heatmap color ramp from blue, for no cost, to red, for the max cost.
+//
+inline std::array<float, 4> heatmap_color(float t) {
+    auto saturate = [](float x) { return std::min(std::max(x, 0.0f), 1.0f); };
+    t = saturate(t);
+    return {saturate(2 * t - 0.5f), saturate(2 - std::abs(4 * t - 2)),
+        saturate(1.5f - 2 * t), 1};
+}
+
 int main(int argc, char* argv[]) {
     // logging
     yapp::set_default_loggers();
@@ -47,7 +65,7 @@ int main(int argc, char* argv[]) {
 
     // build bvh and trace scene
     ycmd::log_msgf(ycmd::log_level_info, "ytrace", "building bvh");
-    auto scene_bvh = yapp::make_bvh(scene);
+    auto scene_bvh = yapp::make_bvh(scene, pars->bvh_params, pars->bvh_cache);
     ycmd::log_msgf(ycmd::log_level_info, "ytrace", "setting up tracer");
     auto trace_scene =
         yapp::make_trace_scene(scene, scene_bvh, pars->render_params.camera_id);
@@ -60,12 +78,33 @@ int main(int argc, char* argv[]) {
     auto hdr = new std::array<float, 4>[pars->width * pars->height];
     for (auto i = 0; i < pars->width * pars->height; i++) hdr[i] = {0, 0, 0, 0};
 
+    // traversal cost of each pixel, measured one pixel at a time
+    auto cost = std::vector<uint64_t>(
+        (pars->heatmap) ? pars->width * pars->height : 0, 0);
+    auto cost_data = cost.data();
+    if (pars->heatmap) {
+        ybvh::reset_ray_stats();
+        ybvh::enable_ray_stats(true);
+    }
+
+    // per pixel statistics for adaptive sampling
+    auto adaptive = pars->render_params.adaptive_threshold > 0;
+    auto stats = std::vector<ytrace::pixel_stats>(
+        (adaptive) ? pars->width * pars->height : 0);
+    auto stats_data = stats.data();
+
     // render
     ycmd::log_msgf(ycmd::log_level_info, "ytrace", "starting renderer");
-    auto blocks =
+    auto grid =
         yapp::make_trace_blocks(pars->width, pars->height, pars->block_size);
+    auto blocks = grid;
     for (auto cur_sample = 0; cur_sample < pars->render_params.nsamples;
          cur_sample += pars->batch_size) {
+        if (adaptive && cur_sample) {
+            blocks = yapp::rebalance_trace_blocks(
+                grid, pars->width, stats_data, pars->render_params);
+            if (blocks.empty()) break;
+        }
         if (pars->save_progressive && cur_sample) {
             auto imfilename = ycmd::get_dirname(pars->imfilename) +
                               ycmd::get_basename(pars->imfilename) +
@@ -77,19 +116,52 @@ int main(int argc, char* argv[]) {
                 pars->exposure, pars->tonemap, pars->gamma);
         }
         ycmd::log_msgf(ycmd::log_level_info, "ytrace",
-            "rendering sample %4d/%d", cur_sample,
-            pars->render_params.nsamples);
-        ycmd::thread_pool_for(blocks.size(), [=](auto cur_block) {
+            "rendering sample %4d/%d in %d blocks", cur_sample,
+            pars->render_params.nsamples, (int)blocks.size());
+        ycmd::thread_pool_for(blocks.size(), [=, &blocks](auto cur_block) {
             auto block = blocks[cur_block];
-            ytrace::trace_block(trace_scene, pars->width, pars->height,
-                (ytrace::float4*)hdr, block[0], block[1], block[2], block[3],
-                cur_sample,
-                std::min(cur_sample + pars->batch_size,
-                    pars->render_params.nsamples),
-                pars->render_params);
+            auto samples_max = std::min(
+                cur_sample + pars->batch_size, pars->render_params.nsamples);
+            if (!pars->heatmap && adaptive) {
+                ytrace::trace_block(trace_scene, pars->width, pars->height,
+                    (ytrace::float4*)hdr, stats_data, block[0], block[1],
+                    block[2], block[3], cur_sample, samples_max,
+                    pars->render_params);
+                return;
+            }
+            if (!pars->heatmap) {
+                ytrace::trace_block(trace_scene, pars->width, pars->height,
+                    (ytrace::float4*)hdr, block[0], block[1], block[2],
+                    block[3], cur_sample, samples_max, pars->render_params);
+                return;
+            }
+            for (auto j = block[1]; j < block[1] + block[3]; j++) {
+                for (auto i = block[0]; i < block[0] + block[2]; i++) {
+                    auto start = ray_cost(ybvh::get_thread_ray_stats());
+                    if (adaptive) {
+                        ytrace::trace_block(trace_scene, pars->width,
+                            pars->height, (ytrace::float4*)hdr, stats_data, i,
+                            j, 1, 1, cur_sample, samples_max,
+                            pars->render_params);
+                    } else {
+                        ytrace::trace_block(trace_scene, pars->width,
+                            pars->height, (ytrace::float4*)hdr, i, j, 1, 1,
+                            cur_sample, samples_max, pars->render_params);
+                    }
+                    cost_data[j * pars->width + i] +=
+                        ray_cost(ybvh::get_thread_ray_stats()) - start;
+                }
+            }
         });
     }
     ycmd::log_msgf(ycmd::log_level_info, "ytrace", "rendering done");
+    if (adaptive) {
+        auto nsamples = (uint64_t)0;
+        for (auto& st : stats) nsamples += st.nsamples;
+        ycmd::log_msgf(ycmd::log_level_info, "ytrace",
+            "adaptive sampling used %.1f samples per pixel",
+            nsamples / (double)stats.size());
+    }
 
     // save image
     ycmd::log_msgf(ycmd::log_level_info, "ytrace", "saving image %s",
@@ -97,6 +169,34 @@ int main(int argc, char* argv[]) {
     yapp::save_image(pars->imfilename, pars->width, pars->height, hdr,
         pars->exposure, pars->tonemap, pars->gamma);
 
+    // save heatmap of the cost per sample, normalized to the max
+    if (pars->heatmap) {
+        ybvh::enable_ray_stats(false);
+        auto stats = ybvh::get_ray_stats();
+        auto nrays = (double)std::max(stats.nrays, (uint64_t)1);
+        ycmd::log_msgf(ycmd::log_level_info, "ytrace",
+            "rays %llu, nodes per ray %.1f, leaves per ray %.1f, "
+            "element tests per ray %.1f, transforms per ray %.1f",
+            (unsigned long long)stats.nrays, stats.nnodes / nrays,
+            stats.nleaves / nrays,
+            (ray_cost(stats) - stats.nnodes) / nrays,
+            stats.ntransforms / nrays);
+        auto max_cost = (uint64_t)1;
+        for (auto c : cost) max_cost = std::max(max_cost, c);
+        auto heatmap = std::vector<std::array<float, 4>>(cost.size());
+        for (auto i = 0; i < (int)cost.size(); i++)
+            heatmap[i] = heatmap_color((float)cost[i] / (float)max_cost);
+        auto hmfilename = ycmd::get_dirname(pars->imfilename) +
+                          ycmd::get_basename(pars->imfilename) + ".heatmap" +
+                          ycmd::get_extension(pars->imfilename);
+        ycmd::log_msgf(ycmd::log_level_info, "ytrace",
+            "saving heatmap %s with max cost %.1f per sample",
+            hmfilename.c_str(),
+            max_cost / (double)std::max(pars->render_params.nsamples, 1));
+        yapp::save_image(hmfilename, pars->width, pars->height,
+            heatmap.data(), 0, yimg::tonemap_type::linear, 1);
+    }
+
     // done
     // cleanup
     delete scene;
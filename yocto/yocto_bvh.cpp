@@ -30,8 +30,33 @@
 #include "yocto_math.h"
 
 #include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <cstdio>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <type_traits>
 #include <unordered_map>
+#include <unordered_set>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define YBVH__MMAP 1
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64) || defined(_M_AMD64)
+#include <emmintrin.h>
+#define YBVH__SSE 1
+#endif
+#ifdef __AVX__
+#include <immintrin.h>
+#define YBVH__AVX 1
+#endif
 
 namespace ybvh {
 
@@ -348,6 +373,7 @@ static inline const T& _safemax(const T& a, const T& b) {
 //
 // Returns:
 // - whether the intersection occurred
+// - ray_tnear: ray distance at which the ray enters the box
 //
 // Implementation Notes:
 // - based on "Robust BVH Ray Traversal" by T. Ize published at
@@ -355,7 +381,7 @@ static inline const T& _safemax(const T& a, const T& b) {
 //
 static inline bool _intersect_check_bbox(const ym::ray3f& ray,
     const ym::vec3f& ray_dinv, const ym::vec3i& ray_dsign,
-    const ym::bbox3f& bbox) {
+    const ym::bbox3f& bbox, float& ray_tnear) {
     auto txmin = (bbox[ray_dsign[0]][0] - ray.o[0]) * ray_dinv[0];
     auto txmax = (bbox[1 - ray_dsign[0]][0] - ray.o[0]) * ray_dinv[0];
     auto tymin = (bbox[ray_dsign[1]][1] - ray.o[1]) * ray_dinv[1];
@@ -365,6 +391,7 @@ static inline bool _intersect_check_bbox(const ym::ray3f& ray,
     auto tmin = _safemax(tzmin, _safemax(tymin, _safemax(txmin, ray.tmin)));
     auto tmax = _safemin(tzmax, _safemin(tymax, _safemin(txmax, ray.tmax)));
     tmax *= 1.00000024f;  // for double: 1.0000000000000004
+    ray_tnear = tmin;
     return tmin <= tmax;
 }
 
@@ -661,6 +688,9 @@ static inline bool _overlap_bbox_conservative(const ym::bbox3f& bbox1,
 // number of primitives to avoid splitting on
 #define YBVH__MINPRIMS 4
 
+// number of primitives below which the build does not use threads
+#define YBVH__PARALLEL_MINPRIMS 65536
+
 //
 // BVH tree node containing its bounds, indices to the BVH arrays of either
 // sorted primitives or internal nodes, whether its a leaf or an internal node,
@@ -681,6 +711,270 @@ struct bvhn {
     uint8_t axis;     // slit axis
 };
 
+
+//
+// Wide BVH node that stores the bounds of up to N children as SoA lanes, so
+// that a single SIMD slab test covers all children at once. Lanes refer to
+// either other wide nodes, for internal children, or to ranges of sorted
+// primitives, for leaf children. Empty lanes have invalid bounds and never
+// pass the slab test. Wide nodes are obtained by collapsing the binary tree,
+// that is always kept since the other queries walk it.
+//
+// This is not part of the public interface.
+//
+template <int N>
+struct bvhw {
+    float bbox[6][N];   // children bounds as min x,y,z and max x,y,z lanes
+    int32_t start[N];   // index to wide node or first sorted primitive
+    uint16_t count[N];  // number of primitives (0 for internal children)
+};
+
+// number of children of compressed nodes
+#define YBVH__QWIDTH 8
+
+//
+// Compressed BVH node with YBVH__QWIDTH children. Children bounds are
+// quantized to 8 bits relative to the node bounds, whose min corner is the
+// quantization origin and whose size gives a power of two scale for each
+// axis. Children are either other compressed nodes or single primitives,
+// whose index is stored inline, so compressed bvhs do not need the sorted
+// primitive array. Empty lanes have a negative index.
+//
+// This is not part of the public interface.
+//
+// Implemenetation Notes:
+// - Quantized bounds are rounded outward, so they are conservative
+// - 96 bytes for eight children, versus 32 bytes for each binary node
+//
+struct bvhq {
+    float origin[3];                   // quantization origin
+    int8_t exp[3];                     // quantization scale exponents
+    uint8_t leaf;                      // mask of lanes that store primitives
+    uint8_t qbbox[6][YBVH__QWIDTH];    // children bounds as min and max lanes
+    int32_t ref[YBVH__QWIDTH];         // index to compressed node or primitive
+};
+
+//
+// Pack of N triangles stored in SoA layout with their first vertex and edges
+// precomputed, so that leaves are intersected without gathering vertices and
+// with SIMD instructions. Packs follow the sorted primitive order, which is
+// padded so that each leaf starts at a multiple of N, so the packs of a leaf
+// start at its first primitive divided by N. Empty lanes have a negative
+// element id and degenerate edges.
+//
+// This is not part of the public interface.
+//
+template <int N>
+struct bvht {
+    float v0[3][N];    // first vertex
+    float e1[3][N];    // first edge
+    float e2[3][N];    // second edge
+    int32_t eid[N];    // element id
+};
+
+//
+// Array of bvh data, that either owns its elements or aliases external
+// memory, like a memory-mapped cache file. Aliased elements can be modified
+// in place, but are copied to owned storage before any change in size.
+// Element access is as fast as for std::vector.
+//
+// This is not part of the public interface.
+//
+template <typename T>
+struct _array {
+    // constructors and assignments
+    _array() {}
+    _array(const _array& a) { *this = a.vec(); }
+    _array(_array&& a) = default;
+    _array& operator=(const _array& a) { return (*this = a.vec()); }
+    _array& operator=(_array&& a) = default;
+    _array& operator=(const std::vector<T>& v) {
+        _vec = v;
+        _sync();
+        return *this;
+    }
+    _array& operator=(std::vector<T>&& v) {
+        _vec = std::move(v);
+        _sync();
+        return *this;
+    }
+
+    // aliases external memory
+    void alias(T* data, size_t size) {
+        _vec = {};
+        _data = data;
+        _size = size;
+        _aliased = true;
+    }
+    bool aliased() const { return _aliased; }
+
+    // element access
+    size_t size() const { return _size; }
+    bool empty() const { return !_size; }
+    T* data() { return _data; }
+    const T* data() const { return _data; }
+    T& operator[](size_t i) { return _data[i]; }
+    const T& operator[](size_t i) const { return _data[i]; }
+    T* begin() { return _data; }
+    T* end() { return _data + _size; }
+    const T* begin() const { return _data; }
+    const T* end() const { return _data + _size; }
+    std::vector<T> vec() const { return std::vector<T>(begin(), end()); }
+
+    // size changes
+    void clear() {
+        _vec.clear();
+        _sync();
+    }
+    void shrink_to_fit() {
+        _vec.shrink_to_fit();
+        _sync();
+    }
+    void reserve(size_t n) {
+        _own();
+        _vec.reserve(n);
+        _sync();
+    }
+    void resize(size_t n) {
+        _own();
+        _vec.resize(n);
+        _sync();
+    }
+    void push_back(const T& v) {
+        _own();
+        _vec.push_back(v);
+        _sync();
+    }
+    void emplace_back() {
+        _own();
+        _vec.emplace_back();
+        _sync();
+    }
+
+   private:
+    void _own() {
+        if (_aliased) _vec.assign(begin(), end());
+    }
+    void _sync() {
+        _data = _vec.data();
+        _size = _vec.size();
+        _aliased = false;
+    }
+
+    std::vector<T> _vec;     // owned elements
+    T* _data = nullptr;      // elements, either owned or aliased
+    size_t _size = 0;        // number of elements
+    bool _aliased = false;   // whether the elements are aliased
+};
+
+//
+// Storage for traversal stacks of a given size, that keeps up to N entries
+// inline and moves to the heap for larger sizes. Stacks are sized from the
+// depth of the bvh they walk, so that degenerate trees cannot overflow them
+// while pushes stay unchecked in release builds.
+//
+// This is not part of the public interface.
+//
+template <typename T, int N>
+struct _stack {
+    _stack(int size) : _size(size) {
+        if (size <= N) return;
+        _heap.resize(size);
+        _data = _heap.data();
+    }
+    _stack(const _stack&) = delete;
+    _stack& operator=(const _stack&) = delete;
+
+    T* data() { return _data; }
+    int size() const { return _size; }
+
+   private:
+    T _buffer[N];          // inline entries
+    std::vector<T> _heap;  // heap entries, used for sizes larger than N
+    T* _data = _buffer;    // entries, either inline or on the heap
+    int _size = 0;         // number of entries
+};
+
+//
+// Cache file mapped in memory, or read into a buffer where mapping is not
+// available, and aliased by the bvh arrays.
+//
+// This is not part of the public interface.
+//
+struct _cache_map {
+    void* data = nullptr;         // mapped or read data
+    size_t size = 0;              // data size
+    std::vector<uint8_t> buffer;  // read data, if not mapped
+    ~_cache_map() {
+#ifdef YBVH__MMAP
+        if (data && buffer.empty()) munmap(data, size);
+#endif
+    }
+};
+
+struct shape;
+
+//
+// Lazy shape whose data is loaded from a shape file on first use. The
+// resident shape is shared with running queries, so that evicting it frees
+// it only once they are done. Resident shapes are set and cleared only while
+// holding the scene lazy cache lock, and are linked in its use list.
+//
+// This is not part of the public interface.
+//
+struct _lazy_shape {
+    std::string filename;               // shape file
+    ym::bbox3f bbox;                    // local bounds
+    std::shared_ptr<shape> resident;    // loaded shape (atomic access)
+    size_t size = 0;                    // loaded size in bytes
+    std::atomic<uint64_t> last_use{0};  // tick of the last use
+    std::atomic<bool> failed{false};    // whether loading failed
+    std::mutex mutex;                   // serializes loads
+    _lazy_shape* prev = nullptr;        // more recently used resident shape
+    _lazy_shape* next = nullptr;        // less recently used resident shape
+};
+
+//
+// Lazy shapes residency of a scene, bounded by a memory budget with least
+// recently used eviction. Resident shapes are kept in a list from the most
+// to the least recently used.
+//
+// This is not part of the public interface.
+//
+struct _lazy_cache {
+    size_t budget = 0;              // max resident bytes (0 for no limit)
+    size_t resident = 0;            // resident bytes
+    uint64_t nloads = 0;            // number of loads
+    uint64_t nevictions = 0;        // number of evictions
+    std::atomic<uint64_t> tick{0};  // use counter
+    _lazy_shape* head = nullptr;    // most recently used resident shape
+    _lazy_shape* tail = nullptr;    // least recently used resident shape
+    std::mutex mutex;               // guards the fields above and residency
+};
+
+//
+// Removes a resident shape from the use list of a lazy cache.
+//
+static inline void _unlink_lazy(_lazy_cache* cache, _lazy_shape* lazy) {
+    if (lazy->prev) lazy->prev->next = lazy->next;
+    if (lazy->next) lazy->next->prev = lazy->prev;
+    if (cache->head == lazy) cache->head = lazy->next;
+    if (cache->tail == lazy) cache->tail = lazy->prev;
+    lazy->prev = nullptr;
+    lazy->next = nullptr;
+}
+
+//
+// Adds a resident shape at the front of the use list of a lazy cache.
+//
+static inline void _link_lazy(_lazy_cache* cache, _lazy_shape* lazy) {
+    lazy->prev = nullptr;
+    lazy->next = cache->head;
+    if (cache->head) cache->head->prev = lazy;
+    cache->head = lazy;
+    if (!cache->tail) cache->tail = lazy;
+}
+
 //
 // BVH tree, stored as a node array. The tree structure is encoded using array
 // indices instead of pointers, both for speed but also to simplify code.
@@ -695,8 +989,38 @@ struct bvhn {
 //
 struct bvh {
     // bvh data
-    std::vector<bvhn> nodes;       // sorted array of internal nodes
-    std::vector<int> sorted_prim;  // sorted elements
+    _array<bvhn> nodes;       // sorted array of internal nodes
+    _array<int> sorted_prim;  // sorted elements
+    int max_depth = 0;        // depth of the deepest leaf
+    bool dups = false;        // whether elements may be in many leaves
+
+    // wide bvh data used for ray traversal
+    int width = 2;            // node width
+    _array<bvhw<4>> wnodes4;  // wide nodes for width 4
+    _array<bvhw<8>> wnodes8;  // wide nodes for width 8
+
+    // triangle packs used for leaf intersection
+    int tpack_width = 0;      // triangles per pack (0 for no packs)
+    _array<bvht<4>> tpacks4;  // packs for width 4
+    _array<bvht<8>> tpacks8;  // packs for width 8
+
+    // update data kept for scene bvhs
+    std::vector<int> parent;           // parent of each node (-1 for root)
+    std::vector<int> depth;            // depth of each node
+    std::vector<int> prim_leaf;        // leaf of each primitive
+    std::vector<ym::vec2i> node_lane;  // wide node and lane of each node
+    std::vector<uint8_t> touched;      // nodes touched during an update
+    std::vector<ym::bbox3f> motion_bbox;  // node bounds at times 0 and 1
+    double sah_area = 0;               // sah cost times the root area
+    float build_sah = 0;               // sah cost at build
+
+    // compressed bvh data used in place of nodes and sorted_prim
+    bool compressed = false;       // whether the bvh is compressed
+    ym::bbox3f bbox;               // bvh bounds when compressed
+    _array<bvhq> qnodes;           // compressed nodes
+
+    // cache file aliased by the arrays above, if any
+    std::unique_ptr<_cache_map> cache;
 };
 
 //
@@ -707,7 +1031,8 @@ struct shape {
     int sid = -1;  // shape id
 
     // shape transform --------------------
-    ym::frame3f frame;  // shape transform
+    ym::frame3f frame;                // shape transform
+    std::vector<ym::frame3f> frames;  // motion keys evenly spaced in [0,1]
 
     // elements data ----------------------
     int nelems = 0;                       // number of elements
@@ -721,15 +1046,21 @@ struct shape {
     const ym::vec3f* pos = nullptr;  // vertex pos
     const float* radius = nullptr;   // vertex radius
 
+    // instance data ----------------------
+    const scene* instance = nullptr;  // instanced prototype scene
+
+    // lazy data --------------------------
+    std::unique_ptr<_lazy_shape> _lazy;  // lazy loading data [private]
+
     // [private] bvh data -----------------
-    bvh* _bvh = nullptr;  // bvh [private]
+    bvh* _bvh = nullptr;   // bvh [private]
+    bool _dirty = false;   // moved since the last update [private]
 
     // [private] methods ------------------
     float rad(int i) const { return (radius) ? radius[i] : 0; }
-    ym::bbox3f local_bbox() const { return _bvh->nodes[0].bbox; }
-    ym::bbox3f world_bbox() const {
-        return ym::transform_bbox(frame, _bvh->nodes[0].bbox);
-    }
+    ym::bbox3f local_bbox() const;
+    ym::bbox3f world_bbox() const;
+    ym::frame3f frame_at(float time) const;
 
     // destructor
     ~shape();
@@ -743,12 +1074,49 @@ struct scene {
     std::vector<shape*> shapes;  // shapes
 
     // bvh private data -------------------
-    bvh* _bvh = nullptr;  // bvh [private]
+    bvh* _bvh = nullptr;     // bvh [private]
+    build_params _params;    // build params used for rebuilds [private]
+    std::unique_ptr<_lazy_cache> _lazy;  // lazy shapes residency [private]
 
     // destructor
     ~scene();
 };
 
+//
+// Shape bounds in its local frame, that are the prototype bounds for
+// instances and the file bounds for lazy shapes.
+//
+inline ym::bbox3f shape::local_bbox() const {
+    if (instance) return instance->_bvh->nodes[0].bbox;
+    if (_lazy) return _lazy->bbox;
+    return (_bvh->compressed) ? _bvh->bbox : _bvh->nodes[0].bbox;
+}
+
+//
+// Shape bounds in world space. For moving shapes, these are the bounds over
+// all times, since each point moves linearly between keys.
+//
+inline ym::bbox3f shape::world_bbox() const {
+    auto bbox = ym::transform_bbox(frame, local_bbox());
+    for (auto& key : frames) bbox += ym::transform_bbox(key, local_bbox());
+    return bbox;
+}
+
+//
+// Shape frame at a time in [0,1], interpolating the motion keys as affine
+// matrices. Frames are not rigid between keys, but bounds of the keys bound
+// the shape in between.
+//
+inline ym::frame3f shape::frame_at(float time) const {
+    if (frames.size() < 2) return frame;
+    auto t = ym::clamp(time, 0.0f, 1.0f) * (frames.size() - 1);
+    auto k = ym::min((int)t, (int)frames.size() - 2);
+    const auto &a = frames[k], &b = frames[k + 1];
+    auto u = t - k;
+    return {ym::lerp(a[0], b[0], u), ym::lerp(a[1], b[1], u),
+        ym::lerp(a[2], b[2], u), ym::lerp(a[3], b[3], u)};
+}
+
 //
 // Init scene.
 //
@@ -778,6 +1146,22 @@ YBVH_API shape::~shape() {
     if (_bvh) delete _bvh;
 }
 
+//
+// Clears the lazy data of a shape, removing its resident data from the scene
+// lazy cache.
+//
+static inline void _clear_lazy(scene* scn, shape* shp) {
+    if (!shp->_lazy) return;
+    std::lock_guard<std::mutex> lock(scn->_lazy->mutex);
+    auto resident = std::atomic_exchange(
+        &shp->_lazy->resident, std::shared_ptr<shape>());
+    if (resident) {
+        scn->_lazy->resident -= shp->_lazy->size;
+        _unlink_lazy(scn->_lazy.get(), shp->_lazy.get());
+    }
+    shp->_lazy = nullptr;
+}
+
 //
 // Set shape. Public API.
 //
@@ -786,6 +1170,7 @@ YBVH_API void set_point_shape(scene* scn, int sid, const float3x4& frame,
     const float* radius) {
     scn->shapes[sid]->sid = sid;
     scn->shapes[sid]->frame = frame;
+    scn->shapes[sid]->frames.clear();
     scn->shapes[sid]->nelems = npoints;
     scn->shapes[sid]->point = (const int*)point;
     scn->shapes[sid]->line = nullptr;
@@ -794,7 +1179,10 @@ YBVH_API void set_point_shape(scene* scn, int sid, const float3x4& frame,
     scn->shapes[sid]->nverts = nverts;
     scn->shapes[sid]->pos = (const ym::vec3f*)pos;
     scn->shapes[sid]->radius = radius;
+    scn->shapes[sid]->instance = nullptr;
     if (scn->shapes[sid]->_bvh) delete scn->shapes[sid]->_bvh;
+    scn->shapes[sid]->_bvh = nullptr;
+    _clear_lazy(scn, scn->shapes[sid]);
 }
 
 //
@@ -805,6 +1193,7 @@ YBVH_API void set_line_shape(scene* scn, int sid, const float3x4& frame,
     const float* radius) {
     scn->shapes[sid]->sid = sid;
     scn->shapes[sid]->frame = frame;
+    scn->shapes[sid]->frames.clear();
     scn->shapes[sid]->nelems = nlines;
     scn->shapes[sid]->point = nullptr;
     scn->shapes[sid]->line = (const ym::vec2i*)lines;
@@ -813,7 +1202,10 @@ YBVH_API void set_line_shape(scene* scn, int sid, const float3x4& frame,
     scn->shapes[sid]->nverts = nverts;
     scn->shapes[sid]->pos = (const ym::vec3f*)pos;
     scn->shapes[sid]->radius = radius;
+    scn->shapes[sid]->instance = nullptr;
     if (scn->shapes[sid]->_bvh) delete scn->shapes[sid]->_bvh;
+    scn->shapes[sid]->_bvh = nullptr;
+    _clear_lazy(scn, scn->shapes[sid]);
 }
 
 //
@@ -824,6 +1216,7 @@ YBVH_API void set_triangle_shape(scene* scn, int sid, const float3x4& frame,
     const float* radius) {
     scn->shapes[sid]->sid = sid;
     scn->shapes[sid]->frame = frame;
+    scn->shapes[sid]->frames.clear();
     scn->shapes[sid]->nelems = ntriangles;
     scn->shapes[sid]->point = nullptr;
     scn->shapes[sid]->line = nullptr;
@@ -832,7 +1225,10 @@ YBVH_API void set_triangle_shape(scene* scn, int sid, const float3x4& frame,
     scn->shapes[sid]->nverts = nverts;
     scn->shapes[sid]->pos = (const ym::vec3f*)pos;
     scn->shapes[sid]->radius = radius;
+    scn->shapes[sid]->instance = nullptr;
     if (scn->shapes[sid]->_bvh) delete scn->shapes[sid]->_bvh;
+    scn->shapes[sid]->_bvh = nullptr;
+    _clear_lazy(scn, scn->shapes[sid]);
 }
 
 //
@@ -843,6 +1239,7 @@ YBVH_API void set_tetra_shape(scene* scn, int sid, const float3x4& frame,
     const float* radius) {
     scn->shapes[sid]->sid = sid;
     scn->shapes[sid]->frame = frame;
+    scn->shapes[sid]->frames.clear();
     scn->shapes[sid]->nelems = ntetra;
     scn->shapes[sid]->point = nullptr;
     scn->shapes[sid]->line = nullptr;
@@ -851,7 +1248,10 @@ YBVH_API void set_tetra_shape(scene* scn, int sid, const float3x4& frame,
     scn->shapes[sid]->nverts = nverts;
     scn->shapes[sid]->pos = (const ym::vec3f*)pos;
     scn->shapes[sid]->radius = radius;
+    scn->shapes[sid]->instance = nullptr;
     if (scn->shapes[sid]->_bvh) delete scn->shapes[sid]->_bvh;
+    scn->shapes[sid]->_bvh = nullptr;
+    _clear_lazy(scn, scn->shapes[sid]);
 }
 
 //
@@ -861,6 +1261,7 @@ YBVH_API void set_point_shape(scene* scn, int sid, const float3x4& frame,
     int nverts, const float3* pos, const float* radius) {
     scn->shapes[sid]->sid = sid;
     scn->shapes[sid]->frame = frame;
+    scn->shapes[sid]->frames.clear();
     scn->shapes[sid]->nelems = nverts;
     scn->shapes[sid]->point = nullptr;
     scn->shapes[sid]->line = nullptr;
@@ -869,14 +1270,55 @@ YBVH_API void set_point_shape(scene* scn, int sid, const float3x4& frame,
     scn->shapes[sid]->nverts = nverts;
     scn->shapes[sid]->pos = (const ym::vec3f*)pos;
     scn->shapes[sid]->radius = radius;
+    scn->shapes[sid]->instance = nullptr;
+    if (scn->shapes[sid]->_bvh) delete scn->shapes[sid]->_bvh;
+    scn->shapes[sid]->_bvh = nullptr;
+    _clear_lazy(scn, scn->shapes[sid]);
+}
+
+//
+// Set instance. Public API.
+//
+YBVH_API void set_instance(
+    scene* scn, int sid, const float3x4& frame, const scene* prototype) {
+    scn->shapes[sid]->sid = sid;
+    scn->shapes[sid]->frame = frame;
+    scn->shapes[sid]->frames.clear();
+    scn->shapes[sid]->nelems = 0;
+    scn->shapes[sid]->point = nullptr;
+    scn->shapes[sid]->line = nullptr;
+    scn->shapes[sid]->triangle = nullptr;
+    scn->shapes[sid]->tetra = nullptr;
+    scn->shapes[sid]->nverts = 0;
+    scn->shapes[sid]->pos = nullptr;
+    scn->shapes[sid]->radius = nullptr;
+    scn->shapes[sid]->instance = prototype;
     if (scn->shapes[sid]->_bvh) delete scn->shapes[sid]->_bvh;
+    scn->shapes[sid]->_bvh = nullptr;
+    _clear_lazy(scn, scn->shapes[sid]);
 }
 
 //
 // Set shape. Public API.
 //
 YBVH_API void set_shape_frame(scene* scn, int sid, const float3x4& frame) {
-    scn->shapes[sid]->frame = frame;
+    auto shp = scn->shapes[sid];
+    if (shp->frame == ym::frame3f(frame) && shp->frames.empty()) return;
+    shp->frame = frame;
+    shp->frames.clear();
+    shp->_dirty = true;
+}
+
+//
+// Set shape motion keys. Public API.
+//
+YBVH_API void set_shape_frames(
+    scene* scn, int sid, int nkeys, const float3x4* frames) {
+    auto shp = scn->shapes[sid];
+    shp->frame = frames[0];
+    shp->frames.assign((const ym::frame3f*)frames,
+        (const ym::frame3f*)frames + ((nkeys > 1) ? nkeys : 0));
+    shp->_dirty = true;
 }
 
 // -----------------------------------------------------------------------------
@@ -913,14 +1355,117 @@ struct _bound_prim_comp {
     }
 };
 
+//
+// Runs func(i) for i in [0, count) on nthreads threads that pick indices in
+// order. Used by the build since ybvh does not depend on a thread pool.
+//
+template <typename Func>
+static inline void _parallel_for(int count, int nthreads, const Func& func) {
+    if (nthreads <= 1 || count <= 1) {
+        for (auto i = 0; i < count; i++) func(i);
+        return;
+    }
+    std::atomic<int> next(0);
+    auto threads = std::vector<std::thread>();
+    for (auto t = 0; t < std::min(nthreads, count); t++) {
+        threads.push_back(std::thread([&func, &next, count]() {
+            while (true) {
+                auto i = next.fetch_add(1);
+                if (i >= count) break;
+                func(i);
+            }
+        }));
+    }
+    for (auto& t : threads) t.join();
+}
+
+//
+// Number of threads to use for a range of primitives.
+//
+static inline int _range_threads(int start, int end, int nthreads) {
+    return (end - start < YBVH__PARALLEL_MINPRIMS) ? 1 : nthreads;
+}
+
+//
+// Computes the bounds of the primitives, or of their centers, between start
+// and end. Large ranges are split into chunks bounded in parallel.
+//
+static inline ym::bbox3f _bound_prims(const _bound_prim* sorted_prim,
+    int start, int end, bool centers, int nthreads) {
+    nthreads = _range_threads(start, end, nthreads);
+    auto chunk_bbox = std::vector<ym::bbox3f>(nthreads, ym::invalid_bbox3f);
+    _parallel_for(nthreads, nthreads, [&](int c) {
+        auto cstart = start + (int)((int64_t)(end - start) * c / nthreads);
+        auto cend = start + (int)((int64_t)(end - start) * (c + 1) / nthreads);
+        auto bbox = ym::invalid_bbox3f;
+        if (centers) {
+            for (auto i = cstart; i < cend; i++) bbox += sorted_prim[i].center;
+        } else {
+            for (auto i = cstart; i < cend; i++) bbox += sorted_prim[i].bbox;
+        }
+        chunk_bbox[c] = bbox;
+    });
+    auto bbox = ym::invalid_bbox3f;
+    for (auto& cbbox : chunk_bbox) bbox += cbbox;
+    return bbox;
+}
+
+// number of bins for binned sah
+#define YBVH__NBINS 16
+
+//
+// Bin index of a primitive for binned sah.
+//
+static inline int _bin_prim(const _bound_prim& prim,
+    const ym::bbox3f& centroid_bbox, const ym::vec3f& centroid_size,
+    int axis) {
+    auto b = (int)(YBVH__NBINS * (prim.center[axis] - centroid_bbox[0][axis]) /
+                   centroid_size[axis]);
+    return ym::clamp(b, 0, YBVH__NBINS - 1);
+}
+
+//
+// Bins the primitives between start and end along an axis, accumulating
+// bins bounds and counts. Large ranges are binned in parallel.
+//
+static inline void _bin_prims(const _bound_prim* sorted_prim, int start,
+    int end, const ym::bbox3f& centroid_bbox, const ym::vec3f& centroid_size,
+    int axis, ym::bbox3f* bins_bbox, int* bins_count, int nthreads) {
+    nthreads = _range_threads(start, end, nthreads);
+    auto chunk_bbox =
+        std::vector<ym::bbox3f>(nthreads * YBVH__NBINS, ym::invalid_bbox3f);
+    auto chunk_count = std::vector<int>(nthreads * YBVH__NBINS, 0);
+    _parallel_for(nthreads, nthreads, [&](int c) {
+        auto cstart = start + (int)((int64_t)(end - start) * c / nthreads);
+        auto cend = start + (int)((int64_t)(end - start) * (c + 1) / nthreads);
+        auto cbbox = chunk_bbox.data() + c * YBVH__NBINS;
+        auto ccount = chunk_count.data() + c * YBVH__NBINS;
+        for (auto i = cstart; i < cend; i++) {
+            auto b =
+                _bin_prim(sorted_prim[i], centroid_bbox, centroid_size, axis);
+            ccount[b] += 1;
+            cbbox[b] += sorted_prim[i].bbox;
+        }
+    });
+    for (auto b = 0; b < YBVH__NBINS; b++) {
+        bins_bbox[b] = ym::invalid_bbox3f;
+        bins_count[b] = 0;
+        for (auto c = 0; c < nthreads; c++) {
+            bins_bbox[b] += chunk_bbox[c * YBVH__NBINS + b];
+            bins_count[b] += chunk_count[c * YBVH__NBINS + b];
+        }
+    }
+}
+
 //
 // Given an array sorted_prim of primitives to split between the elements
 // start and end, determines the split axis axis, split primitive index mid
 // based on the heuristic heuristic. Supports balanced tree (equalnum) and
-// Surface-Area Heuristic.
+// Surface-Area Heuristic. Large ranges are bounded and binned in parallel
+// on nthreads threads.
 //
 static inline bool _partition_prims(_bound_prim* sorted_prim, int start,
-    int end, int& axis, int& mid, heuristic_type htype) {
+    int end, int& axis, int& mid, heuristic_type htype, int nthreads = 1) {
     // internal function
     auto bbox_area = [](auto r) {
         const auto __box_eps = 1e-12f;
@@ -934,8 +1479,7 @@ static inline bool _partition_prims(_bound_prim* sorted_prim, int start,
     mid = (start + end) / 2;
 
     // compute primintive bounds and size
-    auto centroid_bbox = ym::invalid_bbox3f;
-    for (auto i = start; i < end; i++) centroid_bbox += sorted_prim[i].center;
+    auto centroid_bbox = _bound_prims(sorted_prim, start, end, true, nthreads);
     auto centroid_size = ym::diagonal(centroid_bbox);
 
     // check if it is not possible to split
@@ -1011,27 +1555,11 @@ static inline bool _partition_prims(_bound_prim* sorted_prim, int start,
         // performance
         case heuristic_type::binned_sah: {
             // allocate bins
-            const auto nbins = 16;
+            const auto nbins = YBVH__NBINS;
             ym::bbox3f bins_bbox[nbins];
             int bins_count[nbins];
-            for (int b = 0; b < nbins; b++) {
-                bins_bbox[b] = ym::invalid_bbox3f;
-                // bins_bbox[b] = centroid_bbox;
-                // bins_bbox[b].min[largest_axis] += b *
-                // centroid_size[largest_axis] / nbins;
-                // bins_bbox[b].max[largest_axis] -= (nbins - 1 - b) *
-                // centroid_size[largest_axis] / nbins;
-                bins_count[b] = 0;
-            }
-            for (int i = start; i < end; i++) {
-                auto b = (int)(nbins *
-                               (sorted_prim[i].center[largest_axis] -
-                                   centroid_bbox[0][largest_axis]) /
-                               centroid_size[largest_axis]);
-                b = ym::clamp(b, 0, nbins - 1);
-                bins_count[b] += 1;
-                bins_bbox[b] += sorted_prim[i].bbox;
-            }
+            _bin_prims(sorted_prim, start, end, centroid_bbox, centroid_size,
+                largest_axis, bins_bbox, bins_count, nthreads);
             float min_cost = HUGE_VALF;
             int bin_idx = -1;
             for (int b = 1; b < nbins; b++) {
@@ -1063,8 +1591,13 @@ static inline bool _partition_prims(_bound_prim* sorted_prim, int start,
             mid = start;
             for (int b = 0; b < bin_idx; b++) { mid += bins_count[b]; }
             assert(axis >= 0 && mid > 0);
-            std::nth_element(sorted_prim + start, sorted_prim + mid,
-                sorted_prim + end, _bound_prim_comp(largest_axis));
+            // partition by bin, which gives the same split as sorting
+            // since bins are ordered along the axis
+            std::partition(sorted_prim + start, sorted_prim + end,
+                [&](const _bound_prim& prim) {
+                    return _bin_prim(prim, centroid_bbox, centroid_size,
+                               largest_axis) < bin_idx;
+                });
         } break;
         default: assert(false); break;
     }
@@ -1122,171 +1655,2435 @@ static inline void _make_node(bvhn& node, std::vector<bvhn>& nodes,
 }
 
 //
-// Build a BVH from a set of primitives.
+// Subtree built independently during a parallel build. Nodes are stored with
+// the subtree root first, laid out as _make_node would.
 //
-YBVH_API void _build_bvh(
-    bvh* bvh, int nprims, _bound_prim* bound_prims, heuristic_type htype) {
-    // clear bvh
-    bvh->nodes.clear();
-    bvh->sorted_prim.clear();
-
-    // allocate nodes (over-allocate now then shrink)
-    bvh->nodes.reserve(nprims * 2);
+struct _build_task {
+    int start = 0;             // primitive start
+    int end = 0;               // primitive end
+    std::vector<bvhn> nodes;   // subtree nodes
+};
 
-    // start recursive splitting
-    bvh->nodes.emplace_back();
-    _make_node(bvh->nodes[0], bvh->nodes, bound_prims, 0, nprims, htype);
+//
+// Node of the top levels of a parallel build. Either an internal node with
+// two children or a subtree task.
+//
+struct _build_top {
+    ym::bbox3f bbox = ym::invalid_bbox3f;   // bounds
+    int axis = 0;                           // split axis
+    int children[2] = {-1, -1};             // children top nodes
+    int task = -1;                          // subtree task
+};
 
-    // shrink back
-    bvh->nodes.shrink_to_fit();
+//
+// Splits the top levels of the tree, using threads in each split, until
+// ranges are small enough to become subtree tasks. Splits are the same as
+// _make_node.
+//
+static inline void _make_top_node(std::vector<_build_top>& top, int tid,
+    std::vector<_build_task>& tasks, _bound_prim* sorted_prims, int start,
+    int end, heuristic_type htype, int task_size, int nthreads) {
+    // make a task for small ranges
+    auto axis = 0, mid = 0;
+    auto split = end - start > task_size &&
+                 _partition_prims(
+                     sorted_prims, start, end, axis, mid, htype, nthreads);
+    if (!split) {
+        top[tid].task = (int)tasks.size();
+        tasks.emplace_back();
+        tasks.back().start = start;
+        tasks.back().end = end;
+        return;
+    }
 
-    // init sorted element arrays
-    // for shared memory, stored pointer to the external data
-    // store the sorted primitive order for BVH walk
-    bvh->sorted_prim.resize(nprims);
-    for (int i = 0; i < nprims; i++) {
-        bvh->sorted_prim[i] = bound_prims[i].pid;
+    // make an internal node
+    top[tid].bbox = _bound_prims(sorted_prims, start, end, false, nthreads);
+    top[tid].axis = axis;
+    for (auto c = 0; c < 2; c++) {
+        top[tid].children[c] = (int)top.size();
+        top.emplace_back();
     }
+    _make_top_node(top, top[tid].children[0], tasks, sorted_prims, start, mid,
+        htype, task_size, nthreads);
+    _make_top_node(top, top[tid].children[1], tasks, sorted_prims, mid, end,
+        htype, task_size, nthreads);
 }
 
 //
-// Gets the bbox of a shape element
-//
-static inline ym::bbox3f _bound_elem(const shape* shp, int eid) {
-    if (shp->point) {
-        auto f = shp->point[eid];
-        return _bound_point(shp->pos[f], shp->rad(f));
-    } else if (shp->line) {
-        auto f = shp->line[eid];
-        return _bound_line(
-            shp->pos[f[0]], shp->pos[f[1]], shp->rad(f[0]), shp->rad(f[1]));
-    } else if (shp->triangle) {
-        auto f = shp->triangle[eid];
-        return _bound_triangle(shp->pos[f[0]], shp->pos[f[1]], shp->pos[f[2]]);
-    } else if (shp->tetra) {
-        auto f = shp->tetra[eid];
-        return _bound_tetrahedron(
-            shp->pos[f[0]], shp->pos[f[1]], shp->pos[f[2]], shp->pos[f[3]]);
+// Copies the top levels and the subtree tasks into the bvh nodes in the same
+// order used by _make_node. A subtree expands contiguously, so its local
+// node k > 0 ends up at base + k - 1, with base the number of nodes when the
+// subtree is reached.
+//
+static inline void _emit_top_node(std::vector<bvhn>& nodes,
+    const std::vector<_build_top>& top, int tid,
+    const std::vector<_build_task>& tasks, int nid) {
+    if (top[tid].task >= 0) {
+        const auto& task_nodes = tasks[top[tid].task].nodes;
+        auto base = (int)nodes.size();
+        auto remap = [base](bvhn node) {
+            if (!node.isleaf) node.start = base + node.start - 1;
+            return node;
+        };
+        nodes[nid] = remap(task_nodes[0]);
+        for (auto k = 1; k < (int)task_nodes.size(); k++)
+            nodes.push_back(remap(task_nodes[k]));
     } else {
-        return _bound_point(shp->pos[eid], shp->rad(eid));
+        auto start = (int)nodes.size();
+        auto& node = nodes[nid];
+        node.bbox = top[tid].bbox;
+        node.isleaf = false;
+        node.axis = top[tid].axis;
+        node.start = start;
+        node.count = 2;
+        nodes.emplace_back();
+        nodes.emplace_back();
+        _emit_top_node(nodes, top, top[tid].children[0], tasks, start);
+        _emit_top_node(nodes, top, top[tid].children[1], tasks, start + 1);
     }
 }
 
 //
-// Build a shape BVH. Public function whose interface is described above.
-//
-YBVH_API void build_bvh(shape* shp, heuristic_type htype) {
-    // create bounded primitives used in BVH build
-    auto bound_prims = std::vector<_bound_prim>(shp->nelems);
-    for (auto i = 0; i < bound_prims.size(); i++) {
-        bound_prims[i].pid = i;
-        bound_prims[i].bbox = _bound_elem(shp, i);
-        bound_prims[i].center = ym::center(bound_prims[i].bbox);
-    }
-
-    // tree bvh
-    if (!shp->_bvh) shp->_bvh = new bvh();
-    return _build_bvh(
-        shp->_bvh, (int)bound_prims.size(), bound_prims.data(), htype);
+// Builds the bvh nodes on multiple threads. The top levels are split with
+// parallel bounds and binning, then the remaining subtrees are built as
+// independent tasks and copied back in depth-first order, so that the node
+// layout is the same as the serial build.
+//
+static inline void _make_nodes_parallel(std::vector<bvhn>& nodes,
+    _bound_prim* sorted_prims, int nprims, heuristic_type htype,
+    int nthreads) {
+    // split top levels
+    auto task_size =
+        std::max(YBVH__PARALLEL_MINPRIMS / 16, nprims / (nthreads * 16));
+    auto top = std::vector<_build_top>(1);
+    auto tasks = std::vector<_build_task>();
+    _make_top_node(top, 0, tasks, sorted_prims, 0, nprims, htype, task_size,
+        nthreads);
+
+    // build subtrees, largest first for load balancing
+    auto order = std::vector<int>(tasks.size());
+    for (auto i = 0; i < (int)order.size(); i++) order[i] = i;
+    std::sort(order.begin(), order.end(), [&tasks](int a, int b) {
+        return tasks[a].end - tasks[a].start > tasks[b].end - tasks[b].start;
+    });
+    _parallel_for((int)tasks.size(), nthreads, [&](int i) {
+        auto& task = tasks[order[i]];
+        task.nodes.reserve((task.end - task.start) * 2);
+        task.nodes.emplace_back();
+        _make_node(task.nodes[0], task.nodes, sorted_prims, task.start,
+            task.end, htype);
+    });
+
+    // copy nodes
+    nodes.emplace_back();
+    _emit_top_node(nodes, top, 0, tasks, 0);
 }
 
 //
-// Build a scene BVH. Public function whose interface is described above.
+// Spreads the lowest bits of x so that they are 3 bits apart, for 30 and 63
+// bits morton codes.
 //
-YBVH_API void build_bvh(scene* scn, heuristic_type htype, bool do_shapes) {
-    // do shapes
-    if (do_shapes) {
-        for (auto shp : scn->shapes) build_bvh(shp, htype);
+static inline uint64_t _morton_expand(uint64_t x, int nbits) {
+    if (nbits <= 10) {
+        x &= 0x3ff;
+        x = (x | (x << 16)) & 0x030000ff;
+        x = (x | (x << 8)) & 0x0300f00f;
+        x = (x | (x << 4)) & 0x030c30c3;
+        x = (x | (x << 2)) & 0x09249249;
+    } else {
+        x &= 0x1fffff;
+        x = (x | (x << 32)) & 0x001f00000000ffffull;
+        x = (x | (x << 16)) & 0x001f0000ff0000ffull;
+        x = (x | (x << 8)) & 0x100f00f00f00f00full;
+        x = (x | (x << 4)) & 0x10c30c30c30c30c3ull;
+        x = (x | (x << 2)) & 0x1249249249249249ull;
     }
+    return x;
+}
 
-    // create bounded primitives used in BVH build
-    auto bound_prims = std::vector<_bound_prim>(scn->shapes.size());
-    for (auto i = 0; i < bound_prims.size(); i++) {
-        bound_prims[i].pid = i;
-        bound_prims[i].bbox = scn->shapes[i]->world_bbox();
-        bound_prims[i].center = ym::center(bound_prims[i].bbox);
+//
+// Sorts keys and values by key with a least significant digit radix sort on
+// the lowest nbits of the keys. Each pass builds per-chunk histograms and
+// scatters in parallel, so the sort is stable and does not depend on the
+// number of threads.
+//
+static inline void _radix_sort(std::vector<uint64_t>& keys,
+    std::vector<int>& values, int nbits, int nthreads) {
+    const auto ndigits = 256;
+    auto n = (int)keys.size();
+    auto nchunks = _range_threads(0, n, nthreads);
+    auto keys_tmp = std::vector<uint64_t>(n);
+    auto values_tmp = std::vector<int>(n);
+    auto offsets = std::vector<int>(nchunks * ndigits);
+    auto chunk_start = [n, nchunks](int c) {
+        return (int)((int64_t)n * c / nchunks);
+    };
+    for (auto shift = 0; shift < nbits; shift += 8) {
+        // histograms
+        std::fill(offsets.begin(), offsets.end(), 0);
+        _parallel_for(nchunks, nchunks, [&](int c) {
+            auto coffsets = offsets.data() + c * ndigits;
+            for (auto i = chunk_start(c); i < chunk_start(c + 1); i++)
+                coffsets[(keys[i] >> shift) & 0xff] += 1;
+        });
+        // prefix sums in digit then chunk order
+        auto sum = 0;
+        for (auto d = 0; d < ndigits; d++) {
+            for (auto c = 0; c < nchunks; c++) {
+                auto count = offsets[c * ndigits + d];
+                offsets[c * ndigits + d] = sum;
+                sum += count;
+            }
+        }
+        // scatter
+        _parallel_for(nchunks, nchunks, [&](int c) {
+            auto coffsets = offsets.data() + c * ndigits;
+            for (auto i = chunk_start(c); i < chunk_start(c + 1); i++) {
+                auto idx = coffsets[(keys[i] >> shift) & 0xff]++;
+                keys_tmp[idx] = keys[i];
+                values_tmp[idx] = values[i];
+            }
+        });
+        std::swap(keys, keys_tmp);
+        std::swap(values, values_tmp);
     }
-
-    // tree bvh
-    if (!scn->_bvh) scn->_bvh = new bvh();
-    _build_bvh(scn->_bvh, (int)bound_prims.size(), bound_prims.data(), htype);
 }
 
 //
-// Recursively recomputes the node bounds for a shape bvh
+// Initializes the node from the primitives between start and end sorted by
+// morton code. Ranges are split at the highest bit where the codes of the
+// first and last primitive differ, which is found with a binary search.
+// Nodes are added in the same order as _make_node and bounds are computed
+// bottom up.
 //
-static inline void _refit_bvh(scene* scn, int sid, int nodeid, bool do_shapes) {
-    // get shape and bvh
-    auto shp = (sid < 0) ? nullptr : scn->shapes[sid];
-    auto bvh = (!shp) ? scn->_bvh : shp->_bvh;
+static inline void _make_morton_node(std::vector<bvhn>& nodes, int nid,
+    const _bound_prim* sorted_prims, const uint64_t* codes, int start,
+    int end) {
+    // make a leaf
+    if (end - start <= YBVH__MINPRIMS) {
+        auto& node = nodes[nid];
+        node.bbox = ym::invalid_bbox3f;
+        for (auto i = start; i < end; i++) node.bbox += sorted_prims[i].bbox;
+        node.isleaf = true;
+        node.start = start;
+        node.count = end - start;
+        return;
+    }
 
-    // refit
-    auto node = &bvh->nodes[nodeid];
-    node->bbox = ym::invalid_bbox3f;
-    if (node->isleaf) {
-        if (!shp) {
-            for (auto i = 0; i < node->count; i++) {
-                auto idx = bvh->sorted_prim[node->start + i];
-                if (do_shapes) _refit_bvh(scn, idx, 0, false);
-                node->bbox += scn->shapes[idx]->world_bbox();
-            }
-        } else {
-            for (auto i = 0; i < node->count; i++) {
-                auto idx = bvh->sorted_prim[node->start + i];
-                node->bbox += _bound_elem(shp, idx);
+    // find the split; identical codes are split in the middle
+    auto axis = 0, mid = (start + end) / 2;
+    auto diff = codes[start] ^ codes[end - 1];
+    if (diff) {
+        auto bit = 63;
+        while (!(diff & (1ull << bit))) bit--;
+        axis = 2 - bit % 3;
+        auto lo = start, hi = end - 1;
+        while (lo + 1 < hi) {
+            auto m = (lo + hi) / 2;
+            if (codes[m] & (1ull << bit)) {
+                hi = m;
+            } else {
+                lo = m;
             }
         }
-    } else {
-        for (auto i = 0; i < node->count; i++) {
-            auto idx = node->start + i;
-            _refit_bvh(scn, sid, idx, do_shapes);
-            node->bbox += bvh->nodes[i].bbox;
-        }
+        mid = hi;
     }
+
+    // make an internal node
+    auto children = (int)nodes.size();
+    nodes.emplace_back();
+    nodes.emplace_back();
+    _make_morton_node(nodes, children, sorted_prims, codes, start, mid);
+    _make_morton_node(nodes, children + 1, sorted_prims, codes, mid, end);
+    auto& node = nodes[nid];
+    node.bbox = nodes[children].bbox;
+    node.bbox += nodes[children + 1].bbox;
+    node.isleaf = false;
+    node.axis = axis;
+    node.start = children;
+    node.count = 2;
 }
 
 //
-// Refits a scene BVH. Public function whose interface is described above.
+// Builds a linear bvh. Primitive centers are quantized in their bounds,
+// sorted by morton code with a parallel radix sort, and the tree is emitted
+// in one pass over the sorted codes. Codes use 30 bits, or 63 bits for large
+// inputs.
 //
-YBVH_API void refit_bvh(scene* scn, int sid) {
-    return _refit_bvh(scn, sid, 0, false);
-}
+static inline void _make_nodes_morton(std::vector<bvhn>& nodes,
+    _bound_prim* sorted_prims, int nprims, int nthreads) {
+    // compute codes
+    auto nbits = (nprims < (1 << 20)) ? 10 : 21;
+    auto centroid_bbox = _bound_prims(sorted_prims, 0, nprims, true, nthreads);
+    auto centroid_size = ym::diagonal(centroid_bbox);
+    auto codes = std::vector<uint64_t>(nprims);
+    auto order = std::vector<int>(nprims);
+    auto nchunks = _range_threads(0, nprims, nthreads);
+    _parallel_for(nchunks, nchunks, [&](int c) {
+        auto start = (int)((int64_t)nprims * c / nchunks);
+        auto end = (int)((int64_t)nprims * (c + 1) / nchunks);
+        auto scale = (float)((1 << nbits) - 1);
+        for (auto i = start; i < end; i++) {
+            uint64_t code = 0;
+            for (auto a = 0; a < 3; a++) {
+                auto q = (centroid_size[a] > 0) ?
+                             (sorted_prims[i].center[a] -
+                                 centroid_bbox[0][a]) /
+                                 centroid_size[a] :
+                             0.0f;
+                auto qi = (uint64_t)ym::clamp(q * scale, 0.0f, scale);
+                code |= _morton_expand(qi, nbits) << (2 - a);
+            }
+            codes[i] = code;
+            order[i] = i;
+        }
+    });
+
+    // sort and reorder primitives
+    _radix_sort(codes, order, nbits * 3, nthreads);
+    auto unsorted_prims =
+        std::vector<_bound_prim>(sorted_prims, sorted_prims + nprims);
+    for (auto i = 0; i < nprims; i++)
+        sorted_prims[i] = unsorted_prims[order[i]];
+
+    // emit tree
+    nodes.emplace_back();
+    _make_morton_node(nodes, 0, sorted_prims, codes.data(), 0, nprims);
+}
+
+//
+// Number of threads from build params.
+//
+static inline int _build_threads(const build_params& params) {
+    if (params.nthreads > 0) return params.nthreads;
+    return std::max(1, (int)std::thread::hardware_concurrency());
+}
+
+//
+// Surface area of a bounding box.
+//
+static inline float _bbox_area(const ym::bbox3f& bbox) {
+    auto size = ym::diagonal(bbox);
+    return 2 * (size[0] * size[1] + size[1] * size[2] + size[2] * size[0]);
+}
+
+// number of bins for spatial splits
+#define YBVH__SPATIAL_NBINS 16
+
+// max depth of spatial splits
+#define YBVH__SPATIAL_MAXDEPTH 48
+
+//
+// Intersection of two bounding boxes.
+//
+static inline ym::bbox3f _intersect_bbox(
+    const ym::bbox3f& a, const ym::bbox3f& b) {
+    auto bbox = a;
+    for (auto i = 0; i < 3; i++) {
+        bbox[0][i] = ym::max(a[0][i], b[0][i]);
+        bbox[1][i] = ym::min(a[1][i], b[1][i]);
+    }
+    return bbox;
+}
+
+//
+// Splits the bounds of a primitive reference, with bounds bbox, by the plane
+// at pos along axis. Triangles are clipped exactly, while other primitives
+// have their bounds clipped. Empty sides have invalid bounds.
+//
+static inline void _clip_ref(const shape* shp, const _bound_prim& ref,
+    int axis, float pos, ym::bbox3f& left, ym::bbox3f& right) {
+    if (shp && shp->triangle) {
+        left = ym::invalid_bbox3f;
+        right = ym::invalid_bbox3f;
+        auto f = shp->triangle[ref.pid];
+        for (auto i = 0; i < 3; i++) {
+            auto v = shp->pos[f[i]], w = shp->pos[f[(i + 1) % 3]];
+            if (v[axis] <= pos) left += v;
+            if (v[axis] >= pos) right += v;
+            if ((v[axis] < pos && w[axis] > pos) ||
+                (v[axis] > pos && w[axis] < pos)) {
+                auto t = (pos - v[axis]) / (w[axis] - v[axis]);
+                auto p = v + (w - v) * t;
+                p[axis] = pos;
+                left += p;
+                right += p;
+            }
+        }
+        left = _intersect_bbox(left, ref.bbox);
+        right = _intersect_bbox(right, ref.bbox);
+    } else {
+        left = ref.bbox;
+        right = ref.bbox;
+    }
+    left[1][axis] = ym::min(left[1][axis], pos);
+    right[0][axis] = ym::max(right[0][axis], pos);
+    if (left[0][axis] > left[1][axis]) left = ym::invalid_bbox3f;
+    if (right[0][axis] > right[1][axis]) right = ym::invalid_bbox3f;
+}
+
+//
+// Split candidate for the spatial split build.
+//
+struct _sbvh_split {
+    float cost = HUGE_VALF;        // sah cost
+    int axis = -1;                 // split axis
+    float pos = 0;                 // split position
+    bool spatial = false;          // whether this is a spatial split
+    ym::bbox3f left, right;        // children bounds
+    int nleft = 0, nright = 0;     // children references
+};
+
+//
+// Finds the best object split by binning the reference centers along each
+// axis.
+//
+static inline _sbvh_split _sbvh_object_split(
+    const std::vector<_bound_prim>& refs) {
+    auto centroid_bbox = ym::invalid_bbox3f;
+    for (auto& ref : refs) centroid_bbox += ref.center;
+    auto centroid_size = ym::diagonal(centroid_bbox);
+    auto split = _sbvh_split();
+    for (auto a = 0; a < 3; a++) {
+        if (centroid_size[a] <= 0) continue;
+        ym::bbox3f bins_bbox[YBVH__NBINS];
+        int bins_count[YBVH__NBINS];
+        for (auto b = 0; b < YBVH__NBINS; b++) {
+            bins_bbox[b] = ym::invalid_bbox3f;
+            bins_count[b] = 0;
+        }
+        for (auto& ref : refs) {
+            auto b = _bin_prim(ref, centroid_bbox, centroid_size, a);
+            bins_bbox[b] += ref.bbox;
+            bins_count[b] += 1;
+        }
+        ym::bbox3f right_bbox[YBVH__NBINS];
+        int right_count[YBVH__NBINS];
+        right_bbox[YBVH__NBINS - 1] = bins_bbox[YBVH__NBINS - 1];
+        right_count[YBVH__NBINS - 1] = bins_count[YBVH__NBINS - 1];
+        for (auto b = YBVH__NBINS - 2; b >= 0; b--) {
+            right_bbox[b] = right_bbox[b + 1];
+            right_bbox[b] += bins_bbox[b];
+            right_count[b] = right_count[b + 1] + bins_count[b];
+        }
+        auto left_bbox = ym::invalid_bbox3f;
+        auto left_count = 0;
+        for (auto b = 1; b < YBVH__NBINS; b++) {
+            left_bbox += bins_bbox[b - 1];
+            left_count += bins_count[b - 1];
+            if (!left_count || !right_count[b]) continue;
+            auto cost = _bbox_area(left_bbox) * left_count +
+                        _bbox_area(right_bbox[b]) * right_count[b];
+            if (cost >= split.cost) continue;
+            split.cost = cost;
+            split.axis = a;
+            split.pos = centroid_bbox[0][a] +
+                        centroid_size[a] * b / (float)YBVH__NBINS;
+            split.left = left_bbox;
+            split.right = right_bbox[b];
+            split.nleft = left_count;
+            split.nright = right_count[b];
+        }
+    }
+    return split;
+}
+
+//
+// Finds the best spatial split by chopping the references into bins that
+// split the node bounds evenly along each axis. References count in the bins
+// where they enter and exit, so that straddling references count on both
+// sides.
+//
+static inline _sbvh_split _sbvh_spatial_split(const shape* shp,
+    const std::vector<_bound_prim>& refs, const ym::bbox3f& bbox) {
+    const auto nbins = YBVH__SPATIAL_NBINS;
+    auto size = ym::diagonal(bbox);
+    auto split = _sbvh_split();
+    for (auto a = 0; a < 3; a++) {
+        if (size[a] <= 0) continue;
+        auto plane = [&](int b) { return bbox[0][a] + size[a] * b / nbins; };
+        auto bin = [&](float x) {
+            return ym::clamp(
+                (int)(nbins * (x - bbox[0][a]) / size[a]), 0, nbins - 1);
+        };
+        ym::bbox3f bins_bbox[nbins];
+        int bins_enter[nbins], bins_exit[nbins];
+        for (auto b = 0; b < nbins; b++) {
+            bins_bbox[b] = ym::invalid_bbox3f;
+            bins_enter[b] = 0;
+            bins_exit[b] = 0;
+        }
+        for (auto& ref : refs) {
+            auto first = bin(ref.bbox[0][a]), last = bin(ref.bbox[1][a]);
+            auto chopped = ref;
+            for (auto b = first; b < last; b++) {
+                auto left = ym::bbox3f(), right = ym::bbox3f();
+                _clip_ref(shp, chopped, a, plane(b + 1), left, right);
+                bins_bbox[b] += left;
+                chopped.bbox = right;
+            }
+            bins_bbox[last] += chopped.bbox;
+            bins_enter[first] += 1;
+            bins_exit[last] += 1;
+        }
+        ym::bbox3f right_bbox[nbins];
+        int right_count[nbins];
+        right_bbox[nbins - 1] = bins_bbox[nbins - 1];
+        right_count[nbins - 1] = bins_exit[nbins - 1];
+        for (auto b = nbins - 2; b >= 0; b--) {
+            right_bbox[b] = right_bbox[b + 1];
+            right_bbox[b] += bins_bbox[b];
+            right_count[b] = right_count[b + 1] + bins_exit[b];
+        }
+        auto left_bbox = ym::invalid_bbox3f;
+        auto left_count = 0;
+        for (auto b = 1; b < nbins; b++) {
+            left_bbox += bins_bbox[b - 1];
+            left_count += bins_enter[b - 1];
+            if (!left_count || !right_count[b]) continue;
+            auto cost = _bbox_area(left_bbox) * left_count +
+                        _bbox_area(right_bbox[b]) * right_count[b];
+            if (cost >= split.cost) continue;
+            split.cost = cost;
+            split.axis = a;
+            split.pos = plane(b);
+            split.spatial = true;
+            split.left = left_bbox;
+            split.right = right_bbox[b];
+            split.nleft = left_count;
+            split.nright = right_count[b];
+        }
+    }
+    return split;
+}
+
+//
+// Initializes the node nid from the references refs, using the best of
+// object and spatial splits as in Stich et al. 2009. Spatial splits are
+// tried only when the children of the object split overlap, and only while
+// the budget of duplicated references lasts. Straddling references are kept
+// whole on one side if that is cheaper than splitting them. Leaves append
+// their references to sorted_refs. Nodes are added as in _make_node.
+//
+static inline void _make_sbvh_node(std::vector<bvhn>& nodes, int nid,
+    const shape* shp, std::vector<_bound_prim>& refs, float root_area,
+    int depth, int& budget, std::vector<_bound_prim>& sorted_refs) {
+    // compute node bounds
+    auto bbox = ym::invalid_bbox3f;
+    for (auto& ref : refs) bbox += ref.bbox;
+
+    // choose the split
+    auto split = _sbvh_split();
+    if (refs.size() > YBVH__MINPRIMS) {
+        split = _sbvh_object_split(refs);
+        auto overlap = (split.axis >= 0) ?
+                           _intersect_bbox(split.left, split.right) :
+                           bbox;
+        auto overlaps = overlap[0][0] <= overlap[1][0] &&
+                        overlap[0][1] <= overlap[1][1] &&
+                        overlap[0][2] <= overlap[1][2] &&
+                        _bbox_area(overlap) > 1e-5f * root_area;
+        if (overlaps && budget > 0 && depth < YBVH__SPATIAL_MAXDEPTH) {
+            auto spatial = _sbvh_spatial_split(shp, refs, bbox);
+            auto nsplit = spatial.nleft + spatial.nright - (int)refs.size();
+            if (spatial.cost < split.cost && nsplit <= budget)
+                split = spatial;
+        }
+    }
+
+    // make a leaf
+    if (split.axis < 0) {
+        auto& node = nodes[nid];
+        node.bbox = bbox;
+        node.isleaf = true;
+        node.start = (int)sorted_refs.size();
+        node.count = (int)refs.size();
+        sorted_refs.insert(sorted_refs.end(), refs.begin(), refs.end());
+        return;
+    }
+
+    // partition the references
+    auto left = std::vector<_bound_prim>(), right = std::vector<_bound_prim>();
+    auto axis = split.axis;
+    if (!split.spatial) {
+        for (auto& ref : refs) {
+            if (ref.center[axis] < split.pos) {
+                left.push_back(ref);
+            } else {
+                right.push_back(ref);
+            }
+        }
+    } else {
+        auto left_bbox = split.left, right_bbox = split.right;
+        auto nleft = split.nleft, nright = split.nright;
+        for (auto& ref : refs) {
+            if (ref.bbox[1][axis] <= split.pos) {
+                left.push_back(ref);
+            } else if (ref.bbox[0][axis] >= split.pos) {
+                right.push_back(ref);
+            } else {
+                // reference unsplitting
+                auto left_union = left_bbox, right_union = right_bbox;
+                left_union += ref.bbox;
+                right_union += ref.bbox;
+                auto cost_split = _bbox_area(left_bbox) * nleft +
+                                  _bbox_area(right_bbox) * nright;
+                auto cost_left = _bbox_area(left_union) * nleft +
+                                 _bbox_area(right_bbox) * (nright - 1);
+                auto cost_right = _bbox_area(left_bbox) * (nleft - 1) +
+                                  _bbox_area(right_union) * nright;
+                if (cost_left < cost_split && cost_left <= cost_right) {
+                    left.push_back(ref);
+                    left_bbox = left_union;
+                    nright -= 1;
+                } else if (cost_right < cost_split) {
+                    right.push_back(ref);
+                    right_bbox = right_union;
+                    nleft -= 1;
+                } else {
+                    auto lref = ref, rref = ref;
+                    _clip_ref(shp, ref, axis, split.pos, lref.bbox, rref.bbox);
+                    lref.center = ym::center(lref.bbox);
+                    rref.center = ym::center(rref.bbox);
+                    left.push_back(lref);
+                    right.push_back(rref);
+                    budget -= 1;
+                }
+            }
+        }
+    }
+    refs = {};
+
+    // spatial splits that fail to separate references become leaves
+    if (left.empty() || right.empty()) {
+        auto& all = (left.empty()) ? right : left;
+        auto& node = nodes[nid];
+        node.bbox = bbox;
+        node.isleaf = true;
+        node.start = (int)sorted_refs.size();
+        node.count = (int)all.size();
+        sorted_refs.insert(sorted_refs.end(), all.begin(), all.end());
+        return;
+    }
+
+    // make an internal node
+    auto children = (int)nodes.size();
+    nodes.emplace_back();
+    nodes.emplace_back();
+    nodes[nid].bbox = bbox;
+    nodes[nid].isleaf = false;
+    nodes[nid].axis = axis;
+    nodes[nid].start = children;
+    nodes[nid].count = 2;
+    _make_sbvh_node(nodes, children, shp, left, root_area, depth + 1, budget,
+        sorted_refs);
+    _make_sbvh_node(nodes, children + 1, shp, right, root_area, depth + 1,
+        budget, sorted_refs);
+}
+
+//
+// Builds a bvh with spatial splits. Returns the sorted primitive references,
+// where primitives may appear more than once, up to the fraction budget of
+// the primitives.
+//
+static inline std::vector<_bound_prim> _make_nodes_sbvh(
+    std::vector<bvhn>& nodes, const shape* shp, const _bound_prim* bound_prims,
+    int nprims, float budget) {
+    auto refs = std::vector<_bound_prim>(bound_prims, bound_prims + nprims);
+    auto bbox = ym::invalid_bbox3f;
+    for (auto& ref : refs) bbox += ref.bbox;
+    auto nsplits = (int)(budget * nprims);
+    auto sorted_refs = std::vector<_bound_prim>();
+    sorted_refs.reserve(nprims + nsplits);
+    nodes.emplace_back();
+    _make_sbvh_node(
+        nodes, 0, shp, refs, _bbox_area(bbox), 0, nsplits, sorted_refs);
+    return sorted_refs;
+}
+
+// max number of leaves of the treelets restructured after the build
+#define YBVH__TREELET_LEAVES 7
+
+//
+// Sah cost of a subtree times its root area, with the same weights as
+// _sah_area. Costs of the children are computed first.
+//
+static inline float _treelet_cost(
+    const std::vector<bvhn>& nodes, const std::vector<float>& cost, int nid) {
+    const auto& node = nodes[nid];
+    if (node.isleaf) return _bbox_area(node.bbox) * node.count;
+    return _bbox_area(node.bbox) + cost[node.start] + cost[node.start + 1];
+}
+
+//
+// Restructures the treelet rooted at the node nid. The treelet is grown by
+// repeatedly opening its internal leaf with the largest surface area. The
+// tree over the treelet leaves with the lowest sah cost is found by dynamic
+// programming over the subsets of leaves, and replaces the treelet if it is
+// cheaper. Treelet leaves are whole subtrees moved to the child slots of the
+// treelet internal nodes, so primitives are never moved. Updates parents and
+// costs of the nodes written and returns whether the treelet changed.
+//
+static inline bool _optimize_treelet(std::vector<bvhn>& nodes,
+    std::vector<int>& parent, std::vector<float>& cost, int nid) {
+    // grow treelet
+    const auto nmax = YBVH__TREELET_LEAVES;
+    int leaves[nmax], slots[nmax - 1];
+    auto nleaves = 0, nslots = 0;
+    auto open = nid;
+    while (open >= 0) {
+        slots[nslots++] = nodes[open].start;
+        leaves[nleaves++] = nodes[open].start;
+        leaves[nleaves++] = nodes[open].start + 1;
+        if (nleaves == nmax) break;
+        auto best = -1;
+        auto best_area = -1.0f;
+        for (auto i = 0; i < nleaves; i++) {
+            const auto& node = nodes[leaves[i]];
+            if (node.isleaf || _bbox_area(node.bbox) <= best_area) continue;
+            best = i;
+            best_area = _bbox_area(node.bbox);
+        }
+        open = (best >= 0) ? leaves[best] : -1;
+        if (best >= 0) leaves[best] = leaves[--nleaves];
+    }
+    if (nleaves < 3) return false;
+
+    // optimal cost of each subset of leaves, visited in increasing order
+    // so that subsets come before their supersets
+    auto nsets = 1 << nleaves;
+    ym::bbox3f set_bbox[1 << nmax];
+    float set_cost[1 << nmax];
+    int set_split[1 << nmax];
+    for (auto s = 1; s < nsets; s++) {
+        auto low = s & -s;
+        if (s == low) {
+            auto i = 0;
+            while (!(s & (1 << i))) i++;
+            set_bbox[s] = nodes[leaves[i]].bbox;
+            set_cost[s] = cost[leaves[i]];
+            set_split[s] = 0;
+            continue;
+        }
+        set_bbox[s] = set_bbox[low];
+        set_bbox[s] += set_bbox[s ^ low];
+        // partitions containing the lowest leaf, to visit each once
+        auto best_cost = ym::flt_max;
+        auto best_split = 0;
+        for (auto p = (s - 1) & s; p; p = (p - 1) & s) {
+            if (!(p & low)) continue;
+            auto split_cost = set_cost[p] + set_cost[s ^ p];
+            if (split_cost < best_cost) {
+                best_cost = split_cost;
+                best_split = p;
+            }
+        }
+        set_cost[s] = _bbox_area(set_bbox[s]) + best_cost;
+        set_split[s] = best_split;
+    }
+
+    // keep the treelet unless the new one is cheaper
+    auto all = nsets - 1;
+    if (set_cost[all] >= cost[nid] * 0.99999f) return false;
+
+    // emit the new treelet, copying leaves since slots are overwritten
+    bvhn leaf_nodes[nmax];
+    float leaf_cost[nmax];
+    for (auto i = 0; i < nleaves; i++) {
+        leaf_nodes[i] = nodes[leaves[i]];
+        leaf_cost[i] = cost[leaves[i]];
+    }
+    auto next_slot = 0;
+    std::function<void(int, int)> emit = [&](int nid, int s) {
+        if (s == (s & -s)) {
+            auto i = 0;
+            while (!(s & (1 << i))) i++;
+            nodes[nid] = leaf_nodes[i];
+            cost[nid] = leaf_cost[i];
+            if (!nodes[nid].isleaf) {
+                parent[nodes[nid].start] = nid;
+                parent[nodes[nid].start + 1] = nid;
+            }
+            return;
+        }
+        auto children = slots[next_slot++];
+        emit(children, set_split[s]);
+        emit(children + 1, s ^ set_split[s]);
+        parent[children] = nid;
+        parent[children + 1] = nid;
+        auto& node = nodes[nid];
+        node.bbox = set_bbox[s];
+        node.isleaf = false;
+        node.start = children;
+        node.count = 2;
+        auto d = ym::center(nodes[children + 1].bbox) -
+                 ym::center(nodes[children].bbox);
+        node.axis = 0;
+        for (auto a = 1; a < 3; a++)
+            if (std::abs(d[a]) > std::abs(d[node.axis])) node.axis = a;
+        cost[nid] = set_cost[s];
+    };
+    emit(nid, all);
+    return true;
+}
+
+//
+// Lowers the sah cost of a tree by restructuring treelets, following
+// "Fast Parallel Construction of High-Quality Bounding Volume Hierarchies"
+// by T. Karras and T. Aila. Each pass walks the tree bottom up in parallel:
+// a thread starts from each leaf and stops at the first node whose other
+// child is not done yet, so that each treelet is restructured after all the
+// ones below it. Passes stop early when they change nothing or when the time
+// budget runs out, in which case the remaining treelets are kept as they are.
+//
+static inline void _optimize_nodes(std::vector<bvhn>& nodes, int npasses,
+    float max_time, int nthreads) {
+    if (npasses <= 0 || nodes.size() < 3) return;
+    auto start_time = std::chrono::steady_clock::now();
+    auto out_of_time = [&]() {
+        if (max_time <= 0) return false;
+        auto elapsed = std::chrono::duration<float>(
+            std::chrono::steady_clock::now() - start_time);
+        return elapsed.count() > max_time;
+    };
+
+    // parents and leaves, in breadth first order
+    auto nnodes = (int)nodes.size();
+    auto parent = std::vector<int>(nnodes, -1);
+    auto order = std::vector<int>();
+    auto leaves = std::vector<int>();
+    order.reserve(nnodes);
+    auto init_order = [&]() {
+        order.assign(1, 0);
+        leaves.clear();
+        for (auto i = 0; i < (int)order.size(); i++) {
+            const auto& node = nodes[order[i]];
+            if (node.isleaf) {
+                leaves.push_back(order[i]);
+                continue;
+            }
+            for (auto c = 0; c < 2; c++) {
+                parent[node.start + c] = order[i];
+                order.push_back(node.start + c);
+            }
+        }
+    };
+
+    // subtree costs, children first
+    init_order();
+    auto cost = std::vector<float>(nnodes);
+    for (auto i = (int)order.size() - 1; i >= 0; i--)
+        cost[order[i]] = _treelet_cost(nodes, cost, order[i]);
+
+    // passes; restructuring moves leaves, so they are found again each time
+    auto visits =
+        std::unique_ptr<std::atomic<int>[]>(new std::atomic<int>[nnodes]);
+    for (auto pass = 0; pass < npasses && !out_of_time(); pass++) {
+        if (pass) init_order();
+        for (auto i = 0; i < nnodes; i++) visits[i] = 0;
+        std::atomic<bool> changed(false);
+        _parallel_for((int)leaves.size(), nthreads, [&](int i) {
+            auto nid = parent[leaves[i]];
+            while (nid >= 0 && visits[nid].fetch_add(1)) {
+                cost[nid] = _treelet_cost(nodes, cost, nid);
+                if (!out_of_time() &&
+                    _optimize_treelet(nodes, parent, cost, nid))
+                    changed = true;
+                nid = parent[nid];
+            }
+        });
+        if (!changed) break;
+    }
+}
+
+//
+// Sorts the primitives in depth-first leaf order and points the leaves to
+// their new ranges. Restructured treelets move whole subtrees, so their
+// leaves are no longer contiguous in the primitive array, as _make_qitem()
+// and leaf ranges of subtrees assume.
+//
+static inline void _sort_leaf_prims(
+    std::vector<bvhn>& nodes, _bound_prim* bound_prims, int nprims) {
+    auto sorted = std::vector<_bound_prim>();
+    sorted.reserve(nprims);
+    auto node_stack = std::vector<int>{0};
+    while (!node_stack.empty()) {
+        auto& node = nodes[node_stack.back()];
+        node_stack.pop_back();
+        if (node.isleaf) {
+            auto start = (int)sorted.size();
+            for (auto i = 0; i < (int)node.count; i++)
+                sorted.push_back(bound_prims[node.start + i]);
+            node.start = start;
+        } else {
+            for (auto i = (int)node.count - 1; i >= 0; i--)
+                node_stack.push_back((int)node.start + i);
+        }
+    }
+    assert((int)sorted.size() == nprims);
+    std::copy(sorted.begin(), sorted.end(), bound_prims);
+}
+
+//
+// Collapses the binary subtree rooted at the node nid into a wide node.
+// Children are gathered by repeatedly opening the internal child with the
+// largest surface area, until N children are found or only leaves are left.
+// Returns the index of the wide node. Leaves of the binary tree become leaf
+// lanes, so that the sorted primitive array is shared between the layouts.
+// If node_lane is given, stores the wide node and lane of each binary node.
+//
+template <int N>
+static inline int _collapse_node(const bvh* bvh, int nid,
+    _array<bvhw<N>>& wnodes,
+    std::vector<ym::vec2i>* node_lane = nullptr) {
+    // gather children
+    int lanes[N];
+    auto nlanes = 0;
+    const auto& node = bvh->nodes[nid];
+    if (node.isleaf) {
+        lanes[nlanes++] = nid;
+    } else {
+        for (auto i = 0; i < node.count; i++) lanes[nlanes++] = node.start + i;
+    }
+
+    // open the largest internal children while there is room
+    while (nlanes < N) {
+        auto open = -1;
+        auto open_area = -1.0f;
+        for (auto l = 0; l < nlanes; l++) {
+            const auto& child = bvh->nodes[lanes[l]];
+            if (child.isleaf || nlanes - 1 + child.count > N) continue;
+            auto area = _bbox_area(child.bbox);
+            if (area > open_area) {
+                open = l;
+                open_area = area;
+            }
+        }
+        if (open < 0) break;
+        const auto& child = bvh->nodes[lanes[open]];
+        lanes[open] = child.start;
+        for (auto i = 1; i < child.count; i++)
+            lanes[nlanes++] = child.start + i;
+    }
+
+    // allocate the node and fill its lanes; empty lanes get invalid bounds
+    auto wid = (int)wnodes.size();
+    wnodes.emplace_back();
+    for (auto l = 0; l < N; l++) {
+        auto bbox = ym::invalid_bbox3f;
+        auto start = -1, count = 0;
+        if (l < nlanes) {
+            const auto& child = bvh->nodes[lanes[l]];
+            if (node_lane) (*node_lane)[lanes[l]] = {wid, l};
+            if (!child.isleaf) {
+                bbox = child.bbox;
+                start = _collapse_node(bvh, lanes[l], wnodes, node_lane);
+            } else if (child.count) {
+                bbox = child.bbox;
+                start = child.start;
+                count = child.count;
+            }
+        }
+        auto& wnode = wnodes[wid];
+        for (auto a = 0; a < 3; a++) {
+            wnode.bbox[a][l] = bbox[0][a];
+            wnode.bbox[3 + a][l] = bbox[1][a];
+        }
+        wnode.start[l] = start;
+        wnode.count[l] = count;
+    }
+
+    return wid;
+}
+
+//
+// Updates the wide nodes from the binary ones. Called after build and refit.
+//
+static inline void _collapse_bvh(bvh* bvh) {
+    bvh->wnodes4.clear();
+    bvh->wnodes8.clear();
+    if (bvh->compressed) return;
+    auto node_lane = (bvh->parent.empty()) ? nullptr : &bvh->node_lane;
+    if (node_lane) node_lane->assign(bvh->nodes.size(), {-1, -1});
+    switch (bvh->width) {
+        case 2: break;
+        case 4: _collapse_node(bvh, 0, bvh->wnodes4, node_lane); break;
+        case 8: _collapse_node(bvh, 0, bvh->wnodes8, node_lane); break;
+        default: assert(false); break;
+    }
+    bvh->wnodes4.shrink_to_fit();
+    bvh->wnodes8.shrink_to_fit();
+}
+
+//
+// Quantizes the bounds of up to YBVH__QWIDTH children into a compressed node.
+// Scales are the smallest powers of two that cover the node bounds with 255
+// steps, checked with the same arithmetic used when decoding.
+//
+static inline void _encode_qnode(
+    bvhq& qnode, const ym::bbox3f* lane_bbox, const int* ref, int nlanes) {
+    auto bbox = ym::invalid_bbox3f;
+    for (auto l = 0; l < nlanes; l++) bbox += lane_bbox[l];
+    for (auto a = 0; a < 3; a++) {
+        auto origin = (nlanes) ? bbox[0][a] : 0.0f;
+        auto extent = (nlanes) ? bbox[1][a] - origin : 0.0f;
+        auto e = -120;
+        if (extent > 0) {
+            std::frexp(extent / 255, &e);
+            e = ym::clamp(e - 1, -120, 127);
+        }
+        while (e < 127 && origin + 255 * std::ldexp(1.0f, e) < bbox[1][a])
+            e++;
+        auto scale = std::ldexp(1.0f, e);
+        qnode.origin[a] = origin;
+        qnode.exp[a] = (int8_t)e;
+        for (auto l = 0; l < YBVH__QWIDTH; l++) {
+            if (l >= nlanes) {
+                qnode.qbbox[a][l] = 255;
+                qnode.qbbox[3 + a][l] = 0;
+                continue;
+            }
+            auto qmin = ym::clamp(
+                (int)std::floor((lane_bbox[l][0][a] - origin) / scale), 0, 255);
+            while (qmin > 0 && origin + qmin * scale > lane_bbox[l][0][a])
+                qmin--;
+            auto qmax = ym::clamp(
+                (int)std::ceil((lane_bbox[l][1][a] - origin) / scale), 0, 255);
+            while (qmax < 255 && origin + qmax * scale < lane_bbox[l][1][a])
+                qmax++;
+            qnode.qbbox[a][l] = (uint8_t)qmin;
+            qnode.qbbox[3 + a][l] = (uint8_t)qmax;
+        }
+    }
+    for (auto l = 0; l < YBVH__QWIDTH; l++)
+        qnode.ref[l] = (l < nlanes) ? ref[l] : -1;
+}
+
+//
+// Decodes the children bounds of a compressed node as wide node lanes.
+//
+static inline void _decode_qnode(const bvhq& qnode, bvhw<YBVH__QWIDTH>& wnode) {
+    for (auto a = 0; a < 3; a++) {
+        auto scale = std::ldexp(1.0f, qnode.exp[a]);
+        for (auto l = 0; l < YBVH__QWIDTH; l++) {
+            wnode.bbox[a][l] = qnode.origin[a] + qnode.qbbox[a][l] * scale;
+            wnode.bbox[3 + a][l] =
+                qnode.origin[a] + qnode.qbbox[3 + a][l] * scale;
+        }
+    }
+}
+
+//
+// Subtree used when compressing a bvh: either a binary node or half of the
+// primitives of a large leaf. Both cover a range of sorted primitives.
+//
+struct _qitem {
+    int nid = -1;            // binary node or -1 for primitive ranges
+    int start = 0, end = 0;  // primitive range
+};
+
+//
+// Makes a compression item for a binary node, finding its primitive range
+// from its leftmost and rightmost leaves.
+//
+static inline _qitem _make_qitem(const bvh* bvh, int nid) {
+    auto item = _qitem();
+    item.nid = nid;
+    auto first = &bvh->nodes[nid];
+    while (!first->isleaf) first = &bvh->nodes[first->start];
+    auto last = &bvh->nodes[nid];
+    while (!last->isleaf) last = &bvh->nodes[last->start + last->count - 1];
+    item.start = first->start;
+    item.end = last->start + last->count;
+    return item;
+}
+
+//
+// Compresses the subtree item into a compressed node and returns its index.
+// As in _collapse_node, the largest children are opened until the eight
+// lanes are filled. Subtrees with up to eight primitives open directly into
+// their primitives, that are stored inline, so that nodes are mostly full.
+// Leaves that hold many primitives are halved over more levels than the
+// binary bvh has, so the depth of the node, with the root at one, is kept in
+// max_depth.
+//
+static inline int _compress_node(const bvh* bvh,
+    const _bound_prim* sorted_prims, const _qitem& item, _array<bvhq>& qnodes,
+    int depth, int& max_depth) {
+    // item bounds and children
+    auto item_bbox = [bvh, sorted_prims](const _qitem& item) {
+        if (item.nid >= 0) return bvh->nodes[item.nid].bbox;
+        auto bbox = ym::invalid_bbox3f;
+        for (auto i = item.start; i < item.end; i++)
+            bbox += sorted_prims[i].bbox;
+        return bbox;
+    };
+    auto item_children = [bvh](const _qitem& item, _qitem* children) {
+        auto count = item.end - item.start;
+        if (count <= YBVH__QWIDTH) {
+            for (auto i = 0; i < count; i++) {
+                children[i].start = item.start + i;
+                children[i].end = item.start + i + 1;
+            }
+            return count;
+        } else if (item.nid >= 0 && !bvh->nodes[item.nid].isleaf) {
+            const auto& node = bvh->nodes[item.nid];
+            for (auto c = 0; c < 2; c++)
+                children[c] = _make_qitem(bvh, node.start + c);
+            return 2;
+        } else {
+            auto mid = (item.start + item.end) / 2;
+            children[0].start = item.start;
+            children[0].end = mid;
+            children[1].start = mid;
+            children[1].end = item.end;
+            return 2;
+        }
+    };
+    auto is_prim = [](const _qitem& item) {
+        return item.end - item.start == 1;
+    };
+
+    // open items until the lanes are filled
+    _qitem lanes[YBVH__QWIDTH];
+    ym::bbox3f lanes_bbox[YBVH__QWIDTH];
+    auto nlanes = 0;
+    if (item.end > item.start) {
+        lanes[0] = item;
+        lanes_bbox[0] = item_bbox(item);
+        nlanes = 1;
+    }
+    while (nlanes < YBVH__QWIDTH) {
+        auto open = -1;
+        auto open_area = -1.0f;
+        for (auto l = 0; l < nlanes; l++) {
+            auto count = lanes[l].end - lanes[l].start;
+            if (is_prim(lanes[l])) continue;
+            if (count <= YBVH__QWIDTH && nlanes - 1 + count > YBVH__QWIDTH)
+                continue;
+            auto area = _bbox_area(lanes_bbox[l]);
+            if (area > open_area) {
+                open = l;
+                open_area = area;
+            }
+        }
+        if (open < 0) break;
+        _qitem children[YBVH__QWIDTH];
+        auto nchildren = item_children(lanes[open], children);
+        for (auto c = 0; c < nchildren; c++) {
+            auto l = (c) ? nlanes++ : open;
+            lanes[l] = children[c];
+            lanes_bbox[l] = item_bbox(lanes[l]);
+        }
+    }
+
+    // allocate the node and recurse on the lanes that are not primitives
+    auto qid = (int)qnodes.size();
+    qnodes.emplace_back();
+    max_depth = ym::max(max_depth, depth);
+    int ref[YBVH__QWIDTH];
+    auto leaf = 0;
+    for (auto l = 0; l < nlanes; l++) {
+        if (is_prim(lanes[l])) {
+            ref[l] = sorted_prims[lanes[l].start].pid;
+            leaf |= 1 << l;
+        } else {
+            ref[l] = _compress_node(
+                bvh, sorted_prims, lanes[l], qnodes, depth + 1, max_depth);
+        }
+    }
+    _encode_qnode(qnodes[qid], lanes_bbox, ref, nlanes);
+    qnodes[qid].leaf = (uint8_t)leaf;
+    return qid;
+}
+
+//
+// Replaces the binary nodes and the sorted primitives with compressed nodes.
+// The depth is replaced by the one of the compressed nodes.
+//
+static inline void _compress_bvh(bvh* bvh, const _bound_prim* sorted_prims) {
+    bvh->qnodes.clear();
+    bvh->max_depth = 0;
+    _compress_node(bvh, sorted_prims, _make_qitem(bvh, 0), bvh->qnodes, 1,
+        bvh->max_depth);
+    bvh->qnodes.shrink_to_fit();
+    bvh->compressed = true;
+    bvh->bbox = bvh->nodes[0].bbox;
+    bvh->nodes = std::vector<bvhn>();
+    bvh->sorted_prim = std::vector<int>();
+}
+
+//
+// Depth of the deepest leaf of a bvh, counting the root as one. Wide nodes
+// collapse these nodes, so they are never deeper. Compressed nodes may split
+// leaves further, so _compress_bvh() computes their own depth.
+//
+static inline int _max_depth(const bvh* bvh) {
+    auto max_depth = 0;
+    auto node_stack = std::vector<ym::vec2i>{{0, 1}};
+    while (!node_stack.empty()) {
+        auto node_depth = node_stack.back();
+        node_stack.pop_back();
+        const auto& node = bvh->nodes[node_depth[0]];
+        max_depth = ym::max(max_depth, node_depth[1]);
+        if (node.isleaf) continue;
+        for (auto i = 0; i < node.count; i++)
+            node_stack.push_back({(int)node.start + i, node_depth[1] + 1});
+    }
+    return max_depth;
+}
+
+//
+// Build a BVH from a set of primitives.
+//
+YBVH_API void _build_bvh(bvh* bvh, int nprims, _bound_prim* bound_prims,
+    const build_params& params, const shape* shp = nullptr) {
+    // clear bvh
+    bvh->nodes.clear();
+    bvh->sorted_prim.clear();
+    bvh->compressed = false;
+    bvh->qnodes.clear();
+    bvh->cache = nullptr;
+    bvh->dups = (params.htype == heuristic_type::sbvh) ||
+                (params.line_pieces > 1 && shp && shp->line);
+
+    // allocate nodes (over-allocate now then shrink)
+    auto nodes = std::vector<bvhn>();
+    nodes.reserve(nprims * 2);
+
+    // start recursive splitting
+    auto nthreads = _build_threads(params);
+    auto sbvh_refs = std::vector<_bound_prim>();
+    if (params.htype == heuristic_type::sbvh) {
+        sbvh_refs = _make_nodes_sbvh(
+            nodes, shp, bound_prims, nprims, params.split_budget);
+        bound_prims = sbvh_refs.data();
+        nprims = (int)sbvh_refs.size();
+    } else if (params.htype == heuristic_type::morton) {
+        _make_nodes_morton(nodes, bound_prims, nprims, nthreads);
+    } else if (nthreads > 1 && nprims >= YBVH__PARALLEL_MINPRIMS) {
+        _make_nodes_parallel(
+            nodes, bound_prims, nprims, params.htype, nthreads);
+    } else {
+        nodes.emplace_back();
+        _make_node(nodes[0], nodes, bound_prims, 0, nprims, params.htype);
+    }
+    _optimize_nodes(
+        nodes, params.treelet_passes, params.treelet_time, nthreads);
+    if (params.treelet_passes > 0) _sort_leaf_prims(nodes, bound_prims, nprims);
+
+    // shrink back
+    nodes.shrink_to_fit();
+    bvh->nodes = std::move(nodes);
+
+    // init sorted element arrays
+    // for shared memory, stored pointer to the external data
+    // store the sorted primitive order for BVH walk
+    bvh->sorted_prim.resize(nprims);
+    for (int i = 0; i < nprims; i++) {
+        bvh->sorted_prim[i] = bound_prims[i].pid;
+    }
+
+    // depth used to size traversal stacks
+    bvh->max_depth = _max_depth(bvh);
+
+    // compressed or wide nodes
+    if (params.compressed) _compress_bvh(bvh, bound_prims);
+    bvh->width = (params.compressed) ? 2 : params.width;
+    _collapse_bvh(bvh);
+}
+
+//
+// Gets the bbox of a shape element
+//
+static inline ym::bbox3f _bound_elem(const shape* shp, int eid) {
+    if (shp->point) {
+        auto f = shp->point[eid];
+        return _bound_point(shp->pos[f], shp->rad(f));
+    } else if (shp->line) {
+        auto f = shp->line[eid];
+        return _bound_line(
+            shp->pos[f[0]], shp->pos[f[1]], shp->rad(f[0]), shp->rad(f[1]));
+    } else if (shp->triangle) {
+        auto f = shp->triangle[eid];
+        return _bound_triangle(shp->pos[f[0]], shp->pos[f[1]], shp->pos[f[2]]);
+    } else if (shp->tetra) {
+        auto f = shp->tetra[eid];
+        return _bound_tetrahedron(
+            shp->pos[f[0]], shp->pos[f[1]], shp->pos[f[2]], shp->pos[f[3]]);
+    } else {
+        return _bound_point(shp->pos[eid], shp->rad(eid));
+    }
+}
+
+//
+// Number of pieces a line is split into. Lines along an axis are tightly
+// bounded and kept whole, while diagonal ones are split in pieces about as
+// long as they are thick, since their bounds grow with the diagonal length.
+//
+static inline int _line_pieces(const shape* shp, int eid, int max_pieces) {
+    auto f = shp->line[eid];
+    auto d = shp->pos[f[1]] - shp->pos[f[0]];
+    auto dmax =
+        ym::max(std::abs(d[0]), ym::max(std::abs(d[1]), std::abs(d[2])));
+    auto diag = ym::length(d) - dmax;
+    auto thick = 2 * ym::max(shp->rad(f[0]), shp->rad(f[1]));
+    if (diag <= 0) return 1;
+    if (thick <= 0) return max_pieces;
+    return ym::clamp((int)std::ceil(diag / thick), 1, max_pieces);
+}
+
+//
+// Splits the lines of a shape into pieces, each bounded separately and
+// referencing the whole line, as references of spatial splits do.
+//
+static inline std::vector<_bound_prim> _split_lines(const shape* shp,
+    const std::vector<_bound_prim>& bound_prims, int max_pieces, int nthreads) {
+    auto offset = std::vector<int>(bound_prims.size() + 1, 0);
+    for (auto i = 0; i < (int)bound_prims.size(); i++)
+        offset[i + 1] =
+            offset[i] + _line_pieces(shp, bound_prims[i].pid, max_pieces);
+    auto pieces = std::vector<_bound_prim>(offset.back());
+    nthreads = _range_threads(0, (int)bound_prims.size(), nthreads);
+    _parallel_for(nthreads, nthreads, [&](int c) {
+        auto start = (int)((int64_t)bound_prims.size() * c / nthreads);
+        auto end = (int)((int64_t)bound_prims.size() * (c + 1) / nthreads);
+        for (auto i = start; i < end; i++) {
+            auto eid = bound_prims[i].pid;
+            auto f = shp->line[eid];
+            auto v0 = shp->pos[f[0]], v1 = shp->pos[f[1]];
+            auto r0 = shp->rad(f[0]), r1 = shp->rad(f[1]);
+            auto npieces = offset[i + 1] - offset[i];
+            for (auto p = 0; p < npieces; p++) {
+                auto s0 = (float)p / npieces, s1 = (float)(p + 1) / npieces;
+                auto& piece = pieces[offset[i] + p];
+                piece.pid = eid;
+                piece.bbox = _bound_line(ym::lerp(v0, v1, s0),
+                    ym::lerp(v0, v1, s1), ym::lerp(r0, r1, s0),
+                    ym::lerp(r0, r1, s1));
+                piece.center = ym::center(piece.bbox);
+            }
+        }
+    });
+    return pieces;
+}
+
+//
+// Pads the sorted primitives so that each leaf starts at a multiple of the
+// pack width. Padding has negative indices and is never part of a leaf.
+//
+static inline void _pad_leaves(bvh* bvh, int width) {
+    auto sorted_prim = std::vector<int>();
+    sorted_prim.reserve(bvh->sorted_prim.size() * 2);
+    for (auto& node : bvh->nodes) {
+        if (!node.isleaf) continue;
+        auto start = (int)sorted_prim.size();
+        for (auto i = 0; i < node.count; i++)
+            sorted_prim.push_back(bvh->sorted_prim[node.start + i]);
+        while (sorted_prim.size() % width) sorted_prim.push_back(-1);
+        node.start = start;
+    }
+    sorted_prim.shrink_to_fit();
+    bvh->sorted_prim = sorted_prim;
+}
+
+//
+// Fills the triangle packs from the padded sorted primitives.
+//
+template <int N>
+static inline void _make_tpacks(
+    const shape* shp, const bvh* bvh, _array<bvht<N>>& tpacks) {
+    tpacks.resize(bvh->sorted_prim.size() / N);
+    for (auto p = 0; p < (int)tpacks.size(); p++) {
+        auto& pack = tpacks[p];
+        for (auto l = 0; l < N; l++) {
+            auto eid = bvh->sorted_prim[p * N + l];
+            auto v0 = ym::zero3f, e1 = ym::zero3f, e2 = ym::zero3f;
+            if (eid >= 0) {
+                auto f = shp->triangle[eid];
+                v0 = shp->pos[f[0]];
+                e1 = shp->pos[f[1]] - v0;
+                e2 = shp->pos[f[2]] - v0;
+            }
+            for (auto a = 0; a < 3; a++) {
+                pack.v0[a][l] = v0[a];
+                pack.e1[a][l] = e1[a];
+                pack.e2[a][l] = e2[a];
+            }
+            pack.eid[l] = eid;
+        }
+    }
+}
+
+//
+// Updates the triangle packs of a shape. Called after build and refit.
+//
+static inline void _update_tpacks(const shape* shp, bvh* bvh) {
+    bvh->tpacks4.clear();
+    bvh->tpacks8.clear();
+    switch (bvh->tpack_width) {
+        case 0: break;
+        case 4: _make_tpacks(shp, bvh, bvh->tpacks4); break;
+        case 8: _make_tpacks(shp, bvh, bvh->tpacks8); break;
+        default: assert(false); break;
+    }
+}
+
+//
+// Build a shape BVH. Public function whose interface is described above.
+//
+YBVH_API void build_bvh(shape* shp, const build_params& params) {
+    // instances share the bvh of their prototype, and lazy shapes load theirs
+    if (shp->instance || shp->_lazy) return;
+
+    // create bounded primitives used in BVH build
+    auto bound_prims = std::vector<_bound_prim>(shp->nelems);
+    auto nthreads = _range_threads(0, shp->nelems, _build_threads(params));
+    _parallel_for(nthreads, nthreads, [&](int c) {
+        auto start = (int)((int64_t)shp->nelems * c / nthreads);
+        auto end = (int)((int64_t)shp->nelems * (c + 1) / nthreads);
+        for (auto i = start; i < end; i++) {
+            bound_prims[i].pid = i;
+            bound_prims[i].bbox = _bound_elem(shp, i);
+            bound_prims[i].center = ym::center(bound_prims[i].bbox);
+        }
+    });
+
+    // split diagonal lines into pieces with tighter bounds
+    if (params.line_pieces > 1 && shp->line)
+        bound_prims = _split_lines(
+            shp, bound_prims, params.line_pieces, _build_threads(params));
+
+    // tree bvh
+    if (!shp->_bvh) shp->_bvh = new bvh();
+    _build_bvh(shp->_bvh, (int)bound_prims.size(), bound_prims.data(), params,
+        shp);
+
+    // triangle packs
+    shp->_bvh->tpack_width = 0;
+    if (params.triangle_packs && shp->triangle && !params.compressed) {
+        shp->_bvh->tpack_width = params.triangle_packs;
+        _pad_leaves(shp->_bvh, params.triangle_packs);
+        _collapse_bvh(shp->_bvh);
+    }
+    _update_tpacks(shp, shp->_bvh);
+}
+
+//
+// Build a shape BVH. Public function whose interface is described above.
+//
+YBVH_API void build_bvh(scene* scn, int sid, const build_params& params) {
+    build_bvh(scn->shapes[sid], params);
+}
+
+//
+// Build a shape BVH. Public function whose interface is described above.
+//
+YBVH_API void build_bvh(scene* scn, int sid, heuristic_type htype) {
+    auto params = build_params();
+    params.htype = htype;
+    build_bvh(scn->shapes[sid], params);
+}
+
+//
+// Computes the sah cost of a bvh times its root area, where internal nodes
+// count as one and leaves as their number of primitives.
+//
+static inline double _sah_area(const bvh* bvh) {
+    auto sah_area = 0.0;
+    for (const auto& node : bvh->nodes) {
+        sah_area += _bbox_area(node.bbox) * ((node.isleaf) ? node.count : 1);
+    }
+    return sah_area;
+}
+
+//
+// Sah cost of a bvh from its area sum.
+//
+static inline float _sah_cost(const bvh* bvh) {
+    auto root_area = _bbox_area(bvh->nodes[0].bbox);
+    return (root_area > 0) ? (float)(bvh->sah_area / root_area) : 0;
+}
+
+//
+// Bounds of a shape at times 0 and 1 whose interpolation bounds the shape at
+// all times. The bounds of the first and last keys are grown together by the
+// most that the other keys stick out of their interpolation. Since points
+// move linearly between keys, checking the keys is enough.
+//
+static inline void _motion_bbox(const shape* shp, ym::bbox3f* bbox) {
+    if (shp->frames.size() < 2) {
+        bbox[0] = bbox[1] = shp->world_bbox();
+        return;
+    }
+    auto local_bbox = shp->local_bbox();
+    auto nkeys = (int)shp->frames.size();
+    bbox[0] = ym::transform_bbox(shp->frames.front(), local_bbox);
+    bbox[1] = ym::transform_bbox(shp->frames.back(), local_bbox);
+    auto grow_min = ym::zero3f, grow_max = ym::zero3f;
+    for (auto k = 1; k < nkeys - 1; k++) {
+        auto t = (float)k / (nkeys - 1);
+        auto key_bbox = ym::transform_bbox(shp->frames[k], local_bbox);
+        for (auto a = 0; a < 3; a++) {
+            grow_min[a] = ym::max(grow_min[a],
+                ym::lerp(bbox[0][0][a], bbox[1][0][a], t) - key_bbox[0][a]);
+            grow_max[a] = ym::max(grow_max[a],
+                key_bbox[1][a] - ym::lerp(bbox[0][1][a], bbox[1][1][a], t));
+        }
+    }
+    for (auto i = 0; i < 2; i++) {
+        bbox[i][0] -= grow_min;
+        bbox[i][1] += grow_max;
+    }
+}
+
+//
+// Updates the bounds at times 0 and 1 of a scene bvh node from its children
+// or shapes. The interpolation of the union contains the interpolation of
+// each child, so the node is bounded at all times.
+//
+static inline void _refit_motion(const scene* scn, bvh* bvh, int nid) {
+    const auto& node = bvh->nodes[nid];
+    auto bbox = bvh->motion_bbox.data() + 2 * nid;
+    bbox[0] = bbox[1] = ym::invalid_bbox3f;
+    for (auto i = 0; i < node.count; i++) {
+        ym::bbox3f child_bbox[2];
+        if (node.isleaf) {
+            _motion_bbox(
+                scn->shapes[bvh->sorted_prim[node.start + i]], child_bbox);
+        } else {
+            child_bbox[0] = bvh->motion_bbox[2 * (node.start + i)];
+            child_bbox[1] = bvh->motion_bbox[2 * (node.start + i) + 1];
+        }
+        bbox[0] += child_bbox[0];
+        bbox[1] += child_bbox[1];
+    }
+}
+
+//
+// Initializes the bounds at times 0 and 1 of the scene bvh nodes, children
+// first, if any shape has motion keys. Otherwise clears them, so that the
+// traversal uses the static bounds.
+//
+static inline void _init_motion(scene* scn) {
+    auto bvh = scn->_bvh;
+    bvh->motion_bbox.clear();
+    auto moving = false;
+    for (auto shp : scn->shapes) moving = moving || shp->frames.size() > 1;
+    if (!moving) return;
+    bvh->motion_bbox.resize(bvh->nodes.size() * 2);
+    auto order = std::vector<int>{0};
+    for (auto i = 0; i < (int)order.size(); i++) {
+        const auto& node = bvh->nodes[order[i]];
+        if (node.isleaf) continue;
+        for (auto c = 0; c < node.count; c++) order.push_back(node.start + c);
+    }
+    for (auto i = (int)order.size() - 1; i >= 0; i--)
+        _refit_motion(scn, bvh, order[i]);
+}
+
+//
+// Initializes the data used by update_bvh for the scene bvh: node parents and
+// depths, the leaf of each shape, the wide lanes of each node and the sah
+// cost. Clears the shapes dirty flags.
+//
+static inline void _init_update(scene* scn) {
+    auto bvh = scn->_bvh;
+    auto nnodes = (int)bvh->nodes.size();
+    bvh->parent.assign(nnodes, -1);
+    bvh->depth.assign(nnodes, 0);
+    bvh->prim_leaf.assign(scn->shapes.size(), -1);
+    bvh->touched.assign(nnodes, 0);
+    auto node_stack = std::vector<int>{0};
+    while (!node_stack.empty()) {
+        auto nid = node_stack.back();
+        node_stack.pop_back();
+        const auto& node = bvh->nodes[nid];
+        for (auto i = 0; i < node.count; i++) {
+            if (node.isleaf) {
+                bvh->prim_leaf[bvh->sorted_prim[node.start + i]] = nid;
+            } else {
+                bvh->parent[node.start + i] = nid;
+                bvh->depth[node.start + i] = bvh->depth[nid] + 1;
+                node_stack.push_back(node.start + i);
+            }
+        }
+    }
+    _collapse_bvh(bvh);
+    bvh->sah_area = _sah_area(bvh);
+    bvh->build_sah = _sah_cost(bvh);
+    for (auto shp : scn->shapes) shp->_dirty = false;
+}
+
+//
+// Build a scene BVH. Public function whose interface is described above.
+//
+YBVH_API void build_bvh(scene* scn, const build_params& params) {
+    // do shapes: large shapes use all threads one at a time, while small
+    // shapes are built in parallel on one thread each
+    if (params.do_shapes) {
+        auto small_shapes = std::vector<shape*>();
+        for (auto shp : scn->shapes) {
+            if (shp->instance || shp->_lazy) continue;
+            if (shp->nelems >= YBVH__PARALLEL_MINPRIMS) {
+                build_bvh(shp, params);
+            } else {
+                small_shapes.push_back(shp);
+            }
+        }
+        auto small_params = params;
+        small_params.nthreads = 1;
+        _parallel_for((int)small_shapes.size(), _build_threads(params),
+            [&](int i) { build_bvh(small_shapes[i], small_params); });
+    }
+
+    // create bounded primitives used in BVH build
+    auto bound_prims = std::vector<_bound_prim>(scn->shapes.size());
+    for (auto i = 0; i < bound_prims.size(); i++) {
+        bound_prims[i].pid = i;
+        bound_prims[i].bbox = scn->shapes[i]->world_bbox();
+        bound_prims[i].center = ym::center(bound_prims[i].bbox);
+    }
+
+    // tree bvh; only shapes bvhs can be compressed or use spatial splits,
+    // since updates need each shape in one leaf; scenes with moving shapes
+    // use binary nodes, whose bounds are interpolated at the ray time
+    if (!scn->_bvh) scn->_bvh = new bvh();
+    auto scene_params = params;
+    scene_params.compressed = false;
+    if (scene_params.htype == heuristic_type::sbvh)
+        scene_params.htype = heuristic_type::binned_sah;
+    for (auto shp : scn->shapes)
+        if (shp->frames.size() > 1) scene_params.width = 2;
+    _build_bvh(
+        scn->_bvh, (int)bound_prims.size(), bound_prims.data(), scene_params);
+
+    // init data for incremental updates and motion
+    scn->_params = params;
+    _init_update(scn);
+    _init_motion(scn);
+}
+
+//
+// Build a scene BVH. Public function whose interface is described above.
+//
+YBVH_API void build_bvh(scene* scn, heuristic_type htype, bool do_shapes) {
+    auto params = build_params();
+    params.htype = htype;
+    params.do_shapes = do_shapes;
+    build_bvh(scn, params);
+}
+
+//
+// Recursively recomputes and quantizes the bounds of a compressed bvh node.
+// Returns the node bounds.
+//
+static inline ym::bbox3f _refit_compressed(
+    const shape* shp, bvh* bvh, int qid) {
+    ym::bbox3f lanes_bbox[YBVH__QWIDTH];
+    int ref[YBVH__QWIDTH];
+    auto nlanes = 0;
+    auto leaf = bvh->qnodes[qid].leaf;
+    for (auto l = 0; l < YBVH__QWIDTH; l++) {
+        ref[l] = bvh->qnodes[qid].ref[l];
+        if (ref[l] < 0) break;
+        lanes_bbox[l] = (leaf & (1 << l)) ?
+                            _bound_elem(shp, ref[l]) :
+                            _refit_compressed(shp, bvh, ref[l]);
+        nlanes++;
+    }
+    _encode_qnode(bvh->qnodes[qid], lanes_bbox, ref, nlanes);
+    auto bbox = ym::invalid_bbox3f;
+    for (auto l = 0; l < nlanes; l++) bbox += lanes_bbox[l];
+    return bbox;
+}
+
+//
+// Recursively recomputes the node bounds for a shape bvh
+//
+static inline void _refit_bvh(scene* scn, int sid, int nodeid, bool do_shapes) {
+    // get shape and bvh
+    auto shp = (sid < 0) ? nullptr : scn->shapes[sid];
+    auto bvh = (!shp) ? scn->_bvh : shp->_bvh;
+
+    // compressed bvhs are refit on their own
+    if (bvh->compressed) {
+        bvh->bbox = _refit_compressed(shp, bvh, 0);
+        return;
+    }
+
+    // refit
+    auto node = &bvh->nodes[nodeid];
+    node->bbox = ym::invalid_bbox3f;
+    if (node->isleaf) {
+        if (!shp) {
+            for (auto i = 0; i < node->count; i++) {
+                auto idx = bvh->sorted_prim[node->start + i];
+                if (do_shapes && !scn->shapes[idx]->instance &&
+                    !scn->shapes[idx]->_lazy)
+                    _refit_bvh(scn, idx, 0, false);
+                node->bbox += scn->shapes[idx]->world_bbox();
+            }
+        } else {
+            for (auto i = 0; i < node->count; i++) {
+                auto idx = bvh->sorted_prim[node->start + i];
+                node->bbox += _bound_elem(shp, idx);
+            }
+        }
+    } else {
+        for (auto i = 0; i < node->count; i++) {
+            auto idx = node->start + i;
+            _refit_bvh(scn, sid, idx, do_shapes);
+            node->bbox += bvh->nodes[idx].bbox;
+        }
+    }
+}
+
+//
+// Refits a scene BVH. Public function whose interface is described above.
+//
+YBVH_API void refit_bvh(scene* scn, int sid) {
+    if (scn->shapes[sid]->instance || scn->shapes[sid]->_lazy) {
+        scn->shapes[sid]->_dirty = true;
+        return;
+    }
+    _refit_bvh(scn, sid, 0, false);
+    _collapse_bvh(scn->shapes[sid]->_bvh);
+    _update_tpacks(scn->shapes[sid], scn->shapes[sid]->_bvh);
+    scn->shapes[sid]->_dirty = true;
+}
+
+//
+// Refits a scene BVH. Public function whose interface is described above.
+//
+YBVH_API void refit_bvh(scene* scn, bool do_shapes) {
+    // recompute bvh bounds
+    _refit_bvh(scn, -1, 0, do_shapes);
+
+    // update wide nodes
+    if (do_shapes) {
+        for (auto shp : scn->shapes) {
+            if (shp->instance || shp->_lazy) continue;
+            _collapse_bvh(shp->_bvh);
+            _update_tpacks(shp, shp->_bvh);
+        }
+    }
+    _collapse_bvh(scn->_bvh);
+    if (!scn->_bvh->motion_bbox.empty()) _init_motion(scn);
+
+    // the scene is up to date
+    scn->_bvh->sah_area = _sah_area(scn->_bvh);
+    for (auto shp : scn->shapes) shp->_dirty = false;
+}
+
+//
+// Updates the scene BVH. Public function whose interface is described above.
+//
+// Implementation Notes:
+// - nodes are refit one level at a time from the deepest, so that nodes of
+// the same level can be refit in parallel without relying on the node order
+// - the sah cost is updated with the area change of each refit node
+//
+YBVH_API bool update_bvh(scene* scn, float rebuild_ratio) {
+    auto bvh = scn->_bvh;
+
+    // mark the paths from the moved shapes to the root, by level
+    auto levels = std::vector<std::vector<int>>();
+    for (auto sid = 0; sid < (int)scn->shapes.size(); sid++) {
+        if (!scn->shapes[sid]->_dirty) continue;
+        scn->shapes[sid]->_dirty = false;
+        for (auto nid = bvh->prim_leaf[sid]; nid >= 0 && !bvh->touched[nid];
+             nid = bvh->parent[nid]) {
+            bvh->touched[nid] = 1;
+            if ((int)levels.size() <= bvh->depth[nid])
+                levels.resize(bvh->depth[nid] + 1);
+            levels[bvh->depth[nid]].push_back(nid);
+        }
+    }
+    if (levels.empty()) return false;
+
+    // refit touched nodes bottom up
+    auto nthreads = _build_threads(scn->_params);
+    auto area_delta = std::vector<double>();
+    for (auto d = (int)levels.size() - 1; d >= 0; d--) {
+        const auto& level = levels[d];
+        area_delta.assign(level.size(), 0);
+        auto level_threads = (level.size() < 256) ? 1 : nthreads;
+        _parallel_for((int)level.size(), level_threads, [&](int i) {
+            auto nid = level[i];
+            auto& node = bvh->nodes[nid];
+            auto bbox = ym::invalid_bbox3f;
+            for (auto c = 0; c < node.count; c++) {
+                if (node.isleaf) {
+                    auto sid = bvh->sorted_prim[node.start + c];
+                    bbox += scn->shapes[sid]->world_bbox();
+                } else {
+                    bbox += bvh->nodes[node.start + c].bbox;
+                }
+            }
+            area_delta[i] = (_bbox_area(bbox) - _bbox_area(node.bbox)) *
+                            ((node.isleaf) ? node.count : 1);
+            node.bbox = bbox;
+            if (!bvh->motion_bbox.empty()) _refit_motion(scn, bvh, nid);
+            bvh->touched[nid] = 0;
+            if (!bvh->node_lane.empty() && bvh->node_lane[nid][0] >= 0) {
+                auto wid = bvh->node_lane[nid][0], l = bvh->node_lane[nid][1];
+                for (auto a = 0; a < 3; a++) {
+                    auto set_lane = [&](auto& wnode) {
+                        wnode.bbox[a][l] = bbox[0][a];
+                        wnode.bbox[3 + a][l] = bbox[1][a];
+                    };
+                    if (bvh->width == 4) set_lane(bvh->wnodes4[wid]);
+                    if (bvh->width == 8) set_lane(bvh->wnodes8[wid]);
+                }
+            }
+        });
+        for (auto delta : area_delta) bvh->sah_area += delta;
+    }
+
+    // rebuild if the tree degraded too much
+    if (rebuild_ratio > 0 && _sah_cost(bvh) > rebuild_ratio * bvh->build_sah) {
+        auto params = scn->_params;
+        auto rebuild_params = params;
+        rebuild_params.do_shapes = false;
+        build_bvh(scn, rebuild_params);
+        scn->_params = params;
+        return true;
+    }
+    return false;
+}
+
+// -----------------------------------------------------------------------------
+// BVH CACHE FILES
+// -----------------------------------------------------------------------------
+
+// cache file magic number and version
+#define YBVH__CACHE_MAGIC 0x48564259u  // "YBVH"
+#define YBVH__CACHE_VERSION 5
+
+// alignment of arrays in cache files, so they can be used in place
+#define YBVH__CACHE_ALIGN 64
+
+// number of arrays in cache files
+#define YBVH__CACHE_NARRAYS 13
+
+//
+// Cache file header. Arrays follow the header at the given offsets in the
+// order nodes, sorted_prim, wnodes4, wnodes8, tpacks4, tpacks8, qnodes, and
+// for shape files point, line, triangle, tetra, pos, radius. Element sizes
+// are stored so that files written with a different layout are rejected.
+//
+// This is not part of the public interface.
+//
+struct _cache_header {
+    uint32_t magic = YBVH__CACHE_MAGIC;      // magic number
+    uint32_t version = YBVH__CACHE_VERSION;  // file version
+    uint64_t hash = 0;                       // shape hash
+    uint32_t elem_size[YBVH__CACHE_NARRAYS] = {sizeof(bvhn), sizeof(int),
+        sizeof(bvhw<4>), sizeof(bvhw<8>), sizeof(bvht<4>), sizeof(bvht<8>),
+        sizeof(bvhq), sizeof(int), sizeof(ym::vec2i), sizeof(ym::vec3i),
+        sizeof(ym::vec4i), sizeof(ym::vec3f),
+        sizeof(float)};                     // size of array elements
+    int32_t width = 2;                      // node width
+    int32_t tpack_width = 0;                // triangles per pack
+    int32_t compressed = 0;                 // whether the bvh is compressed
+    int32_t max_depth = 0;                  // depth of the deepest leaf
+    int32_t dups = 0;                       // whether elements may repeat
+    int32_t nelems = 0;                     // number of shape elements
+    int32_t nverts = 0;                     // number of shape vertices
+    float bbox[6];                          // shape bounds
+    uint64_t count[YBVH__CACHE_NARRAYS];   // number of array elements
+    uint64_t offset[YBVH__CACHE_NARRAYS];  // array offsets from the file start
+};
+
+//
+// Hashes size bytes of data, continuing from the hash h, with 64 bits FNV-1a
+// applied to 8 bytes at a time for speed.
+//
+static inline uint64_t _hash_data(uint64_t h, const void* data, size_t size) {
+    const auto prime = (uint64_t)1099511628211ull;
+    auto bytes = (const uint8_t*)data;
+    auto i = (size_t)0;
+    for (; i + 8 <= size; i += 8) {
+        auto word = (uint64_t)0;
+        memcpy(&word, bytes + i, 8);
+        h = (h ^ word) * prime;
+    }
+    for (; i < size; i++) h = (h ^ bytes[i]) * prime;
+    return h;
+}
+
+//
+// Hash a shape for bvh caches. Public function whose interface is described
+// above.
+//
+YBVH_API uint64_t hash_shape(
+    const scene* scn, int sid, const build_params& params) {
+    auto shp = scn->shapes[sid];
+    auto h = (uint64_t)14695981039346656037ull;
+    int32_t header[] = {YBVH__CACHE_VERSION, shp->nelems, shp->nverts,
+        (int)params.htype, params.width, (int)params.compressed,
+        params.triangle_packs, params.treelet_passes, params.line_pieces};
+    h = _hash_data(h, header, sizeof(header));
+    h = _hash_data(h, &params.split_budget, sizeof(params.split_budget));
+    h = _hash_data(h, &params.treelet_time, sizeof(params.treelet_time));
+    if (shp->point) h = _hash_data(h, shp->point, sizeof(int) * shp->nelems);
+    if (shp->line)
+        h = _hash_data(h, shp->line, sizeof(ym::vec2i) * shp->nelems);
+    if (shp->triangle)
+        h = _hash_data(h, shp->triangle, sizeof(ym::vec3i) * shp->nelems);
+    if (shp->tetra)
+        h = _hash_data(h, shp->tetra, sizeof(ym::vec4i) * shp->nelems);
+    h = _hash_data(h, shp->pos, sizeof(ym::vec3f) * shp->nverts);
+    if (shp->radius)
+        h = _hash_data(h, shp->radius, sizeof(float) * shp->nverts);
+    return h;
+}
+
+//
+// Saves a shape bvh to a cache file, together with the shape elements and
+// vertices for shape files.
+//
+static inline bool _save_cache(const scene* scn, int sid,
+    const build_params& params, const std::string& filename, bool geometry) {
+    auto shp = scn->shapes[sid];
+    auto bvh = shp->_bvh;
+    if (!bvh) return false;
+
+    // header
+    auto header = _cache_header();
+    header.hash = hash_shape(scn, sid, params);
+    header.width = bvh->width;
+    header.tpack_width = bvh->tpack_width;
+    header.compressed = bvh->compressed;
+    header.max_depth = bvh->max_depth;
+    header.dups = bvh->dups;
+    header.nelems = shp->nelems;
+    header.nverts = shp->nverts;
+    auto bbox = shp->local_bbox();
+    for (auto i = 0; i < 6; i++) header.bbox[i] = bbox[i / 3][i % 3];
+    const void* data[YBVH__CACHE_NARRAYS] = {bvh->nodes.data(),
+        bvh->sorted_prim.data(), bvh->wnodes4.data(), bvh->wnodes8.data(),
+        bvh->tpacks4.data(), bvh->tpacks8.data(), bvh->qnodes.data(),
+        shp->point, shp->line, shp->triangle, shp->tetra, shp->pos,
+        shp->radius};
+    size_t count[YBVH__CACHE_NARRAYS] = {bvh->nodes.size(),
+        bvh->sorted_prim.size(), bvh->wnodes4.size(), bvh->wnodes8.size(),
+        bvh->tpacks4.size(), bvh->tpacks8.size(), bvh->qnodes.size()};
+    if (geometry) {
+        for (auto a = 7; a < 11; a++) count[a] = (data[a]) ? shp->nelems : 0;
+        count[11] = shp->nverts;
+        count[12] = (shp->radius) ? shp->nverts : 0;
+    }
+    auto align = [](uint64_t offset) {
+        return (offset + YBVH__CACHE_ALIGN - 1) / YBVH__CACHE_ALIGN *
+               YBVH__CACHE_ALIGN;
+    };
+    auto offset = align(sizeof(header));
+    for (auto a = 0; a < YBVH__CACHE_NARRAYS; a++) {
+        header.count[a] = count[a];
+        header.offset[a] = offset;
+        offset = align(offset + count[a] * header.elem_size[a]);
+    }
+
+    // write
+    auto f = fopen(filename.c_str(), "wb");
+    if (!f) return false;
+    char padding[YBVH__CACHE_ALIGN] = {};
+    auto ok = fwrite(&header, sizeof(header), 1, f) == 1;
+    auto pos = (uint64_t)sizeof(header);
+    for (auto a = 0; a < YBVH__CACHE_NARRAYS && ok; a++) {
+        ok = fwrite(padding, 1, header.offset[a] - pos, f) ==
+             header.offset[a] - pos;
+        auto size = count[a] * header.elem_size[a];
+        if (ok && size) ok = fwrite(data[a], 1, size, f) == size;
+        pos = header.offset[a] + size;
+    }
+    ok = fclose(f) == 0 && ok;
+    if (!ok) remove(filename.c_str());
+    return ok;
+}
+
+//
+// Reads a cache file header and checks it against the file size. If cache
+// is given, also maps the file in memory, or reads it into a buffer where
+// mapping is not available. Returns whether the file is valid.
+//
+// Implementation Notes:
+// - files are mapped privately, so that refits modify pages copied on write
+//
+static inline bool _read_cache(const std::string& filename,
+    _cache_header& header, std::unique_ptr<_cache_map>* cache) {
+    // read and check header
+    auto f = fopen(filename.c_str(), "rb");
+    if (!f) return false;
+    auto expected = _cache_header();
+    auto ok = fread(&header, sizeof(header), 1, f) == 1 &&
+              header.magic == expected.magic &&
+              header.version == expected.version &&
+              !memcmp(header.elem_size, expected.elem_size,
+                  sizeof(expected.elem_size));
+    auto file_size = (uint64_t)0;
+    if (ok) {
+        fseek(f, 0, SEEK_END);
+        file_size = (uint64_t)ftell(f);
+        for (auto a = 0; a < YBVH__CACHE_NARRAYS; a++) {
+            // checked by division, since corrupted counts may overflow
+            if (header.offset[a] % YBVH__CACHE_ALIGN ||
+                header.offset[a] > file_size ||
+                header.count[a] >
+                    (file_size - header.offset[a]) / header.elem_size[a])
+                ok = false;
+        }
+    }
+    if (!ok || !cache) {
+        fclose(f);
+        return ok;
+    }
+
+    // map the file, or read it when mapping is not available
+    auto map = std::unique_ptr<_cache_map>(new _cache_map());
+#ifdef YBVH__MMAP
+    auto data = mmap(nullptr, file_size, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+        fileno(f), 0);
+    if (data != MAP_FAILED) {
+        map->data = data;
+        map->size = file_size;
+    }
+#endif
+    if (!map->data) {
+        map->buffer.resize(file_size);
+        fseek(f, 0, SEEK_SET);
+        ok = fread(map->buffer.data(), 1, file_size, f) == file_size;
+        map->data = map->buffer.data();
+        map->size = file_size;
+    }
+    fclose(f);
+    if (ok) *cache = std::move(map);
+    return ok;
+}
+
+//
+// Makes a bvh whose arrays alias the data of a cache file, used in place
+// without copies.
+//
+static inline bvh* _make_cache_bvh(
+    const _cache_header& header, std::unique_ptr<_cache_map> cache) {
+    auto bvh = new ybvh::bvh();
+    auto data = (uint8_t*)cache->data;
+    auto set_array = [&](auto& array, int a) {
+        using T = typename std::remove_reference<decltype(array[0])>::type;
+        array.alias((T*)(data + header.offset[a]), header.count[a]);
+    };
+    set_array(bvh->nodes, 0);
+    set_array(bvh->sorted_prim, 1);
+    set_array(bvh->wnodes4, 2);
+    set_array(bvh->wnodes8, 3);
+    set_array(bvh->tpacks4, 4);
+    set_array(bvh->tpacks8, 5);
+    set_array(bvh->qnodes, 6);
+    bvh->width = header.width;
+    bvh->tpack_width = header.tpack_width;
+    bvh->compressed = header.compressed;
+    bvh->max_depth = header.max_depth;
+    bvh->dups = header.dups;
+    for (auto i = 0; i < 6; i++) bvh->bbox[i / 3][i % 3] = header.bbox[i];
+    bvh->cache = std::move(cache);
+    return bvh;
+}
+
+//
+// Save a shape bvh cache. Public function whose interface is described above.
+//
+YBVH_API bool save_bvh(const scene* scn, int sid, const build_params& params,
+    const std::string& filename) {
+    return _save_cache(scn, sid, params, filename, false);
+}
+
+//
+// Load a shape bvh cache. Public function whose interface is described above.
+//
+YBVH_API bool load_bvh(scene* scn, int sid, const build_params& params,
+    const std::string& filename) {
+    auto header = _cache_header();
+    auto cache = std::unique_ptr<_cache_map>();
+    if (!_read_cache(filename, header, &cache) ||
+        header.hash != hash_shape(scn, sid, params))
+        return false;
+
+    // replace the shape bvh
+    auto shp = scn->shapes[sid];
+    if (shp->_bvh) delete shp->_bvh;
+    shp->_bvh = _make_cache_bvh(header, std::move(cache));
+    return true;
+}
+
+// -----------------------------------------------------------------------------
+// LAZY SHAPES
+// -----------------------------------------------------------------------------
+
+//
+// Save a shape file. Public function whose interface is described above.
+//
+YBVH_API bool save_shape(const scene* scn, int sid, const build_params& params,
+    const std::string& filename) {
+    return _save_cache(scn, sid, params, filename, true);
+}
+
+//
+// Gets the lazy cache of a scene, creating it if needed.
+//
+static inline _lazy_cache* _get_lazy_cache(scene* scn) {
+    if (!scn->_lazy)
+        scn->_lazy = std::unique_ptr<_lazy_cache>(new _lazy_cache());
+    return scn->_lazy.get();
+}
+
+//
+// Set a lazy shape. Public function whose interface is described above.
+//
+YBVH_API bool set_lazy_shape(scene* scn, int sid, const float3x4& frame,
+    const std::string& filename) {
+    // read the bounds and check that the file has the shape data
+    auto header = _cache_header();
+    if (!_read_cache(filename, header, nullptr) || !header.count[11])
+        return false;
+
+    // set shape
+    auto shp = scn->shapes[sid];
+    shp->sid = sid;
+    shp->frame = frame;
+    shp->frames.clear();
+    shp->nelems = 0;
+    shp->point = nullptr;
+    shp->line = nullptr;
+    shp->triangle = nullptr;
+    shp->tetra = nullptr;
+    shp->nverts = 0;
+    shp->pos = nullptr;
+    shp->radius = nullptr;
+    shp->instance = nullptr;
+    if (shp->_bvh) delete shp->_bvh;
+    shp->_bvh = nullptr;
+    _clear_lazy(scn, shp);
+    _get_lazy_cache(scn);
+    shp->_lazy = std::unique_ptr<_lazy_shape>(new _lazy_shape());
+    shp->_lazy->filename = filename;
+    for (auto i = 0; i < 6; i++)
+        shp->_lazy->bbox[i / 3][i % 3] = header.bbox[i];
+    return true;
+}
+
+//
+// Evicts the least recently used resident shapes of a scene, from the back of
+// the use list, except keep, until it is within its budget. Called while
+// holding the lazy cache lock.
+//
+static inline void _evict_lazy(const scene* scn, const _lazy_shape* keep) {
+    auto cache = scn->_lazy.get();
+    while (cache->budget && cache->resident > cache->budget) {
+        auto lru = cache->tail;
+        if (lru == keep) lru = lru->prev;
+        if (!lru) break;
+        _unlink_lazy(cache, lru);
+        std::atomic_store(&lru->resident, std::shared_ptr<shape>());
+        cache->resident -= lru->size;
+        cache->nevictions += 1;
+    }
+}
+
+//
+// Set the lazy shapes budget. Public function whose interface is described
+// above.
+//
+YBVH_API void set_lazy_budget(scene* scn, size_t budget) {
+    auto cache = _get_lazy_cache(scn);
+    std::lock_guard<std::mutex> lock(cache->mutex);
+    cache->budget = budget;
+    _evict_lazy(scn, nullptr);
+}
+
+//
+// Get the lazy shapes stats. Public function whose interface is described
+// above.
+//
+YBVH_API lazy_stats get_lazy_stats(const scene* scn) {
+    auto stats = lazy_stats();
+    if (!scn->_lazy) return stats;
+    std::lock_guard<std::mutex> lock(scn->_lazy->mutex);
+    stats.resident = scn->_lazy->resident;
+    stats.nloads = scn->_lazy->nloads;
+    stats.nevictions = scn->_lazy->nevictions;
+    return stats;
+}
+
+//
+// Loads the data of a lazy shape from its shape file. The shape elements,
+// vertices and bvh alias the file data owned by the bvh. Returns null if the
+// file cannot be read or does not hold a consistent shape.
+//
+static inline std::shared_ptr<shape> _load_lazy(const shape* shp) {
+    auto header = _cache_header();
+    auto cache = std::unique_ptr<_cache_map>();
+    if (!_read_cache(shp->_lazy->filename, header, &cache)) return nullptr;
+
+    // check that the file has one element array and matching vertex data
+    auto nelem_arrays = 0;
+    for (auto a = 7; a <= 10; a++) {
+        if (!header.count[a]) continue;
+        if (header.count[a] != (uint64_t)header.nelems) return nullptr;
+        nelem_arrays++;
+    }
+    if (nelem_arrays != 1 || header.count[11] != (uint64_t)header.nverts ||
+        (header.count[12] && header.count[12] != (uint64_t)header.nverts))
+        return nullptr;
+    auto data = (const uint8_t*)cache->data;
+    auto array = [&](int a) {
+        return (header.count[a]) ? (const void*)(data + header.offset[a]) :
+                                   nullptr;
+    };
+    auto resident = std::make_shared<shape>();
+    resident->sid = shp->sid;
+    resident->frame = shp->frame;
+    resident->nelems = header.nelems;
+    resident->point = (const int*)array(7);
+    resident->line = (const ym::vec2i*)array(8);
+    resident->triangle = (const ym::vec3i*)array(9);
+    resident->tetra = (const ym::vec4i*)array(10);
+    resident->nverts = header.nverts;
+    resident->pos = (const ym::vec3f*)array(11);
+    resident->radius = (const float*)array(12);
+    resident->_bvh = _make_cache_bvh(header, std::move(cache));
+    return resident;
+}
+
+//
+// Gets the resident data of a lazy shape, loading it on first use and then
+// evicting other shapes if over budget. The returned shape stays valid while
+// held, even if evicted. Returns null if the shape file cannot be read.
+//
+// Implementation Notes:
+// - uses are stamped with the number of loads so far, and resident shapes
+// are moved to the front of the use list only at their first use after a
+// load, so that queries take the cache lock once per load instead of once
+// per use; since only loads evict, eviction is least recently used at the
+// granularity of loads
+//
+static inline std::shared_ptr<shape> _acquire_lazy(
+    const scene* scn, const shape* shp) {
+    auto lazy = shp->_lazy.get();
+    auto cache = scn->_lazy.get();
+    auto tick = cache->tick.load(std::memory_order_relaxed);
+    if (lazy->last_use.load(std::memory_order_relaxed) != tick) {
+        std::lock_guard<std::mutex> cache_lock(cache->mutex);
+        lazy->last_use.store(tick, std::memory_order_relaxed);
+        if (lazy->resident && cache->head != lazy) {
+            _unlink_lazy(cache, lazy);
+            _link_lazy(cache, lazy);
+        }
+    }
+    auto resident = std::atomic_load(&lazy->resident);
+    if (resident || lazy->failed) return resident;
+
+    // load once, while other threads using the shape wait for it
+    std::lock_guard<std::mutex> lock(lazy->mutex);
+    resident = std::atomic_load(&lazy->resident);
+    if (resident || lazy->failed) return resident;
+    resident = _load_lazy(shp);
+    if (!resident) {
+        lazy->failed = true;
+        return nullptr;
+    }
+
+    // make it resident, evicting other shapes if over budget
+    std::lock_guard<std::mutex> cache_lock(cache->mutex);
+    std::atomic_store(&lazy->resident, resident);
+    lazy->size = resident->_bvh->cache->size;
+    lazy->last_use = cache->tick.fetch_add(1) + 1;
+    _link_lazy(cache, lazy);
+    cache->resident += lazy->size;
+    cache->nloads += 1;
+    _evict_lazy(scn, lazy);
+    return resident;
+}
+
+// -----------------------------------------------------------------------------
+// BVH INTERSECTION FUNCTIONS
+// -----------------------------------------------------------------------------
+
+//
+// Ray statistics counters of a thread. Counters are written only by their
+// thread, once per query, with relaxed atomics so that they can be read by
+// other threads while collecting. Counters of exiting threads are added to
+// the retired ones, since bvh builds and queries may run on short lived
+// threads.
+//
+// This is not part of the public interface.
+//
+struct _ray_counters {
+    std::atomic<uint64_t> counts[8];
+
+    _ray_counters();
+    ~_ray_counters();
+};
+
+//
+// Registry of the ray counters of all threads.
+//
+// This is not part of the public interface.
+//
+struct _ray_registry {
+    std::atomic<bool> enabled{false};        // whether stats are collected
+    std::mutex mutex;                        // guards the fields below
+    std::vector<_ray_counters*> threads;     // counters of running threads
+    uint64_t retired[8] = {};                // counters of exited threads
+};
+
+//
+// Global registry, never destroyed so that it outlives the threads.
+//
+static inline _ray_registry* _get_ray_registry() {
+    static auto registry = new _ray_registry();
+    return registry;
+}
+
+inline _ray_counters::_ray_counters() {
+    for (auto& c : counts) c.store(0, std::memory_order_relaxed);
+    auto registry = _get_ray_registry();
+    std::lock_guard<std::mutex> lock(registry->mutex);
+    registry->threads.push_back(this);
+}
+
+inline _ray_counters::~_ray_counters() {
+    auto registry = _get_ray_registry();
+    std::lock_guard<std::mutex> lock(registry->mutex);
+    for (auto i = 0; i < 8; i++)
+        registry->retired[i] += counts[i].load(std::memory_order_relaxed);
+    auto& threads = registry->threads;
+    threads.erase(std::find(threads.begin(), threads.end(), this));
+}
+
+//
+// Counters of the calling thread.
+//
+static inline _ray_counters& _get_thread_counters() {
+    static thread_local _ray_counters counters;
+    return counters;
+}
+
+//
+// Conversions between ray stats and counters.
+//
+static inline void _set_ray_stats(ray_stats& stats, const uint64_t* counts) {
+    stats.nrays = counts[0];
+    stats.nnodes = counts[1];
+    stats.nleaves = counts[2];
+    stats.npoint_tests = counts[3];
+    stats.nline_tests = counts[4];
+    stats.ntriangle_tests = counts[5];
+    stats.ntetra_tests = counts[6];
+    stats.ntransforms = counts[7];
+}
+static inline void _get_ray_counts(const ray_stats& stats, uint64_t* counts) {
+    counts[0] = stats.nrays;
+    counts[1] = stats.nnodes;
+    counts[2] = stats.nleaves;
+    counts[3] = stats.npoint_tests;
+    counts[4] = stats.nline_tests;
+    counts[5] = stats.ntriangle_tests;
+    counts[6] = stats.ntetra_tests;
+    counts[7] = stats.ntransforms;
+}
+
+//
+// Returns the stats to count a query into, or null if stats are disabled.
+//
+static inline ray_stats* _begin_ray_stats(ray_stats& stats, int nrays) {
+    if (!_get_ray_registry()->enabled.load(std::memory_order_relaxed))
+        return nullptr;
+    stats.nrays = nrays;
+    return &stats;
+}
 
 //
-// Refits a scene BVH. Public function whose interface is described above.
+// Adds the stats of a query to the counters of the calling thread.
 //
-YBVH_API void refit_bvh(scene* scn, bool do_shapes) {
-    // recompute bvh bounds
-    _refit_bvh(scn, -1, 0, do_shapes);
+static inline void _end_ray_stats(const ray_stats* stats) {
+    if (!stats) return;
+    uint64_t counts[8];
+    _get_ray_counts(*stats, counts);
+    auto& counters = _get_thread_counters();
+    for (auto i = 0; i < 8; i++) {
+        counters.counts[i].store(
+            counters.counts[i].load(std::memory_order_relaxed) + counts[i],
+            std::memory_order_relaxed);
+    }
 }
 
-// -----------------------------------------------------------------------------
-// BVH INTERSECTION FUNCTIONS
-// -----------------------------------------------------------------------------
+//
+// Counts element tests by shape element type.
+//
+static inline void _count_elem_tests(
+    ray_stats* stats, const shape* shp, int count) {
+    if (shp->triangle) {
+        stats->ntriangle_tests += count;
+    } else if (shp->line) {
+        stats->nline_tests += count;
+    } else if (shp->tetra) {
+        stats->ntetra_tests += count;
+    } else {
+        stats->npoint_tests += count;
+    }
+}
 
 //
-// Logging global variables
+// Enables ray stats. Public function whose interface is described above.
 //
-#ifdef YGL_BVH_LOG_RAYS
-int _log_nrays = 0;
-int _log_nbbox_inters = 0;
-int _log_npoint_inters = 0;
-int _log_nline_inters = 0;
-int _log_ntriangle_inters = 0;
+YBVH_API void enable_ray_stats(bool enabled) {
+    _get_ray_registry()->enabled.store(enabled);
+}
 
 //
-// Logging information
+// Gets ray stats. Public function whose interface is described above.
 //
-YBVH_API void get_ray_log(int& nrays, int& nbbox_inters, int& npoint_inters,
-    int& nline_inters, int& ntriangle_inters) {
-    nrays = _log_nrays;
-    nbbox_inters = _log_nbbox_inters;
-    npoint_inters = _log_npoint_inters;
-    nline_inters = _log_nline_inters;
-    ntriangle_inters = _log_ntriangle_inters;
+YBVH_API ray_stats get_ray_stats() {
+    auto registry = _get_ray_registry();
+    std::lock_guard<std::mutex> lock(registry->mutex);
+    uint64_t counts[8];
+    for (auto i = 0; i < 8; i++) counts[i] = registry->retired[i];
+    for (auto counters : registry->threads) {
+        for (auto i = 0; i < 8; i++)
+            counts[i] += counters->counts[i].load(std::memory_order_relaxed);
+    }
+    auto stats = ray_stats();
+    _set_ray_stats(stats, counts);
+    return stats;
 }
 
-#endif
+//
+// Gets thread ray stats. Public function whose interface is described above.
+//
+YBVH_API ray_stats get_thread_ray_stats() {
+    auto& counters = _get_thread_counters();
+    uint64_t counts[8];
+    for (auto i = 0; i < 8; i++)
+        counts[i] = counters.counts[i].load(std::memory_order_relaxed);
+    auto stats = ray_stats();
+    _set_ray_stats(stats, counts);
+    return stats;
+}
+
+//
+// Resets ray stats. Public function whose interface is described above.
+//
+YBVH_API void reset_ray_stats() {
+    auto registry = _get_ray_registry();
+    std::lock_guard<std::mutex> lock(registry->mutex);
+    for (auto i = 0; i < 8; i++) registry->retired[i] = 0;
+    for (auto counters : registry->threads) {
+        for (auto& c : counters->counts) c.store(0, std::memory_order_relaxed);
+    }
+}
 
 //
 // Intersect a shape element. Used in the templated function below.
@@ -1335,6 +4132,436 @@ static inline point _intersect_elem(
     return pt;
 }
 
+//
+// Intersect the children bounds of a wide node with a ray. Returns a bit mask
+// of the children that were hit and their entry distances in tnear.
+//
+// Implementation Notes:
+// - same robust test as the binary nodes; the SIMD min/max instructions
+// return the second operand for NaNs, matching _safemin and _safemax
+//
+template <int N>
+static inline int _intersect_check_wide(const bvhw<N>& node,
+    const ym::ray3f& ray, const ym::vec3f& ray_dinv,
+    const ym::vec3i& ray_dsign, float* tnear) {
+    // pick near and far planes for each axis
+    const float* near_planes[3];
+    const float* far_planes[3];
+    for (auto a = 0; a < 3; a++) {
+        near_planes[a] = node.bbox[(ray_dsign[a]) ? 3 + a : a];
+        far_planes[a] = node.bbox[(ray_dsign[a]) ? a : 3 + a];
+    }
+
+    auto mask = 0;
+#if defined(YBVH__AVX)
+    if (N == 8) {
+        auto tmin = _mm256_set1_ps(ray.tmin), tmax = _mm256_set1_ps(ray.tmax);
+        for (auto a = 0; a < 3; a++) {
+            auto o = _mm256_set1_ps(ray.o[a]);
+            auto dinv = _mm256_set1_ps(ray_dinv[a]);
+            auto t0 = _mm256_mul_ps(
+                _mm256_sub_ps(_mm256_loadu_ps(near_planes[a]), o), dinv);
+            auto t1 = _mm256_mul_ps(
+                _mm256_sub_ps(_mm256_loadu_ps(far_planes[a]), o), dinv);
+            tmin = _mm256_max_ps(t0, tmin);
+            tmax = _mm256_min_ps(t1, tmax);
+        }
+        tmax = _mm256_mul_ps(tmax, _mm256_set1_ps(1.00000024f));
+        _mm256_storeu_ps(tnear, tmin);
+        return _mm256_movemask_ps(_mm256_cmp_ps(tmin, tmax, _CMP_LE_OQ));
+    }
+#endif
+#if defined(YBVH__SSE)
+    for (auto l = 0; l < N; l += 4) {
+        auto tmin = _mm_set1_ps(ray.tmin), tmax = _mm_set1_ps(ray.tmax);
+        for (auto a = 0; a < 3; a++) {
+            auto o = _mm_set1_ps(ray.o[a]);
+            auto dinv = _mm_set1_ps(ray_dinv[a]);
+            auto t0 = _mm_mul_ps(
+                _mm_sub_ps(_mm_loadu_ps(near_planes[a] + l), o), dinv);
+            auto t1 = _mm_mul_ps(
+                _mm_sub_ps(_mm_loadu_ps(far_planes[a] + l), o), dinv);
+            tmin = _mm_max_ps(t0, tmin);
+            tmax = _mm_min_ps(t1, tmax);
+        }
+        tmax = _mm_mul_ps(tmax, _mm_set1_ps(1.00000024f));
+        _mm_storeu_ps(tnear + l, tmin);
+        mask |= _mm_movemask_ps(_mm_cmple_ps(tmin, tmax)) << l;
+    }
+#else
+    for (auto l = 0; l < N; l++) {
+        auto tmin = ray.tmin, tmax = ray.tmax;
+        for (auto a = 0; a < 3; a++) {
+            auto t0 = (near_planes[a][l] - ray.o[a]) * ray_dinv[a];
+            auto t1 = (far_planes[a][l] - ray.o[a]) * ray_dinv[a];
+            tmin = _safemax(t0, tmin);
+            tmax = _safemin(t1, tmax);
+        }
+        tmax *= 1.00000024f;
+        tnear[l] = tmin;
+        if (tmin <= tmax) mask |= 1 << l;
+    }
+#endif
+    return mask;
+}
+
+static inline point _intersect_ray(const scene* scn, int sid,
+    const ym::ray3f& ray_, float ray_time, bool early_exit, ray_stats* stats);
+
+//
+// Intersect a ray with a pack of triangles. Returns a bit mask of the
+// triangles hit, with their ray distances and barycentric coordinates.
+//
+// Implementation Notes:
+// - same operations and rejection tests as _intersect_triangle, so that the
+// results are identical
+//
+template <int N>
+static inline int _intersect_tpack(const bvht<N>& pack, const ym::ray3f& ray,
+    float* ray_t, float* u, float* v) {
+    auto mask = 0;
+#if defined(YBVH__SSE)
+    auto dx = _mm_set1_ps(ray.d[0]), dy = _mm_set1_ps(ray.d[1]),
+         dz = _mm_set1_ps(ray.d[2]);
+    auto zero = _mm_setzero_ps(), one = _mm_set1_ps(1);
+    for (auto l = 0; l < N; l += 4) {
+        auto e1x = _mm_loadu_ps(pack.e1[0] + l),
+             e1y = _mm_loadu_ps(pack.e1[1] + l),
+             e1z = _mm_loadu_ps(pack.e1[2] + l);
+        auto e2x = _mm_loadu_ps(pack.e2[0] + l),
+             e2y = _mm_loadu_ps(pack.e2[1] + l),
+             e2z = _mm_loadu_ps(pack.e2[2] + l);
+        // pvec = cross(d, e2), det = dot(e1, pvec)
+        auto px = _mm_sub_ps(_mm_mul_ps(dy, e2z), _mm_mul_ps(dz, e2y));
+        auto py = _mm_sub_ps(_mm_mul_ps(dz, e2x), _mm_mul_ps(dx, e2z));
+        auto pz = _mm_sub_ps(_mm_mul_ps(dx, e2y), _mm_mul_ps(dy, e2x));
+        auto det = _mm_add_ps(
+            _mm_add_ps(_mm_mul_ps(e1x, px), _mm_mul_ps(e1y, py)),
+            _mm_mul_ps(e1z, pz));
+        auto inv_det = _mm_div_ps(one, det);
+        // tvec = o - v0, u = dot(tvec, pvec) / det
+        auto tx = _mm_sub_ps(
+            _mm_set1_ps(ray.o[0]), _mm_loadu_ps(pack.v0[0] + l));
+        auto ty = _mm_sub_ps(
+            _mm_set1_ps(ray.o[1]), _mm_loadu_ps(pack.v0[1] + l));
+        auto tz = _mm_sub_ps(
+            _mm_set1_ps(ray.o[2]), _mm_loadu_ps(pack.v0[2] + l));
+        auto uu = _mm_mul_ps(
+            _mm_add_ps(_mm_add_ps(_mm_mul_ps(tx, px), _mm_mul_ps(ty, py)),
+                _mm_mul_ps(tz, pz)),
+            inv_det);
+        // qvec = cross(tvec, e1), v = dot(d, qvec) / det, t = dot(e2, qvec)
+        auto qx = _mm_sub_ps(_mm_mul_ps(ty, e1z), _mm_mul_ps(tz, e1y));
+        auto qy = _mm_sub_ps(_mm_mul_ps(tz, e1x), _mm_mul_ps(tx, e1z));
+        auto qz = _mm_sub_ps(_mm_mul_ps(tx, e1y), _mm_mul_ps(ty, e1x));
+        auto vv = _mm_mul_ps(
+            _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, qx), _mm_mul_ps(dy, qy)),
+                _mm_mul_ps(dz, qz)),
+            inv_det);
+        auto tt = _mm_mul_ps(
+            _mm_add_ps(_mm_add_ps(_mm_mul_ps(e2x, qx), _mm_mul_ps(e2y, qy)),
+                _mm_mul_ps(e2z, qz)),
+            inv_det);
+        // reject with the same tests as the scalar code
+        auto reject = _mm_cmpeq_ps(det, zero);
+        reject = _mm_or_ps(reject, _mm_cmplt_ps(uu, zero));
+        reject = _mm_or_ps(reject, _mm_cmpgt_ps(uu, one));
+        reject = _mm_or_ps(reject, _mm_cmplt_ps(vv, zero));
+        reject = _mm_or_ps(reject, _mm_cmpgt_ps(_mm_add_ps(uu, vv), one));
+        reject = _mm_or_ps(reject, _mm_cmplt_ps(tt, _mm_set1_ps(ray.tmin)));
+        reject = _mm_or_ps(reject, _mm_cmpgt_ps(tt, _mm_set1_ps(ray.tmax)));
+        _mm_storeu_ps(ray_t + l, tt);
+        _mm_storeu_ps(u + l, uu);
+        _mm_storeu_ps(v + l, vv);
+        mask |= (~_mm_movemask_ps(reject) & 0xf) << l;
+    }
+#else
+    for (auto l = 0; l < N; l++) {
+        auto e1 = ym::vec3f{pack.e1[0][l], pack.e1[1][l], pack.e1[2][l]};
+        auto e2 = ym::vec3f{pack.e2[0][l], pack.e2[1][l], pack.e2[2][l]};
+        auto pvec = ym::cross(ray.d, e2);
+        auto det = ym::dot(e1, pvec);
+        if (det == 0) continue;
+        auto inv_det = 1.0f / det;
+        auto tvec =
+            ray.o - ym::vec3f{pack.v0[0][l], pack.v0[1][l], pack.v0[2][l]};
+        u[l] = ym::dot(tvec, pvec) * inv_det;
+        if (u[l] < 0 || u[l] > 1) continue;
+        auto qvec = ym::cross(tvec, e1);
+        v[l] = ym::dot(ray.d, qvec) * inv_det;
+        if (v[l] < 0 || u[l] + v[l] > 1) continue;
+        ray_t[l] = ym::dot(e2, qvec) * inv_det;
+        if (ray_t[l] < ray.tmin || ray_t[l] > ray.tmax) continue;
+        mask |= 1 << l;
+    }
+#endif
+    return mask;
+}
+
+//
+// Intersect the triangle packs of a leaf. See _intersect_leaf.
+//
+template <int N>
+static inline bool _intersect_tpacks(const shape* shp,
+    const _array<bvht<N>>& tpacks, int start, int count,
+    ym::ray3f& ray, bool early_exit, point& pt) {
+    auto hit = false;
+    float ray_t[N], u[N], v[N];
+    for (auto p = start / N; p * N < start + count; p++) {
+        const auto& pack = tpacks[p];
+        auto mask = _intersect_tpack(pack, ray, ray_t, u, v);
+        if (!mask) continue;
+        for (auto l = 0; l < N; l++) {
+            if (!(mask & (1 << l)) || pack.eid[l] < 0) continue;
+            if (ray_t[l] > ray.tmax) continue;
+            hit = true;
+            pt.dist = ray_t[l];
+            pt.euv = {1 - u[l] - v[l], u[l], v[l], 0};
+            pt.eid = pack.eid[l];
+            pt.sid = shp->sid;
+            ray.tmax = pt.dist;
+            if (early_exit) return true;
+        }
+    }
+    return hit;
+}
+
+//
+// Intersect the primitives of a leaf, stored from start to start+count in the
+// sorted primitive array, updating the closest point pt and the ray tmax.
+// Returns whether a hit was found.
+//
+static inline bool _intersect_leaf(const scene* scn, const shape* shp,
+    const bvh* bvh, int start, int count, ym::ray3f& ray, float ray_time,
+    bool early_exit, point& pt, ray_stats* stats) {
+    // stats
+    if (stats) {
+        stats->nleaves += 1;
+        if (shp) _count_elem_tests(stats, shp, count);
+    }
+
+    // triangle packs
+    switch (bvh->tpack_width) {
+        case 4:
+            return _intersect_tpacks(
+                shp, bvh->tpacks4, start, count, ray, early_exit, pt);
+        case 8:
+            return _intersect_tpacks(
+                shp, bvh->tpacks8, start, count, ray, early_exit, pt);
+        default: break;
+    }
+
+    auto hit = false;
+    for (auto i = 0; i < count; i++) {
+        auto idx = bvh->sorted_prim[start + i];
+        auto pp = (!shp) ? _intersect_ray(
+                               scn, idx, ray, ray_time, early_exit, stats) :
+                           _intersect_elem(shp, idx, ray, early_exit);
+        if (pp) {
+            hit = true;
+            pt = pp;
+            ray.tmax = pt.dist;
+            if (early_exit) return true;
+        }
+    }
+    return hit;
+}
+
+//
+// Size of the stack needed to walk a bvh pushing the children of each node,
+// up to width of them, after popping it.
+//
+static inline int _stack_size(const bvh* bvh, int width) {
+    return bvh->max_depth * (width - 1) + width;
+}
+
+//
+// Transforms a ray to the frame of a shape at a time. Frames of moving shapes
+// are not rigid between keys, so they are inverted as affine matrices; ray
+// directions are not normalized, so that ray distances do not change.
+//
+static inline ym::ray3f _transform_ray_inverse(
+    const shape* shp, const ym::ray3f& ray, float time) {
+    if (shp->frames.size() < 2)
+        return ym::transform_ray_inverse(shp->frame, ray);
+    auto frame = shp->frame_at(time);
+    auto minv = ym::inverse(ym::rot(frame));
+    return {
+        minv * (ray.o - ym::pos(frame)), minv * ray.d, ray.tmin, ray.tmax};
+}
+
+//
+// Bounds of a node at a time, interpolated from the ones at times 0 and 1
+// for scene bvhs with moving shapes.
+//
+static inline ym::bbox3f _node_bbox(
+    const bvh* bvh, const ym::bbox3f* motion_bbox, int nid, float time) {
+    if (!motion_bbox) return bvh->nodes[nid].bbox;
+    const auto &a = motion_bbox[2 * nid], &b = motion_bbox[2 * nid + 1];
+    return {ym::lerp(a[0], b[0], time), ym::lerp(a[1], b[1], time)};
+}
+
+//
+// Entry of the binary ray traversal stack: a node whose bounds were hit and
+// the ray distance at which the ray enters them.
+//
+struct _ray_entry {
+    int nid;
+    float tnear;
+};
+
+//
+// Entry of the wide ray traversal stack: a wide node, or a leaf range with
+// its primitive count, and the ray distance at which the ray enters it.
+//
+struct _wide_entry {
+    int start;
+    int count;
+    float tnear;
+};
+
+//
+// Intersect ray with a wide bvh. See _intersect_ray below for the details.
+// All children bounds of a node are tested at once, then the children hit
+// are pushed on the stack from the farthest to the closest, so that they are
+// visited front to back. Leaf children are pushed too, with their primitive
+// count, so that they are intersected in order. As in the binary walk,
+// entries that start past the closest hit found after they were pushed are
+// popped without visiting them.
+//
+template <int N>
+static inline point _intersect_ray_wide(const scene* scn, const shape* shp,
+    const bvh* bvh, const _array<bvhw<N>>& wnodes, ym::ray3f& ray,
+    float ray_time, bool early_exit, ray_stats* stats) {
+    // node stack of wide node indices or leaf ranges
+    _stack<_wide_entry, 64 * (N - 1) + N> stack(_stack_size(bvh, N));
+    auto node_stack = stack.data();
+    auto node_cur = 0;
+    node_stack[node_cur++] = {0, 0, 0};
+
+    // shared variables
+    auto pt = point();
+
+    // prepare ray for fast queries
+    auto ray_dinv = ym::vec3f{1, 1, 1} / ray.d;
+    auto ray_dsign = ym::vec3i{(ray_dinv[0] < 0) ? 1 : 0,
+        (ray_dinv[1] < 0) ? 1 : 0, (ray_dinv[2] < 0) ? 1 : 0};
+
+    // walking stack
+    float tnear[N];
+    int lanes[N];
+    while (node_cur) {
+        // grab node, skipping it if it starts past the closest hit so far
+        auto entry = node_stack[--node_cur];
+        if (entry.tnear > ray.tmax * 1.00000024f) continue;
+        if (stats) stats->nnodes += 1;
+
+        // intersect leaves
+        if (entry.count) {
+            if (_intersect_leaf(scn, shp, bvh, entry.start, entry.count, ray,
+                    ray_time, early_exit, pt, stats) &&
+                early_exit)
+                return pt;
+            continue;
+        }
+
+        // intersect all children bounds
+        const auto& node = wnodes[entry.start];
+        auto mask =
+            _intersect_check_wide(node, ray, ray_dinv, ray_dsign, tnear);
+
+        // sort children hit from the farthest to the closest
+        auto nlanes = 0;
+        for (auto l = 0; l < N; l++) {
+            if (!(mask & (1 << l)) || node.start[l] < 0) continue;
+            auto j = nlanes++;
+            while (j > 0 && tnear[lanes[j - 1]] < tnear[l]) {
+                lanes[j] = lanes[j - 1];
+                j--;
+            }
+            lanes[j] = l;
+        }
+
+        // push children
+        for (auto i = 0; i < nlanes; i++) {
+            auto l = lanes[i];
+            node_stack[node_cur++] = {node.start[l], node.count[l], tnear[l]};
+            assert(node_cur <= stack.size());
+        }
+    }
+
+    return pt;
+}
+
+//
+// Intersect ray with a compressed shape bvh. Children bounds are decoded and
+// tested as wide node lanes. Primitives are intersected as soon as their
+// bounds are hit, while children nodes are pushed from the farthest to the
+// closest.
+//
+static inline point _intersect_ray_compressed(const shape* shp,
+    const bvh* bvh, ym::ray3f& ray, bool early_exit, ray_stats* stats) {
+    // node stack
+    _stack<int, 64 * (YBVH__QWIDTH - 1) + YBVH__QWIDTH> stack(
+        _stack_size(bvh, YBVH__QWIDTH));
+    auto node_stack = stack.data();
+    auto node_cur = 0;
+    node_stack[node_cur++] = 0;
+
+    // shared variables
+    auto pt = point();
+
+    // prepare ray for fast queries
+    auto ray_dinv = ym::vec3f{1, 1, 1} / ray.d;
+    auto ray_dsign = ym::vec3i{(ray_dinv[0] < 0) ? 1 : 0,
+        (ray_dinv[1] < 0) ? 1 : 0, (ray_dinv[2] < 0) ? 1 : 0};
+
+    // walking stack
+    auto wnode = bvhw<YBVH__QWIDTH>();
+    float tnear[YBVH__QWIDTH];
+    int lanes[YBVH__QWIDTH];
+    while (node_cur) {
+        // decode node and intersect all children bounds
+        const auto& qnode = bvh->qnodes[node_stack[--node_cur]];
+        _decode_qnode(qnode, wnode);
+        auto mask =
+            _intersect_check_wide(wnode, ray, ray_dinv, ray_dsign, tnear);
+        if (stats) stats->nnodes += 1;
+
+        // intersect primitives and sort children from farthest to closest
+        auto nlanes = 0;
+        for (auto l = 0; l < YBVH__QWIDTH; l++) {
+            if (!(mask & (1 << l)) || qnode.ref[l] < 0) continue;
+            if (qnode.leaf & (1 << l)) {
+                if (stats) {
+                    stats->nleaves += 1;
+                    _count_elem_tests(stats, shp, 1);
+                }
+                auto pp = _intersect_elem(shp, qnode.ref[l], ray, early_exit);
+                if (!pp) continue;
+                pt = pp;
+                ray.tmax = pt.dist;
+                if (early_exit) return pt;
+            } else {
+                auto j = nlanes++;
+                while (j > 0 && tnear[lanes[j - 1]] < tnear[l]) {
+                    lanes[j] = lanes[j - 1];
+                    j--;
+                }
+                lanes[j] = l;
+            }
+        }
+
+        // push children
+        for (auto i = 0; i < nlanes; i++) {
+            node_stack[node_cur++] = qnode.ref[lanes[i]];
+            assert(node_cur <= stack.size());
+        }
+    }
+
+    return pt;
+}
+
 //
 // Intersect ray with a bvh-> Similar to the generic public function whose
 // interface is described above. See intersect_ray for parameter docs.
@@ -1349,102 +4576,507 @@ static inline point _intersect_elem(
 // traversal, we will speed up computation significantly while simplifying
 // the code; note in fact that all subsequence farthest iterations will be
 // rejected in the tmax tests
+// - Both children bounds are tested before pushing, and only the ones hit are
+// pushed, ordered by their entry distance; entries that start past the
+// closest hit found after they were pushed are popped without visiting them
+// - Wide and compressed bvhs are walked with their own loops
 //
-static inline point _intersect_ray(
-    const scene* scn, int sid, const ym::ray3f& ray_, bool early_exit) {
+static inline point _intersect_ray(const scene* scn, int sid,
+    const ym::ray3f& ray_, float ray_time, bool early_exit, ray_stats* stats) {
     // get shape and bvh
     auto shp = (sid < 0) ? nullptr : scn->shapes[sid];
     auto bvh = (!shp) ? scn->_bvh : shp->_bvh;
 
-    // node stack
-    int node_stack[64];
-    auto node_cur = 0;
-    node_stack[node_cur++] = 0;
-
     // copy ray and transform it if necessary
-    auto ray = (!shp) ? ray_ : ym::transform_ray_inverse(shp->frame, ray_);
+    auto ray = (!shp) ? ray_ : _transform_ray_inverse(shp, ray_, ray_time);
+    if (shp && stats) stats->ntransforms += 1;
+
+    // instances intersect their prototype
+    if (shp && shp->instance) {
+        auto pt = _intersect_ray(
+            shp->instance, -1, ray, ray_time, early_exit, stats);
+        if (pt) pt.iid = sid;
+        return pt;
+    }
 
-    // shared variables
-    auto pt = point();
+    // lazy shapes intersect their resident data, kept while in use
+    auto resident = std::shared_ptr<shape>();
+    if (shp && shp->_lazy) {
+        resident = _acquire_lazy(scn, shp);
+        if (!resident) return {};
+        shp = resident.get();
+        bvh = shp->_bvh;
+    }
+
+    // compressed bvhs
+    if (bvh->compressed)
+        return _intersect_ray_compressed(shp, bvh, ray, early_exit, stats);
+
+    // wide bvhs
+    switch (bvh->width) {
+        case 4:
+            return _intersect_ray_wide(scn, shp, bvh, bvh->wnodes4, ray,
+                ray_time, early_exit, stats);
+        case 8:
+            return _intersect_ray_wide(scn, shp, bvh, bvh->wnodes8, ray,
+                ray_time, early_exit, stats);
+        default: break;
+    }
 
     // prepare ray for fast queries
     auto ray_dinv = ym::vec3f{1, 1, 1} / ray.d;
     auto ray_dsign = ym::vec3i{(ray_dinv[0] < 0) ? 1 : 0,
         (ray_dinv[1] < 0) ? 1 : 0, (ray_dinv[2] < 0) ? 1 : 0};
-    auto ray_reverse = ym::vec<bool, 4>{
-        (bool)ray_dsign[0], (bool)ray_dsign[1], (bool)ray_dsign[2], false};
+
+    // shared variables
+    auto pt = point();
+    auto motion_bbox =
+        (bvh->motion_bbox.empty()) ? nullptr : bvh->motion_bbox.data();
+
+    // node stack of nodes whose bounds were hit, with their entry distance
+    _stack<_ray_entry, 64> stack(_stack_size(bvh, 2));
+    auto node_stack = stack.data();
+    auto node_cur = 0;
+    auto root_tnear = 0.0f;
+    if (!_intersect_check_bbox(ray, ray_dinv, ray_dsign,
+            _node_bbox(bvh, motion_bbox, 0, ray_time), root_tnear))
+        return pt;
+    node_stack[node_cur++] = {0, root_tnear};
+
+    // walking stack
+    while (node_cur) {
+        // grab node, skipping it if it starts past the closest hit so far
+        auto entry = node_stack[--node_cur];
+        if (entry.tnear > ray.tmax * 1.00000024f) continue;
+        const auto& node = bvh->nodes[entry.nid];
+        if (stats) stats->nnodes += 1;
+
+        // intersect leaves
+        if (node.isleaf) {
+            if (_intersect_leaf(scn, shp, bvh, node.start, node.count, ray,
+                    ray_time, early_exit, pt, stats) &&
+                early_exit)
+                return pt;
+            continue;
+        }
+
+        // intersect both children bounds and push the ones hit, the
+        // farthest first so that the closest is visited next
+        float tnear[2];
+        auto hit0 = _intersect_check_bbox(ray, ray_dinv, ray_dsign,
+            _node_bbox(bvh, motion_bbox, node.start, ray_time), tnear[0]);
+        auto hit1 = _intersect_check_bbox(ray, ray_dinv, ray_dsign,
+            _node_bbox(bvh, motion_bbox, node.start + 1, ray_time), tnear[1]);
+        if (hit0 && hit1) {
+            auto first = (tnear[1] < tnear[0]) ? 1 : 0;
+            node_stack[node_cur++] = {
+                (int)node.start + 1 - first, tnear[1 - first]};
+            node_stack[node_cur++] = {(int)node.start + first, tnear[first]};
+        } else if (hit0) {
+            node_stack[node_cur++] = {(int)node.start, tnear[0]};
+        } else if (hit1) {
+            node_stack[node_cur++] = {(int)node.start + 1, tnear[1]};
+        }
+        assert(node_cur <= stack.size());
+    }
+
+    return pt;
+}
+
+//
+// Shape intersection at a time
+//
+YBVH_API point intersect_ray(const scene* scn, int sid, const float3& ray_o,
+    const float3& ray_d, float ray_tmin, float ray_tmax, float ray_time,
+    bool early_exit) {
+    auto stats = ray_stats();
+    auto pstats = _begin_ray_stats(stats, 1);
+    auto pt = _intersect_ray(scn, sid, {ray_o, ray_d, ray_tmin, ray_tmax},
+        ym::clamp(ray_time, 0.0f, 1.0f), early_exit, pstats);
+    _end_ray_stats(pstats);
+    return pt;
+}
+
+//
+// Scene intersection at a time
+//
+YBVH_API point intersect_ray(const scene* scn, const float3& ray_o,
+    const float3& ray_d, float ray_tmin, float ray_tmax, float ray_time,
+    bool early_exit) {
+    return intersect_ray(
+        scn, -1, ray_o, ray_d, ray_tmin, ray_tmax, ray_time, early_exit);
+}
+
+//
+// Shape intersection
+//
+YBVH_API point intersect_ray(const scene* scn, int sid, const float3& ray_o,
+    const float3& ray_d, float ray_tmin, float ray_tmax, bool early_exit) {
+    return intersect_ray(
+        scn, sid, ray_o, ray_d, ray_tmin, ray_tmax, 0, early_exit);
+}
+
+//
+// Scene intersection
+//
+YBVH_API point intersect_ray(const scene* scn, const float3& ray_o,
+    const float3& ray_d, float ray_tmin, float ray_tmax, bool early_exit) {
+    return intersect_ray(
+        scn, -1, ray_o, ray_d, ray_tmin, ray_tmax, 0, early_exit);
+}
+
+// -----------------------------------------------------------------------------
+// BVH PACKET INTERSECTION FUNCTIONS
+// -----------------------------------------------------------------------------
+
+// number of rays in a packet
+#define YBVH__PACKET 8
+
+//
+// Packet of rays stored in SoA layout. Lanes are tested together against
+// each node bounds.
+//
+struct _ray_packet {
+    float o[3][YBVH__PACKET];     // origins
+    float d[3][YBVH__PACKET];     // directions
+    float dinv[3][YBVH__PACKET];  // inverse directions
+    float tmin[YBVH__PACKET];     // ray min distance
+    float tmax[YBVH__PACKET];     // ray max distance
+    float time[YBVH__PACKET];     // ray time
+};
+
+//
+// Sets a packet lane from a ray.
+//
+static inline void _set_packet_ray(
+    _ray_packet& packet, int l, const ym::ray3f& ray) {
+    for (auto a = 0; a < 3; a++) {
+        packet.o[a][l] = ray.o[a];
+        packet.d[a][l] = ray.d[a];
+        packet.dinv[a][l] = 1 / ray.d[a];
+    }
+    packet.tmin[l] = ray.tmin;
+    packet.tmax[l] = ray.tmax;
+}
+
+//
+// Gets a ray from a packet lane.
+//
+static inline ym::ray3f _get_packet_ray(const _ray_packet& packet, int l) {
+    return {{packet.o[0][l], packet.o[1][l], packet.o[2][l]},
+        {packet.d[0][l], packet.d[1][l], packet.d[2][l]}, packet.tmin[l],
+        packet.tmax[l]};
+}
+
+//
+// Intersect the active rays of a packet with a bounding box. Returns the
+// mask of the rays that hit the box.
+//
+// Implementation Notes:
+// - same robust test as the single ray, where the near and far planes are
+// chosen per lane from the sign of the inverse direction
+//
+static inline int _intersect_check_packet(
+    const _ray_packet& packet, int mask, const ym::bbox3f& bbox) {
+    auto hit = 0;
+#if defined(YBVH__SSE)
+    for (auto l = 0; l < YBVH__PACKET; l += 4) {
+        if (!(mask & (0xf << l))) continue;
+        auto tmin = _mm_loadu_ps(packet.tmin + l);
+        auto tmax = _mm_loadu_ps(packet.tmax + l);
+        for (auto a = 0; a < 3; a++) {
+            auto o = _mm_loadu_ps(packet.o[a] + l);
+            auto dinv = _mm_loadu_ps(packet.dinv[a] + l);
+            auto bmin = _mm_set1_ps(bbox[0][a]), bmax = _mm_set1_ps(bbox[1][a]);
+            auto neg = _mm_cmplt_ps(dinv, _mm_setzero_ps());
+            auto near_plane =
+                _mm_or_ps(_mm_and_ps(neg, bmax), _mm_andnot_ps(neg, bmin));
+            auto far_plane =
+                _mm_or_ps(_mm_and_ps(neg, bmin), _mm_andnot_ps(neg, bmax));
+            auto t0 = _mm_mul_ps(_mm_sub_ps(near_plane, o), dinv);
+            auto t1 = _mm_mul_ps(_mm_sub_ps(far_plane, o), dinv);
+            tmin = _mm_max_ps(t0, tmin);
+            tmax = _mm_min_ps(t1, tmax);
+        }
+        tmax = _mm_mul_ps(tmax, _mm_set1_ps(1.00000024f));
+        hit |= _mm_movemask_ps(_mm_cmple_ps(tmin, tmax)) << l;
+    }
+#else
+    for (auto l = 0; l < YBVH__PACKET; l++) {
+        if (!(mask & (1 << l))) continue;
+        auto tmin = packet.tmin[l], tmax = packet.tmax[l];
+        for (auto a = 0; a < 3; a++) {
+            auto dinv = packet.dinv[a][l];
+            auto t0 = (bbox[(dinv < 0) ? 1 : 0][a] - packet.o[a][l]) * dinv;
+            auto t1 = (bbox[(dinv < 0) ? 0 : 1][a] - packet.o[a][l]) * dinv;
+            tmin = _safemax(t0, tmin);
+            tmax = _safemin(t1, tmax);
+        }
+        tmax *= 1.00000024f;
+        if (tmin <= tmax) hit |= 1 << l;
+    }
+#endif
+    return hit & mask;
+}
+
+//
+// Intersect a packet of rays with a bvh. Similar to _intersect_ray, but
+// each node is tested against all active rays and it is skipped only if no
+// ray hits it. Updates the hits for the rays in mask and returns the mask of
+// the rays whose hit changed.
+//
+// Implementation Notes:
+// - packets always walk the binary nodes, since their cost is amortized
+// across rays
+// - rays in a packet may have different times, so scene nodes are tested
+// with their bounds over all times instead of the interpolated ones
+// - rays that find a hit are deactivated if early_exit is set
+//
+static inline int _intersect_packet(const scene* scn, int sid,
+    const _ray_packet& packet_, int mask, bool early_exit, point* hits,
+    ray_stats* stats) {
+    // get shape and bvh
+    auto shp = (sid < 0) ? nullptr : scn->shapes[sid];
+    auto bvh = (!shp) ? scn->_bvh : shp->_bvh;
+
+    // instances intersect their prototype
+    if (shp && shp->instance) {
+        auto packet = packet_;
+        for (auto l = 0; l < YBVH__PACKET; l++) {
+            if (!(mask & (1 << l))) continue;
+            _set_packet_ray(packet, l,
+                _transform_ray_inverse(
+                    shp, _get_packet_ray(packet_, l), packet_.time[l]));
+            if (stats) stats->ntransforms += 1;
+        }
+        auto hit = _intersect_packet(
+            shp->instance, -1, packet, mask, early_exit, hits, stats);
+        for (auto l = 0; l < YBVH__PACKET; l++) {
+            if (hit & (1 << l)) hits[l].iid = sid;
+        }
+        return hit;
+    }
+
+    // compressed bvhs and lazy shapes are traversed one ray at a time
+    if ((shp && shp->_lazy) || bvh->compressed) {
+        auto hit = 0;
+        for (auto l = 0; l < YBVH__PACKET; l++) {
+            if (!(mask & (1 << l))) continue;
+            auto pp = _intersect_ray(scn, sid, _get_packet_ray(packet_, l),
+                packet_.time[l], early_exit, stats);
+            if (!pp) continue;
+            hits[l] = pp;
+            hit |= 1 << l;
+        }
+        return hit;
+    }
+
+    // copy packet and transform it if necessary
+    auto packet = packet_;
+    if (shp) {
+        for (auto l = 0; l < YBVH__PACKET; l++) {
+            if (!(mask & (1 << l))) continue;
+            _set_packet_ray(packet, l,
+                _transform_ray_inverse(
+                    shp, _get_packet_ray(packet_, l), packet_.time[l]));
+            if (stats) stats->ntransforms += 1;
+        }
+    }
+
+    // node stack of node indices and ray masks
+    _stack<ym::vec2i, 64> stack(_stack_size(bvh, 2));
+    auto node_stack = stack.data();
+    auto node_cur = 0;
+    node_stack[node_cur++] = {0, mask};
+
+    // rays hit so far
+    auto hit = 0;
 
     // walking stack
     while (node_cur) {
         // grab node
-        auto node = bvh->nodes[node_stack[--node_cur]];
+        auto node_mask = node_stack[--node_cur];
+        const auto& node = bvh->nodes[node_mask[0]];
+        if (stats) stats->nnodes += 1;
 
-        // intersect bbox
-        if (!_intersect_check_bbox(ray, ray_dinv, ray_dsign, node.bbox))
-            continue;
+        // skip rays deactivated by early exit and intersect bbox
+        auto node_active = node_mask[1] & mask;
+        if (!node_active) continue;
+        node_active = _intersect_check_packet(packet, node_active, node.bbox);
+        if (!node_active) continue;
 
         // intersect node, switching based on node type
-        // for each type, iterate over the the primitive list
         if (!node.isleaf) {
-            // for internal nodes, attempts to proceed along the
-            // split axis from smallest to largest nodes
-            if (ray_reverse[node.axis]) {
+            // proceed along the split axis using the first active ray
+            auto first = 0;
+            while (!(node_active & (1 << first))) first++;
+            if (packet.d[node.axis][first] < 0) {
                 for (auto i = 0; i < node.count; i++) {
-                    auto idx = node.start + i;
-                    node_stack[node_cur++] = idx;
-                    assert(node_cur < 64);
+                    node_stack[node_cur++] = {(int)node.start + i, node_active};
+                    assert(node_cur <= stack.size());
                 }
             } else {
                 for (auto i = node.count - 1; i >= 0; i--) {
-                    auto idx = node.start + i;
-                    node_stack[node_cur++] = idx;
-                    assert(node_cur < 64);
-                }
-            }
-        } else {
-            if (!shp) {
-                for (auto i = 0; i < node.count; i++) {
-                    auto idx = bvh->sorted_prim[node.start + i];
-                    auto pp = point();
-                    if ((pp = _intersect_ray(scn, idx, ray, early_exit))) {
-                        if (early_exit) return pp;
-                        pt = pp;
-                        ray.tmax = pt.dist;
-                    }
+                    node_stack[node_cur++] = {(int)node.start + i, node_active};
+                    assert(node_cur <= stack.size());
                 }
-            } else {
-                for (auto i = 0; i < node.count; i++) {
-                    auto idx = bvh->sorted_prim[node.start + i];
-                    auto pp = point();
-                    if ((pp = _intersect_elem(shp, idx, ray, early_exit))) {
-                        if (early_exit) return pp;
-                        pt = pp;
-                        ray.tmax = pt.dist;
+            }
+        } else if (shp && bvh->tpack_width) {
+            // triangle packs are intersected one ray at a time
+            if (stats) stats->nleaves += 1;
+            for (auto l = 0; l < YBVH__PACKET; l++) {
+                if (!(node_active & (1 << l))) continue;
+                if (stats) _count_elem_tests(stats, shp, node.count);
+                auto ray = _get_packet_ray(packet, l);
+                if (!_intersect_leaf(scn, shp, bvh, node.start, node.count,
+                        ray, packet.time[l], early_exit, hits[l], nullptr))
+                    continue;
+                packet.tmax[l] = hits[l].dist;
+                hit |= 1 << l;
+                if (early_exit) mask &= ~(1 << l);
+            }
+        } else {
+            if (stats) stats->nleaves += 1;
+            for (auto i = 0; i < node.count && node_active; i++) {
+                auto idx = bvh->sorted_prim[node.start + i];
+                auto prim_hit = 0;
+                if (!shp) {
+                    prim_hit = _intersect_packet(
+                        scn, idx, packet, node_active, early_exit, hits, stats);
+                } else {
+                    for (auto l = 0; l < YBVH__PACKET; l++) {
+                        if (!(node_active & (1 << l))) continue;
+                        if (stats) _count_elem_tests(stats, shp, 1);
+                        auto pp = _intersect_elem(
+                            shp, idx, _get_packet_ray(packet, l), early_exit);
+                        if (!pp) continue;
+                        hits[l] = pp;
+                        prim_hit |= 1 << l;
                     }
                 }
+                for (auto l = 0; l < YBVH__PACKET; l++) {
+                    if (prim_hit & (1 << l)) packet.tmax[l] = hits[l].dist;
+                }
+                hit |= prim_hit;
+                if (early_exit) {
+                    mask &= ~prim_hit;
+                    node_active &= ~prim_hit;
+                }
             }
         }
     }
 
-    return pt;
+    return hit;
 }
 
 //
-// Shape intersection
+// Intersect an array of rays in packets. Rays are grouped by direction octant
+// keeping their order, so that coherent rays end up in the same packets.
 //
-YBVH_API point intersect_ray(const scene* scn, int sid, const float3& ray_o,
-    const float3& ray_d, float ray_tmin, float ray_tmax, bool early_exit) {
-    return _intersect_ray(
-        scn, sid, {ray_o, ray_d, ray_tmin, ray_tmax}, early_exit);
+static inline void _intersect_rays(const scene* scn, int sid, int nrays,
+    const float3* ray_o, const float3* ray_d, const float* ray_tmin,
+    const float* ray_tmax, const float* ray_time, bool early_exit,
+    point* hits) {
+    // ray times in [0,1]
+    auto time = [ray_time](int i) {
+        return (ray_time) ? ym::clamp(ray_time[i], 0.0f, 1.0f) : 0.0f;
+    };
+
+    // stats
+    auto stats = ray_stats();
+    auto pstats = _begin_ray_stats(stats, nrays);
+
+    // group rays by octant with a counting sort
+    auto octant = [ray_d](int i) {
+        return ((ray_d[i][0] < 0) ? 1 : 0) | ((ray_d[i][1] < 0) ? 2 : 0) |
+               ((ray_d[i][2] < 0) ? 4 : 0);
+    };
+    int octant_start[9] = {0, 0, 0, 0, 0, 0, 0, 0, 0};
+    for (auto i = 0; i < nrays; i++) octant_start[octant(i) + 1] += 1;
+    for (auto o = 0; o < 8; o++) octant_start[o + 1] += octant_start[o];
+    auto sorted_ray = std::vector<int>(nrays);
+    for (auto i = 0; i < nrays; i++) sorted_ray[octant_start[octant(i)]++] = i;
+
+    // traverse packets
+    for (auto start = 0; start < nrays; start += YBVH__PACKET) {
+        auto count = std::min(YBVH__PACKET, nrays - start);
+
+        // incoherent packets are traced one ray at a time, since their rays
+        // rarely share nodes
+        auto first_d = ym::normalize(ym::vec3f(ray_d[sorted_ray[start]]));
+        auto coherent = true;
+        for (auto l = 1; l < count && coherent; l++) {
+            auto d = ym::normalize(ym::vec3f(ray_d[sorted_ray[start + l]]));
+            coherent = ym::dot(first_d, d) > 0.9f;
+        }
+        if (!coherent) {
+            for (auto l = 0; l < count; l++) {
+                auto idx = sorted_ray[start + l];
+                hits[idx] = _intersect_ray(scn, sid,
+                    {ray_o[idx], ray_d[idx], ray_tmin[idx], ray_tmax[idx]},
+                    time(idx), early_exit, pstats);
+            }
+            continue;
+        }
+
+        auto packet = _ray_packet();
+        point packet_hits[YBVH__PACKET];
+        for (auto l = 0; l < YBVH__PACKET; l++) {
+            // unused lanes copy the first ray and are masked out
+            auto idx = sorted_ray[start + ((l < count) ? l : 0)];
+            _set_packet_ray(packet, l,
+                {ray_o[idx], ray_d[idx], ray_tmin[idx], ray_tmax[idx]});
+            packet.time[l] = time(idx);
+        }
+        _intersect_packet(scn, sid, packet, (1 << count) - 1, early_exit,
+            packet_hits, pstats);
+        for (auto l = 0; l < count; l++)
+            hits[sorted_ray[start + l]] = packet_hits[l];
+    }
+
+    // stats
+    _end_ray_stats(pstats);
 }
 
 //
-// Scene intersection
+// Shape packet intersection at ray times
 //
-YBVH_API point intersect_ray(const scene* scn, const float3& ray_o,
-    const float3& ray_d, float ray_tmin, float ray_tmax, bool early_exit) {
-    return _intersect_ray(
-        scn, -1, {ray_o, ray_d, ray_tmin, ray_tmax}, early_exit);
+YBVH_API void intersect_rays(const scene* scn, int sid, int nrays,
+    const float3* ray_o, const float3* ray_d, const float* ray_tmin,
+    const float* ray_tmax, const float* ray_time, bool early_exit,
+    point* hits) {
+    _intersect_rays(scn, sid, nrays, ray_o, ray_d, ray_tmin, ray_tmax,
+        ray_time, early_exit, hits);
+}
+
+//
+// Scene packet intersection at ray times
+//
+YBVH_API void intersect_rays(const scene* scn, int nrays, const float3* ray_o,
+    const float3* ray_d, const float* ray_tmin, const float* ray_tmax,
+    const float* ray_time, bool early_exit, point* hits) {
+    _intersect_rays(scn, -1, nrays, ray_o, ray_d, ray_tmin, ray_tmax,
+        ray_time, early_exit, hits);
+}
+
+//
+// Shape packet intersection
+//
+YBVH_API void intersect_rays(const scene* scn, int sid, int nrays,
+    const float3* ray_o, const float3* ray_d, const float* ray_tmin,
+    const float* ray_tmax, bool early_exit, point* hits) {
+    _intersect_rays(scn, sid, nrays, ray_o, ray_d, ray_tmin, ray_tmax,
+        nullptr, early_exit, hits);
+}
+
+//
+// Scene packet intersection
+//
+YBVH_API void intersect_rays(const scene* scn, int nrays, const float3* ray_o,
+    const float3* ray_d, const float* ray_tmin, const float* ray_tmax,
+    bool early_exit, point* hits) {
+    _intersect_rays(scn, -1, nrays, ray_o, ray_d, ray_tmin, ray_tmax,
+        nullptr, early_exit, hits);
 }
 
 // -----------------------------------------------------------------------------
@@ -1519,17 +5151,67 @@ static inline point _overlap_point(const scene* scn, int sid,
     auto shp = (sid < 0) ? nullptr : scn->shapes[sid];
     auto bvh = (!shp) ? scn->_bvh : shp->_bvh;
 
+    // get point
+    auto pos = (!shp) ? pos_ : transform_point_inverse(shp->frame, pos_);
+
+    // instances overlap their prototype
+    if (shp && shp->instance) {
+        auto pt = _overlap_point(shp->instance, -1, pos, max_dist, early_exit);
+        if (pt) pt.iid = sid;
+        return pt;
+    }
+
+    // lazy shapes overlap their resident data, kept while in use
+    auto resident = std::shared_ptr<shape>();
+    if (shp && shp->_lazy) {
+        resident = _acquire_lazy(scn, shp);
+        if (!resident) return {};
+        shp = resident.get();
+        bvh = shp->_bvh;
+    }
+
     // node stack
-    int node_stack[64];
+    _stack<int, 64> stack(_stack_size(bvh, 2));
+    auto node_stack = stack.data();
     auto node_cur = 0;
     node_stack[node_cur++] = 0;
 
-    // get point
-    auto pos = (!shp) ? pos_ : transform_point_inverse(shp->frame, pos_);
-
     // shared variables
     auto pt = point();
 
+    // compressed bvhs decode the children bounds of each node
+    if (bvh->compressed) {
+        _stack<int, 64 * (YBVH__QWIDTH - 1) + YBVH__QWIDTH> qstack(
+            _stack_size(bvh, YBVH__QWIDTH));
+        auto qnode_stack = qstack.data();
+        auto qnode_cur = 0;
+        qnode_stack[qnode_cur++] = 0;
+        auto wnode = bvhw<YBVH__QWIDTH>();
+        while (qnode_cur) {
+            const auto& qnode = bvh->qnodes[qnode_stack[--qnode_cur]];
+            _decode_qnode(qnode, wnode);
+            for (auto l = 0; l < YBVH__QWIDTH; l++) {
+                if (qnode.ref[l] < 0) continue;
+                auto bbox = ym::bbox3f{
+                    {wnode.bbox[0][l], wnode.bbox[1][l], wnode.bbox[2][l]},
+                    {wnode.bbox[3][l], wnode.bbox[4][l], wnode.bbox[5][l]}};
+                if (!_distance_check_bbox(pos, max_dist, bbox)) continue;
+                if (qnode.leaf & (1 << l)) {
+                    auto pp = _overlap_elem(
+                        shp, qnode.ref[l], pos, max_dist, early_exit);
+                    if (!pp) continue;
+                    if (early_exit) return pp;
+                    pt = pp;
+                    max_dist = pt.dist;
+                } else {
+                    qnode_stack[qnode_cur++] = qnode.ref[l];
+                    assert(qnode_cur <= qstack.size());
+                }
+            }
+        }
+        return pt;
+    }
+
     // walking stack
     while (node_cur) {
         // grab node
@@ -1544,7 +5226,7 @@ static inline point _overlap_point(const scene* scn, int sid,
             // internal node
             for (auto idx = node.start; idx < node.start + node.count; idx++) {
                 node_stack[node_cur++] = idx;
-                assert(node_cur < 64);
+                assert(node_cur <= stack.size());
             }
         } else {
             if (!shp) {
@@ -1592,6 +5274,432 @@ YBVH_API point overlap_point(
     return _overlap_point(scn, -1, pos, max_dist, early_exit);
 }
 
+//
+// Closest points of a point to the triangles of a pack, computed for all
+// lanes at once with the same regions as _closestuv_triangle. Regions are
+// evaluated without branches, selecting them from the lowest to the highest
+// priority. Writes squared distances and uvs for each lane.
+//
+template <int N>
+static inline void _closest_tpack(const bvht<N>& pack, const ym::vec3f& pos,
+    float* dist2, float* u, float* v) {
+#if defined(YBVH__SSE)
+    auto zero = _mm_setzero_ps(), one = _mm_set1_ps(1);
+    auto select = [](__m128 mask, __m128 a, __m128 b) {
+        return _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b));
+    };
+    for (auto l = 0; l < N; l += 4) {
+        auto abx = _mm_loadu_ps(pack.e1[0] + l),
+             aby = _mm_loadu_ps(pack.e1[1] + l),
+             abz = _mm_loadu_ps(pack.e1[2] + l);
+        auto acx = _mm_loadu_ps(pack.e2[0] + l),
+             acy = _mm_loadu_ps(pack.e2[1] + l),
+             acz = _mm_loadu_ps(pack.e2[2] + l);
+        auto apx = _mm_sub_ps(
+            _mm_set1_ps(pos[0]), _mm_loadu_ps(pack.v0[0] + l));
+        auto apy = _mm_sub_ps(
+            _mm_set1_ps(pos[1]), _mm_loadu_ps(pack.v0[1] + l));
+        auto apz = _mm_sub_ps(
+            _mm_set1_ps(pos[2]), _mm_loadu_ps(pack.v0[2] + l));
+        auto dot = [](__m128 ax, __m128 ay, __m128 az, __m128 bx, __m128 by,
+                       __m128 bz) {
+            return _mm_add_ps(
+                _mm_add_ps(_mm_mul_ps(ax, bx), _mm_mul_ps(ay, by)),
+                _mm_mul_ps(az, bz));
+        };
+        // dot products with bp = ap - ab and cp = ap - ac
+        auto abab = dot(abx, aby, abz, abx, aby, abz);
+        auto abac = dot(abx, aby, abz, acx, acy, acz);
+        auto acac = dot(acx, acy, acz, acx, acy, acz);
+        auto d1 = dot(abx, aby, abz, apx, apy, apz);
+        auto d2 = dot(acx, acy, acz, apx, apy, apz);
+        auto d3 = _mm_sub_ps(d1, abab), d4 = _mm_sub_ps(d2, abac);
+        auto d5 = _mm_sub_ps(d1, abac), d6 = _mm_sub_ps(d2, acac);
+        auto va = _mm_sub_ps(_mm_mul_ps(d3, d6), _mm_mul_ps(d5, d4));
+        auto vb = _mm_sub_ps(_mm_mul_ps(d5, d2), _mm_mul_ps(d1, d6));
+        auto vc = _mm_sub_ps(_mm_mul_ps(d1, d4), _mm_mul_ps(d3, d2));
+        // face
+        auto denom = _mm_div_ps(one, _mm_add_ps(_mm_add_ps(va, vb), vc));
+        auto uu = _mm_mul_ps(vb, denom), vv = _mm_mul_ps(vc, denom);
+        // edge bc
+        auto d43 = _mm_sub_ps(d4, d3), d56 = _mm_sub_ps(d5, d6);
+        auto mask = _mm_and_ps(_mm_cmple_ps(va, zero),
+            _mm_and_ps(_mm_cmpge_ps(d43, zero), _mm_cmpge_ps(d56, zero)));
+        auto w = _mm_div_ps(d43, _mm_add_ps(d43, d56));
+        uu = select(mask, _mm_sub_ps(one, w), uu);
+        vv = select(mask, w, vv);
+        // edge ac
+        mask = _mm_and_ps(_mm_cmple_ps(vb, zero),
+            _mm_and_ps(_mm_cmpge_ps(d2, zero), _mm_cmple_ps(d6, zero)));
+        uu = select(mask, zero, uu);
+        vv = select(mask, _mm_div_ps(d2, _mm_sub_ps(d2, d6)), vv);
+        // vertex c
+        mask = _mm_and_ps(_mm_cmpge_ps(d6, zero), _mm_cmple_ps(d5, d6));
+        uu = select(mask, zero, uu);
+        vv = select(mask, one, vv);
+        // edge ab
+        mask = _mm_and_ps(_mm_cmple_ps(vc, zero),
+            _mm_and_ps(_mm_cmpge_ps(d1, zero), _mm_cmple_ps(d3, zero)));
+        uu = select(mask, _mm_div_ps(d1, _mm_sub_ps(d1, d3)), uu);
+        vv = select(mask, zero, vv);
+        // vertex b
+        mask = _mm_and_ps(_mm_cmpge_ps(d3, zero), _mm_cmple_ps(d4, d3));
+        uu = select(mask, one, uu);
+        vv = select(mask, zero, vv);
+        // vertex a
+        mask = _mm_and_ps(_mm_cmple_ps(d1, zero), _mm_cmple_ps(d2, zero));
+        uu = select(mask, zero, uu);
+        vv = select(mask, zero, vv);
+        // distance from p to v0 + u * ab + v * ac
+        auto dx = _mm_sub_ps(
+            apx, _mm_add_ps(_mm_mul_ps(uu, abx), _mm_mul_ps(vv, acx)));
+        auto dy = _mm_sub_ps(
+            apy, _mm_add_ps(_mm_mul_ps(uu, aby), _mm_mul_ps(vv, acy)));
+        auto dz = _mm_sub_ps(
+            apz, _mm_add_ps(_mm_mul_ps(uu, abz), _mm_mul_ps(vv, acz)));
+        _mm_storeu_ps(dist2 + l, dot(dx, dy, dz, dx, dy, dz));
+        _mm_storeu_ps(u + l, uu);
+        _mm_storeu_ps(v + l, vv);
+    }
+#else
+    for (auto l = 0; l < N; l++) {
+        auto v0 = ym::vec3f{pack.v0[0][l], pack.v0[1][l], pack.v0[2][l]};
+        auto e1 = ym::vec3f{pack.e1[0][l], pack.e1[1][l], pack.e1[2][l]};
+        auto e2 = ym::vec3f{pack.e2[0][l], pack.e2[1][l], pack.e2[2][l]};
+        auto uv = _closestuv_triangle(pos, v0, v0 + e1, v0 + e2);
+        dist2[l] = ym::distsqr(pos, v0 + e1 * uv[0] + e2 * uv[1]);
+        u[l] = uv[0];
+        v[l] = uv[1];
+    }
+#endif
+}
+
+//
+// Visits the triangles of a leaf stored in packs, like _overlap_elem does
+// for each element. Only for shapes without radius.
+//
+template <int N, typename Visit>
+static inline void _overlap_tpacks(const shape* shp,
+    const _array<bvht<N>>& tpacks, int start, int count,
+    const ym::vec3f& pos, float& max_dist, int iid, const Visit& visit) {
+    float dist2[N], u[N], v[N];
+    for (auto p = start / N; p * N < start + count; p++) {
+        const auto& pack = tpacks[p];
+        _closest_tpack(pack, pos, dist2, u, v);
+        for (auto l = 0; l < N; l++) {
+            if (pack.eid[l] < 0 || dist2[l] > max_dist * max_dist) continue;
+            auto pt = point();
+            pt.dist = std::sqrt(dist2[l]);
+            pt.euv = {1 - u[l] - v[l], u[l], v[l], 0};
+            pt.eid = pack.eid[l];
+            pt.sid = shp->sid;
+            pt.iid = iid;
+            max_dist = visit(pt);
+        }
+    }
+}
+
+//
+// Finds all elements within max_dist of a point, calling visit for each of
+// them with its closest point. Visit returns the new max distance, so that
+// queries can shrink it as they go. Hits are reported for the instance iid.
+// Walks the same nodes as _overlap_point, but tests triangle packs together.
+// If unique, elements of shapes with duplicate references, from spatial splits
+// or line pieces, are visited once for each walk of the shape, i.e. once per
+// instance path.
+//
+template <typename Visit>
+static inline void _overlap_points(const scene* scn, int sid,
+    const ym::vec3f& pos_, float& max_dist, int iid, const Visit& visit,
+    bool unique = false) {
+    // get shape and bvh
+    auto shp = (sid < 0) ? nullptr : scn->shapes[sid];
+    auto bvh = (!shp) ? scn->_bvh : shp->_bvh;
+
+    // get point
+    auto pos = (!shp) ? pos_ : transform_point_inverse(shp->frame, pos_);
+
+    // instances overlap their prototype
+    if (shp && shp->instance) {
+        _overlap_points(shp->instance, -1, pos, max_dist,
+            (iid < 0) ? sid : iid, visit, unique);
+        return;
+    }
+
+    // lazy shapes overlap their resident data, kept while in use
+    auto resident = std::shared_ptr<shape>();
+    if (shp && shp->_lazy) {
+        resident = _acquire_lazy(scn, shp);
+        if (!resident) return;
+        shp = resident.get();
+        bvh = shp->_bvh;
+    }
+
+    // visit an element, skipping copies already visited if unique
+    auto visited = std::unordered_set<int>();
+    auto visit_shape = [&](const point& pt) {
+        if (unique && bvh->dups && !visited.insert(pt.eid).second)
+            return max_dist;
+        return visit(pt);
+    };
+    auto visit_elem = [&](int eid) {
+        auto pt = _overlap_elem(shp, eid, pos, max_dist, false);
+        if (!pt) return;
+        pt.iid = iid;
+        max_dist = visit_shape(pt);
+    };
+
+    // compressed bvhs decode the children bounds of each node
+    if (bvh->compressed) {
+        _stack<int, 64 * (YBVH__QWIDTH - 1) + YBVH__QWIDTH> qstack(
+            _stack_size(bvh, YBVH__QWIDTH));
+        auto qnode_stack = qstack.data();
+        auto qnode_cur = 0;
+        qnode_stack[qnode_cur++] = 0;
+        auto wnode = bvhw<YBVH__QWIDTH>();
+        while (qnode_cur) {
+            const auto& qnode = bvh->qnodes[qnode_stack[--qnode_cur]];
+            _decode_qnode(qnode, wnode);
+            for (auto l = 0; l < YBVH__QWIDTH; l++) {
+                if (qnode.ref[l] < 0) continue;
+                auto bbox = ym::bbox3f{
+                    {wnode.bbox[0][l], wnode.bbox[1][l], wnode.bbox[2][l]},
+                    {wnode.bbox[3][l], wnode.bbox[4][l], wnode.bbox[5][l]}};
+                if (!_distance_check_bbox(pos, max_dist, bbox)) continue;
+                if (qnode.leaf & (1 << l)) {
+                    visit_elem(qnode.ref[l]);
+                } else {
+                    qnode_stack[qnode_cur++] = qnode.ref[l];
+                    assert(qnode_cur <= qstack.size());
+                }
+            }
+        }
+        return;
+    }
+
+    // node stack
+    _stack<int, 64> stack(_stack_size(bvh, 2));
+    auto node_stack = stack.data();
+    auto node_cur = 0;
+    node_stack[node_cur++] = 0;
+
+    // walking stack
+    while (node_cur) {
+        // grab node
+        const auto& node = bvh->nodes[node_stack[--node_cur]];
+
+        // intersect bbox
+        if (!_distance_check_bbox(pos, max_dist, node.bbox)) continue;
+
+        // intersect node, switching based on node type
+        if (!node.isleaf) {
+            for (auto idx = node.start; idx < node.start + node.count; idx++) {
+                node_stack[node_cur++] = idx;
+                assert(node_cur <= stack.size());
+            }
+        } else if (shp && bvh->tpack_width && !shp->radius) {
+            if (bvh->tpack_width == 4) {
+                _overlap_tpacks(shp, bvh->tpacks4, node.start, node.count, pos,
+                    max_dist, iid, visit_shape);
+            } else {
+                _overlap_tpacks(shp, bvh->tpacks8, node.start, node.count, pos,
+                    max_dist, iid, visit_shape);
+            }
+        } else {
+            for (auto i = 0; i < node.count; i++) {
+                auto idx = bvh->sorted_prim[node.start + i];
+                if (idx < 0) continue;
+                if (!shp) {
+                    _overlap_points(
+                        scn, idx, pos, max_dist, iid, visit, unique);
+                } else {
+                    visit_elem(idx);
+                }
+            }
+        }
+    }
+}
+
+//
+// Order of query results, by distance first and then by element to break
+// ties deterministically.
+//
+static inline bool _query_less(const point& a, const point& b) {
+    if (a.dist != b.dist) return a.dist < b.dist;
+    if (a.iid != b.iid) return a.iid < b.iid;
+    if (a.sid != b.sid) return a.sid < b.sid;
+    return a.eid < b.eid;
+}
+
+//
+// Finds the k nearest elements with a max heap of the closest elements
+// found so far, whose top bounds the search once full. Elements may appear
+// more than once in shapes with duplicate references, so the walk skips their
+// copies. Returns the number of elements found, written sorted to out.
+//
+static inline int _knn_query(const scene* scn, const ym::vec3f& pos, int k,
+    float max_dist, point* out, std::vector<point>& heap) {
+    heap.clear();
+    if (k <= 0) return 0;
+    _overlap_points(scn, -1, pos, max_dist, -1, [&](const point& pt) {
+        if ((int)heap.size() < k) {
+            heap.push_back(pt);
+            std::push_heap(heap.begin(), heap.end(), _query_less);
+        } else if (_query_less(pt, heap.front())) {
+            std::pop_heap(heap.begin(), heap.end(), _query_less);
+            heap.back() = pt;
+            std::push_heap(heap.begin(), heap.end(), _query_less);
+        }
+        return ((int)heap.size() < k) ? max_dist : heap.front().dist;
+    }, true);
+    std::sort_heap(heap.begin(), heap.end(), _query_less);
+    for (auto i = 0; i < (int)heap.size(); i++) out[i] = heap[i];
+    return (int)heap.size();
+}
+
+//
+// Nearest neighbors query. Public function whose interface is described
+// above.
+//
+YBVH_API int knn_query(const scene* scn, const float3& pos, int k,
+    float max_dist, point* out) {
+    auto heap = std::vector<point>();
+    heap.reserve(k);
+    return _knn_query(scn, pos, k, max_dist, out, heap);
+}
+
+//
+// Radius query. Public function whose interface is described above.
+//
+YBVH_API void radius_query(const scene* scn, const float3& pos, float radius,
+    const std::function<void(const point&)>& callback) {
+    _overlap_points(scn, -1, pos, radius, -1,
+        [&](const point& pt) {
+            callback(pt);
+            return radius;
+        },
+        true);
+}
+
+// number of queries per task in batched queries
+#define YBVH__QUERY_CHUNK 64
+
+//
+// Batched nearest neighbors query. Public function whose interface is
+// described above.
+//
+YBVH_API void knn_queries(const scene* scn, int nqueries, const float3* pos,
+    int k, float max_dist, point* out, int* nfound) {
+    auto nchunks = (nqueries + YBVH__QUERY_CHUNK - 1) / YBVH__QUERY_CHUNK;
+    _parallel_for(nchunks, _build_threads(scn->_params), [&](int c) {
+        auto heap = std::vector<point>();
+        heap.reserve(k);
+        auto end = std::min(nqueries, (c + 1) * YBVH__QUERY_CHUNK);
+        for (auto q = c * YBVH__QUERY_CHUNK; q < end; q++) {
+            auto n = _knn_query(scn, pos[q], k, max_dist, out + q * k, heap);
+            for (auto i = n; i < k; i++) out[q * k + i] = point();
+            if (nfound) nfound[q] = n;
+        }
+    });
+}
+
+//
+// Batched radius query. Public function whose interface is described above.
+//
+YBVH_API void radius_queries(const scene* scn, int nqueries,
+    const float3* pos, float radius,
+    const std::function<void(int, const point&)>& callback) {
+    auto nchunks = (nqueries + YBVH__QUERY_CHUNK - 1) / YBVH__QUERY_CHUNK;
+    _parallel_for(nchunks, _build_threads(scn->_params), [&](int c) {
+        auto end = std::min(nqueries, (c + 1) * YBVH__QUERY_CHUNK);
+        for (auto q = c * YBVH__QUERY_CHUNK; q < end; q++) {
+            auto max_dist = radius;
+            _overlap_points(scn, -1, pos[q], max_dist, -1,
+                [&](const point& pt) {
+                    callback(q, pt);
+                    return radius;
+                },
+                true);
+        }
+    });
+}
+
+//
+// Closest element to a point, like _overlap_point without early exit.
+//
+static inline point _overlap_closest(
+    const scene* scn, const ym::vec3f& pos, float max_dist) {
+    auto pt = point();
+    _overlap_points(scn, -1, pos, max_dist, -1, [&](const point& pp) {
+        pt = pp;
+        return pp.dist;
+    });
+    return pt;
+}
+
+//
+// Batched closest points. Public function whose interface is described above.
+//
+// Implementation Notes:
+// - Queries are sorted along a Morton curve in their bounds, so that each
+// task walks nearby points that visit the same nodes.
+// - Since the distance to the scene changes at most as much as the query
+// point moves, the distance found for the previous query in a task bounds
+// the search for the next one, which culls most of the nodes in dense
+// queries like distance field grids. If nothing is found within the bound,
+// because of rounding, the query is repeated with the full max_dist.
+//
+YBVH_API void overlap_points(const scene* scn, int npoints,
+    const float3* pos, float max_dist, point* out) {
+    if (npoints <= 0) return;
+    auto nthreads = _build_threads(scn->_params);
+
+    // morton codes in the query bounds
+    const auto nbits = 10;
+    auto bbox = ym::invalid_bbox3f;
+    for (auto i = 0; i < npoints; i++) bbox += ym::vec3f(pos[i]);
+    auto size = ym::diagonal(bbox);
+    auto codes = std::vector<uint64_t>(npoints);
+    auto order = std::vector<int>(npoints);
+    auto nchunks = (npoints + YBVH__QUERY_CHUNK - 1) / YBVH__QUERY_CHUNK;
+    _parallel_for(nchunks, nthreads, [&](int c) {
+        auto scale = (float)((1 << nbits) - 1);
+        auto end = std::min(npoints, (c + 1) * YBVH__QUERY_CHUNK);
+        for (auto i = c * YBVH__QUERY_CHUNK; i < end; i++) {
+            uint64_t code = 0;
+            for (auto a = 0; a < 3; a++) {
+                auto q = (size[a] > 0) ? (pos[i][a] - bbox[0][a]) / size[a] :
+                                         0.0f;
+                auto qi = (uint64_t)ym::clamp(q * scale, 0.0f, scale);
+                code |= _morton_expand(qi, nbits) << (2 - a);
+            }
+            codes[i] = code;
+            order[i] = i;
+        }
+    });
+    _radix_sort(codes, order, nbits * 3, nthreads);
+
+    // closest points in morton order
+    _parallel_for(nchunks, nthreads, [&](int c) {
+        auto end = std::min(npoints, (c + 1) * YBVH__QUERY_CHUNK);
+        auto last = -1;
+        for (auto i = c * YBVH__QUERY_CHUNK; i < end; i++) {
+            auto q = order[i];
+            auto qpos = ym::vec3f(pos[q]);
+            auto pt = point();
+            if (last >= 0 && out[last]) {
+                auto bound = out[last].dist +
+                             ym::dist(qpos, ym::vec3f(pos[last]));
+                bound += bound * 1e-5f;
+                if (bound < max_dist) pt = _overlap_closest(scn, qpos, bound);
+            }
+            if (!pt) pt = _overlap_closest(scn, qpos, max_dist);
+            out[q] = pt;
+            last = q;
+        }
+    });
+}
+
 // -----------------------------------------------------------------------------
 // BVH CLOSEST ELEMENT LOOKUP FOR INTERNAL ELEMENTS
 // -----------------------------------------------------------------------------
@@ -1683,6 +5791,113 @@ static inline void _overlap_elem(const shape* shp1, const shape* shp2, int idx1,
     }
 }
 
+// number of nodes of the smaller bvh below which overlap queries are not
+// split into tasks
+#define YBVH__OVERLAP_MINNODES 8192
+
+// number of tasks overlap queries are split into
+#define YBVH__OVERLAP_NTASKS 256
+
+//
+// Appends to children the pairs of children of the nodes node1 and node2,
+// with indices node_idx, that are not both leaves. Pairs are pushed in
+// stack order, so the last one is visited first.
+//
+static inline void _overlap_children(const ym::vec2i& node_idx,
+    const bvhn& node1, const bvhn& node2, ym::vec2i* children, int& nchildren) {
+    if (node1.isleaf) {
+        for (auto idx2 = node2.start; idx2 < node2.start + node2.count;
+             idx2++) {
+            children[nchildren++] = {node_idx[0], (int)idx2};
+        }
+    } else if (node2.isleaf) {
+        for (auto idx1 = node1.start; idx1 < node1.start + node1.count;
+             idx1++) {
+            children[nchildren++] = {(int)idx1, node_idx[1]};
+        }
+    } else {
+        for (auto idx2 = node2.start; idx2 < node2.start + node2.count;
+             idx2++) {
+            for (auto idx1 = node1.start; idx1 < node1.start + node1.count;
+                 idx1++) {
+                children[nchildren++] = {(int)idx1, (int)idx2};
+            }
+        }
+    }
+}
+
+//
+// Walks the pairs of nodes of two bvhs from the pair start, calling leaf on
+// the pairs of leaves whose bounds pass check.
+//
+template <typename Check, typename Leaf>
+static inline void _overlap_walk(const bvh* bvh1, const bvh* bvh2,
+    const ym::vec2i& start, const Check& check, const Leaf& leaf) {
+    // node stack
+    _stack<ym::vec2i, 128> stack(
+        3 * (bvh1->max_depth + bvh2->max_depth) + 1);
+    auto node_stack = stack.data();
+    auto node_cur = 0;
+    node_stack[node_cur++] = start;
+
+    // walking stack
+    while (node_cur) {
+        // grab node
+        const auto node_idx = node_stack[--node_cur];
+        const auto& node1 = bvh1->nodes[node_idx[0]];
+        const auto& node2 = bvh2->nodes[node_idx[1]];
+
+        // intersect bbox
+        if (!check(node1, node2)) continue;
+
+        // check for leaves or descend
+        if (node1.isleaf && node2.isleaf) {
+            leaf(node1, node2);
+        } else {
+            _overlap_children(node_idx, node1, node2, node_stack, node_cur);
+            assert(node_cur <= stack.size());
+        }
+    }
+}
+
+//
+// Splits the walk of two bvhs into tasks, which are node pairs to walk from.
+// Pairs that pass check are replaced by their children, in visit order,
+// until there are enough of them. Walking the tasks in order visits the
+// leaves in the same order as a single walk, so results are deterministic
+// and independent of the number of threads. Small bvhs give a single task.
+//
+template <typename Check>
+static inline std::vector<ym::vec2i> _overlap_tasks(
+    const bvh* bvh1, const bvh* bvh2, const Check& check) {
+    auto tasks = std::vector<ym::vec2i>{{0, 0}};
+    if (ym::min(bvh1->nodes.size(), bvh2->nodes.size()) <
+        YBVH__OVERLAP_MINNODES)
+        return tasks;
+    auto expanded = true;
+    while (expanded && tasks.size() < YBVH__OVERLAP_NTASKS) {
+        expanded = false;
+        auto next = std::vector<ym::vec2i>();
+        for (auto node_idx : tasks) {
+            const auto& node1 = bvh1->nodes[node_idx[0]];
+            const auto& node2 = bvh2->nodes[node_idx[1]];
+            if (!check(node1, node2)) continue;
+            if (node1.isleaf && node2.isleaf) {
+                next.push_back(node_idx);
+                continue;
+            }
+            ym::vec2i children[64];
+            auto nchildren = 0;
+            _overlap_children(node_idx, node1, node2, children, nchildren);
+            for (auto c = nchildren - 1; c >= 0; c--)
+                next.push_back(children[c]);
+            expanded = true;
+        }
+        tasks = std::move(next);
+    }
+    return tasks;
+}
+
 //
 // Finds the closest element for all pairs of vertices.
 // Similar to the generic public function whose
@@ -1700,21 +5915,31 @@ static inline void _overlap_elem(const shape* shp1, const shape* shp2, int idx1,
 // traversal, we will speed up computation significantly while simplifying
 // the code; note in fact that all subsequent farthest iterations will be
 // rejected in the tmax tests
+// - Large shapes are split into tasks walked on nthreads threads; tasks
+// collect their own overlaps that are merged in task order, keeping the
+// closest one for each vertex if first_only
+// - Bvhs with duplicate references, from spatial splits or line pieces, find
+// the same element and vertex pair once per reference, so the merge keeps
+// only the first one
 //
 static inline void _overlap_verts(const scene* scn1, const scene* scn2,
     int sid1, int sid2, bool exclude_self, float radius, bool first_only,
     std::vector<std::pair<point, int2>>* overlaps,
-    std::unordered_map<int, int>* closest) {
+    std::unordered_map<int, int>* closest, int nthreads) {
     // get shape and bvh
     auto shp1 = (sid1 < 0) ? nullptr : scn1->shapes[sid1];
     auto bvh1 = (!shp1) ? scn1->_bvh : shp1->_bvh;
     auto shp2 = (sid2 < 0) ? nullptr : scn2->shapes[sid2];
     auto bvh2 = (!shp2) ? scn2->_bvh : shp2->_bvh;
 
-    // node stack
-    ym::vec2i node_stack[128];
-    auto node_cur = 0;
-    node_stack[node_cur++] = {0, 0};
+    // instances and lazy shapes are not supported
+    if ((shp1 && (shp1->instance || shp1->_lazy)) ||
+        (shp2 && (shp2->instance || shp2->_lazy)))
+        return;
+
+    // compressed bvhs are not supported
+    assert(!bvh1->compressed && !bvh2->compressed);
+    if (bvh1->compressed || bvh2->compressed) return;
 
     // get frames
     auto frame1 = (!shp1) ? ym::identity_frame3f : shp1->frame;
@@ -1723,31 +5948,18 @@ static inline void _overlap_verts(const scene* scn1, const scene* scn2,
     // check if a trasformed test is needed
     auto xformed = frame1 != frame2;
 
-    // walking stack
-    while (node_cur) {
-        // grab node
-        const auto node_idx = node_stack[--node_cur];
-        const auto node1 = bvh1->nodes[node_idx[0]];
-        const auto node2 = bvh2->nodes[node_idx[1]];
-
-        // intersect bbox
-        if (xformed) {
-            if (!_overlap_bbox(node1.bbox,
-                    {node2.bbox[0] - ym::vec3f{radius, radius, radius},
-                        node2.bbox[1] + ym::vec3f{radius, radius, radius}},
-                    frame1, frame2))
-                continue;
-        } else {
-            if (!_overlap_bbox(node1.bbox,
-                    {node2.bbox[0] - ym::vec3f{radius, radius, radius},
-                        node2.bbox[1] + ym::vec3f{radius, radius, radius}}))
-                continue;
-        }
+    // bounds test
+    auto check = [&](const bvhn& node1, const bvhn& node2) {
+        auto rad = ym::vec3f{radius, radius, radius};
+        auto bbox2 = ym::bbox3f{node2.bbox[0] - rad, node2.bbox[1] + rad};
+        return (xformed) ? _overlap_bbox(node1.bbox, bbox2, frame1, frame2) :
+                           _overlap_bbox(node1.bbox, bbox2);
+    };
 
-        // check for leaves
-        if (node1.isleaf && node2.isleaf) {
-            if (!shp1) {
-                // collide primitives
+    // scenes collide their shapes
+    if (!shp1) {
+        _overlap_walk(bvh1, bvh2, {0, 0}, check,
+            [&](const bvhn& node1, const bvhn& node2) {
                 for (auto i1 = node1.start; i1 < node1.start + node1.count;
                      i1++) {
                     for (auto i2 = node2.start; i2 < node2.start + node2.count;
@@ -1756,11 +5968,21 @@ static inline void _overlap_verts(const scene* scn1, const scene* scn2,
                         auto idx2 = bvh2->sorted_prim[i2];
                         if (exclude_self && idx1 == idx2) continue;
                         _overlap_verts(scn1, scn2, idx1, idx2, exclude_self,
-                            radius, first_only, overlaps, closest);
+                            radius, first_only, overlaps, closest, nthreads);
                     }
                 }
-            } else {
-                // collide primitives
+            });
+        return;
+    }
+
+    // shapes collide their elements, in tasks with their own results
+    auto tasks = _overlap_tasks(bvh1, bvh2, check);
+    auto task_overlaps =
+        std::vector<std::vector<std::pair<point, int2>>>(tasks.size());
+    _parallel_for((int)tasks.size(), nthreads, [&](int t) {
+        auto task_closest = std::unordered_map<int, int>();
+        _overlap_walk(bvh1, bvh2, tasks[t], check,
+            [&](const bvhn& node1, const bvhn& node2) {
                 for (auto i1 = node1.start; i1 < node1.start + node1.count;
                      i1++) {
                     for (auto i2 = node2.start; i2 < node2.start + node2.count;
@@ -1769,33 +5991,33 @@ static inline void _overlap_verts(const scene* scn1, const scene* scn2,
                         auto idx2 = bvh2->sorted_prim[i2];
                         if (exclude_self && idx1 == idx2) continue;
                         _overlap_elem(shp1, shp2, idx1, idx2, exclude_self,
-                            radius, first_only, overlaps, closest);
+                            radius, first_only, &task_overlaps[t],
+                            &task_closest);
                     }
                 }
+            });
+    });
+
+    // merge results in task order, skipping the copies of element and vertex
+    // pairs found through duplicate references
+    auto dups = bvh1->dups || bvh2->dups;
+    auto reported = std::unordered_set<uint64_t>();
+    for (auto& task : task_overlaps) {
+        for (auto& overlap : task) {
+            if (!first_only) {
+                auto key = ((uint64_t)overlap.first.eid << 32) |
+                           (uint32_t)overlap.second[1];
+                if (dups && !reported.insert(key).second) continue;
+                overlaps->push_back(overlap);
+                continue;
             }
-        } else {
-            // descend
-            if (node1.isleaf) {
-                for (auto idx2 = node2.start; idx2 < node2.start + node2.count;
-                     idx2++) {
-                    node_stack[node_cur++] = {node_idx[0], (int)idx2};
-                    assert(node_cur < 128);
-                }
-            } else if (node2.isleaf) {
-                for (auto idx1 = node1.start; idx1 < node1.start + node1.count;
-                     idx1++) {
-                    node_stack[node_cur++] = {(int)idx1, node_idx[1]};
-                    assert(node_cur < 128);
-                }
-            } else {
-                for (auto idx2 = node2.start; idx2 < node2.start + node2.count;
-                     idx2++) {
-                    for (auto idx1 = node1.start;
-                         idx1 < node1.start + node1.count; idx1++) {
-                        node_stack[node_cur++] = {(int)idx1, (int)idx2};
-                        assert(node_cur < 128);
-                    }
-                }
+            auto vid = overlap.second[1];
+            if (closest->find(vid) == closest->end()) {
+                overlaps->push_back(overlap);
+                (*closest)[vid] = (int)overlaps->size() - 1;
+            } else if ((*overlaps)[(*closest)[vid]].first.dist >
+                       overlap.first.dist) {
+                (*overlaps)[(*closest)[vid]] = overlap;
             }
         }
     }
@@ -1809,29 +6031,46 @@ YBVH_API void overlap_verts(const scene* scn1, const scene* scn2, int sid1,
     int sid2, bool exclude_self, float radius, bool first_only,
     std::vector<std::pair<point, int2>>* overlaps) {
     std::unordered_map<int, int> closest;
-    _overlap_verts(
-        scn1, scn2, sid1, sid2, false, radius, first_only, overlaps, &closest);
+    _overlap_verts(scn1, scn2, sid1, sid2, false, radius, first_only,
+        overlaps, &closest, _build_threads(scn1->_params));
 }
 
 //
 // Find the list of overlaps between scenes.
 // Public function whose interface is described above.
 //
+// Implementation Notes:
+// - many shape pairs are collided in parallel, each on one thread, while
+// few shape pairs are collided one at a time, each on all threads
+//
 YBVH_API void overlap_verts(const scene* scn1, const scene* scn2,
     bool exclude_self, float radius, bool first_only,
     std::vector<int2>* soverlaps,
     std::vector<std::pair<point, int2>>* overlaps) {
     overlap_shape_bounds(scn1, scn2, false, false, exclude_self, soverlaps);
-    for (auto sh : *soverlaps) {
-        overlap_verts(scn1, scn2, sh[0], sh[1], exclude_self, radius,
-            first_only, overlaps);
-    }
+    auto nthreads = _build_threads(scn1->_params);
+    auto npairs = (int)soverlaps->size();
+    auto pair_threads = (npairs >= nthreads) ? 1 : nthreads;
+    auto pair_overlaps =
+        std::vector<std::vector<std::pair<point, int2>>>(npairs);
+    _parallel_for(npairs, nthreads / pair_threads, [&](int i) {
+        auto sh = (*soverlaps)[i];
+        std::unordered_map<int, int> closest;
+        _overlap_verts(scn1, scn2, sh[0], sh[1], false, radius, first_only,
+            &pair_overlaps[i], &closest, pair_threads);
+    });
+    for (auto& pair : pair_overlaps)
+        overlaps->insert(overlaps->end(), pair.begin(), pair.end());
 }
 
 //
 // Finds the overlap between shape bounds.
 // Similat interface as the public function.
 //
+// Implementation Notes:
+// - large scenes are split into tasks walked in parallel, whose results are
+// merged in task order
+//
 static inline void _overlap_shape_bounds(const scene* scn1, const scene* scn2,
     bool conservative, bool skip_duplicates, bool skip_self,
     std::vector<int2>* overlaps) {
@@ -1839,72 +6078,49 @@ static inline void _overlap_shape_bounds(const scene* scn1, const scene* scn2,
     auto bvh1 = scn1->_bvh;
     auto bvh2 = scn2->_bvh;
 
-    // node stack
-    ym::vec2i node_stack[128];
-    auto node_cur = 0;
-    node_stack[node_cur++] = {0, 0};
-
-    // walking stack
-    while (node_cur) {
-        // grab node
-        auto node_idx = node_stack[--node_cur];
-        const auto node1 = bvh1->nodes[node_idx[0]];
-        const auto node2 = bvh2->nodes[node_idx[1]];
-
-        // intersect bbox
-        if (!_overlap_bbox(node1.bbox, node2.bbox)) continue;
+    // bounds test
+    auto check = [](const bvhn& node1, const bvhn& node2) {
+        return _overlap_bbox(node1.bbox, node2.bbox);
+    };
 
-        // check for leaves
-        if (node1.isleaf && node2.isleaf) {
-            // collide primitives
-            for (auto i1 = node1.start; i1 < node1.start + node1.count; i1++) {
-                for (auto i2 = node2.start; i2 < node2.start + node2.count;
-                     i2++) {
-                    auto idx1 = bvh1->sorted_prim[i1];
-                    auto idx2 = bvh2->sorted_prim[i2];
-                    auto shp1 = scn1->shapes[idx1];
-                    auto shp2 = scn2->shapes[idx2];
-                    if (skip_duplicates && shp1->sid > shp2->sid) continue;
-                    if (skip_self && shp1->sid == shp2->sid) continue;
-                    if (conservative) {
-                        if (_overlap_bbox(
-                                transform_bbox(shp1->frame, shp1->local_bbox()),
-                                transform_bbox(
-                                    shp2->frame, shp2->local_bbox())))
-                            overlaps->push_back({shp1->sid, shp2->sid});
-                    } else {
-                        if (_overlap_bbox(shp1->local_bbox(),
-                                shp2->local_bbox(), shp1->frame, shp2->frame))
-                            overlaps->push_back({shp1->sid, shp2->sid});
-                    }
-                }
-            }
-        } else {
-            // descend
-            if (node1.isleaf) {
-                for (auto idx2 = node2.start; idx2 < node2.start + node2.count;
-                     idx2++) {
-                    node_stack[node_cur++] = {node_idx[0], (int)idx2};
-                    assert(node_cur < 128);
-                }
-            } else if (node2.isleaf) {
-                for (auto idx1 = node1.start; idx1 < node1.start + node1.count;
-                     idx1++) {
-                    node_stack[node_cur++] = {(int)idx1, node_idx[1]};
-                    assert(node_cur < 128);
-                }
-            } else {
-                for (auto idx2 = node2.start; idx2 < node2.start + node2.count;
-                     idx2++) {
-                    for (auto idx1 = node1.start;
-                         idx1 < node1.start + node1.count; idx1++) {
-                        node_stack[node_cur++] = {(int)idx1, (int)idx2};
-                        assert(node_cur < 128);
-                    }
+    // collide primitives
+    auto leaf = [&](const bvhn& node1, const bvhn& node2,
+                    std::vector<int2>* overlaps) {
+        for (auto i1 = node1.start; i1 < node1.start + node1.count; i1++) {
+            for (auto i2 = node2.start; i2 < node2.start + node2.count; i2++) {
+                auto idx1 = bvh1->sorted_prim[i1];
+                auto idx2 = bvh2->sorted_prim[i2];
+                auto shp1 = scn1->shapes[idx1];
+                auto shp2 = scn2->shapes[idx2];
+                if (skip_duplicates && shp1->sid > shp2->sid) continue;
+                if (skip_self && shp1->sid == shp2->sid) continue;
+                if (conservative) {
+                    if (_overlap_bbox(
+                            transform_bbox(shp1->frame, shp1->local_bbox()),
+                            transform_bbox(shp2->frame, shp2->local_bbox())))
+                        overlaps->push_back({shp1->sid, shp2->sid});
+                } else {
+                    if (_overlap_bbox(shp1->local_bbox(), shp2->local_bbox(),
+                            shp1->frame, shp2->frame))
+                        overlaps->push_back({shp1->sid, shp2->sid});
                 }
             }
         }
-    }
+    };
+
+    // walk tasks
+    auto tasks = _overlap_tasks(bvh1, bvh2, check);
+    auto task_overlaps = std::vector<std::vector<int2>>(tasks.size());
+    _parallel_for((int)tasks.size(), _build_threads(scn1->_params), [&](int t) {
+        _overlap_walk(bvh1, bvh2, tasks[t], check,
+            [&](const bvhn& node1, const bvhn& node2) {
+                leaf(node1, node2, &task_overlaps[t]);
+            });
+    });
+
+    // merge results in task order
+    for (auto& task : task_overlaps)
+        overlaps->insert(overlaps->end(), task.begin(), task.end());
 }
 
 //
@@ -1932,8 +6148,36 @@ YBVH_API void _compute_bvh_stats(const scene* scn, int shape_id,
     // get bvh
     auto bvh = (shape_id >= 0) ? scn->shapes[shape_id]->_bvh : scn->_bvh;
 
+    // compressed bvhs have primitives inline
+    if (bvh->compressed) {
+        _stack<ym::vec2i, 64 * YBVH__QWIDTH> stack(
+            _stack_size(bvh, YBVH__QWIDTH));
+        auto node_stack = stack.data();  // node and depth
+        auto node_cur = 0;
+        node_stack[node_cur++] = ym::vec2i{0, depth};
+        while (node_cur) {
+            auto node_depth = node_stack[--node_cur];
+            const auto& qnode = bvh->qnodes[node_depth[0]];
+            ninternals += 1;
+            for (auto l = 0; l < YBVH__QWIDTH; l++) {
+                if (qnode.ref[l] < 0) continue;
+                if (qnode.leaf & (1 << l)) {
+                    nleaves += 1;
+                    nprims += 1;
+                    min_depth = ym::min(min_depth, node_depth[1] + 1);
+                    max_depth = ym::max(max_depth, node_depth[1] + 1);
+                } else {
+                    node_stack[node_cur++] =
+                        ym::vec2i{qnode.ref[l], node_depth[1] + 1};
+                }
+            }
+        }
+        return;
+    }
+
     // node stack
-    ym::vec2i node_stack[128];  // node and depth
+    _stack<ym::vec2i, 128> stack(_stack_size(bvh, 2));
+    auto node_stack = stack.data();  // node and depth
     auto node_cur = 0;
     node_stack[node_cur++] = ym::vec2i{0, depth};
 
@@ -1959,7 +6203,10 @@ YBVH_API void _compute_bvh_stats(const scene* scn, int shape_id,
             if (include_shapes) {
                 for (auto i = 0; i < node->count; i++) {
                     auto idx = bvh->sorted_prim[node->start + i];
-                    _compute_bvh_stats(scn, idx, true, node_depth[1] + 1,
+                    if (scn->shapes[idx]->_lazy) continue;
+                    auto instance = scn->shapes[idx]->instance;
+                    _compute_bvh_stats((instance) ? instance : scn,
+                        (instance) ? -1 : idx, true, node_depth[1] + 1,
                         nprims, ninternals, nleaves, min_depth, max_depth);
                 }
             } else {
@@ -10,15 +10,42 @@
 /// 2. for each shape, add shape data and transforms with set_point_shape(),
 ///    set_line_shape(), set_triangle_shape() and set_tetra_shape(); to
 ///    modify the frame call set_shape_frame()
+///     - to instance shapes many times, add them to a prototype scene and
+///       build its bvh, then add instances with set_instance(); prototypes
+///       can contain instances in turn, and their bvhs are shared
 /// 3. build the bvh with build_bvh() using the specified heuristic (or default)
-/// 4. perform ray-interseciton tests with intersect_ray()
+///     - use build_params to choose wide nodes (width 4 or 8) for faster
+///       ray traversal, where all children bounds are tested together with
+///       SIMD instructions
+///     - use build_params to compress shape bvhs with quantized nodes, which
+///       use less memory than the default ones
+///     - use build_params to pack triangles with precomputed edges for
+///       faster intersection at the cost of more memory
+///     - use build_params to restructure treelets after a fast build, like
+///       morton, to lower the tree cost within a time budget
+///     - save shape bvhs with save_bvh() and load them back with load_bvh()
+///       to skip the build for shapes that did not change
+///     - for scenes larger than memory, save shapes with save_shape() and
+///       add them with set_lazy_shape(), so that they are loaded on first
+///       use within the budget set by set_lazy_budget()
+/// 4. perform ray-interseciton tests with intersect_ray(), or with
+///    intersect_rays() for arrays of rays traversed in packets
 ///     - use early_exit=false if you want to know the closest hit point
 ///     - use early_exit=false if you only need to know whether there is a hit
+///     - set motion keys with set_shape_frames() and pass ray times to
+///       intersect_ray() or intersect_rays() for motion blur
 ///     - for points and lines, a radius is required
 ///     - for triangle and tetrahedra, the radius is ignored
+///     - use enable_ray_stats() and get_ray_stats() to measure the cost of
+///       ray queries
 /// 5. perform point overlap tests with overlap_point() to if a point overlaps
 ///       with an element within a maximum distance
+///     - use knn_query() and radius_query() to find many elements at once,
+///       or knn_queries() and radius_queries() for many points in parallel
+///     - use overlap_points() for the closest elements of many points, like
+///       when baking distance fields
 ///     - use early_exit as above
+///     - shapes with motion keys are queried at their first key
 ///     - for all primitives, a radius is used if defined, but should
 ///       be very small compared to the size of the primitive since the radius
 ///       overlap is approximate
@@ -26,6 +53,8 @@
 /// overlap_verts()
 /// 7. use refit_bvh() to recompute the bvh bounds if transforms or vertices are
 ///    (you should rebuild the bvh for large changes)
+///     - for moving shapes, use update_bvh() to refit only the scene nodes
+///       above the shapes that moved, rebuilding if the tree degrades
 ///
 /// The interface for each function is described in details in the interface
 /// section of this file.
@@ -50,6 +79,23 @@
 ///
 ///
 /// HISTORY:
+/// - v 0.30: lazy shapes loaded from shape files within a memory budget
+/// - v 0.29: line shapes split into pieces with tight bounds
+/// - v 0.28: motion blur with shape motion keys
+/// - v 0.27: treelet restructuring after the build
+/// - v 0.26: per-thread ray traversal statistics
+/// - v 0.25: batched closest point queries
+/// - v 0.24: knn and radius queries
+/// - v 0.23: multi-level instancing
+/// - v 0.22: shape bvh cache files
+/// - v 0.21: spatial splits bvh build
+/// - v 0.20: incremental scene bvh updates
+/// - v 0.19: triangle packs for leaf intersection
+/// - v 0.18: compressed bvh nodes for shapes
+/// - v 0.17: morton codes linear bvh build
+/// - v 0.16: parallel bvh build
+/// - v 0.15: packet traversal for arrays of rays
+/// - v 0.14: wide bvh nodes for SIMD traversal
 /// - v 0.13: switch to .h/.cpp pair
 /// - v 0.12: doxygen comments
 /// - v 0.11: opaque API (allows for changing internals without altering API)
@@ -108,7 +154,9 @@ namespace ybvh {}
 #endif
 
 #include <array>
+#include <cstdint>
 #include <functional>
+#include <string>
 #include <vector>
 
 // -----------------------------------------------------------------------------
@@ -221,7 +269,23 @@ YBVH_API void set_point_shape(scene* scn, int sid, const float3x4& frame,
     int nverts, const float3* pos, const float* radius);
 
 ///
-/// Set a shape frame.
+/// Set an instance of a prototype scene, whose shapes and bvhs are shared by
+/// all its instances. Prototypes may contain instances too. The prototype
+/// bvh has to be built before the bvh of the scenes that instance it, and
+/// refit before theirs. Instances are skipped by overlap_verts().
+///
+/// - parameters:
+///   - scn: scene
+///   - sid: shape id
+///   - frame: instance transform
+///   - prototype: instanced scene
+///
+YBVH_API void set_instance(
+    scene* scn, int sid, const float3x4& frame, const scene* prototype);
+
+///
+/// Set a shape frame. Shapes whose frame changes are marked as moved for the
+/// next update_bvh().
 ///
 /// - parameters:
 ///   - scn: scene
@@ -230,6 +294,23 @@ YBVH_API void set_point_shape(scene* scn, int sid, const float3x4& frame,
 ///
 YBVH_API void set_shape_frame(scene* scn, int sid, const float3x4& frame);
 
+///
+/// Set the motion keys of a shape, evenly spaced over the times from 0 to 1,
+/// for motion blur. The shape frame at a time interpolates its keys linearly,
+/// and is the first key for queries without a time. Scene bvhs with moving
+/// shapes use binary nodes whose bounds are interpolated at the ray time, so
+/// that moving shapes do not enlarge them. Shapes are marked as moved for the
+/// next update_bvh(), and calling set_shape_frame() removes the keys.
+///
+/// - parameters:
+///   - scn: scene
+///   - sid: shape id
+///   - nkeys: number of keys
+///   - frames: shape transforms at each key
+///
+YBVH_API void set_shape_frames(
+    scene* scn, int sid, int nkeys, const float3x4* frames);
+
 ///
 /// Heuristic strategy for bvh build
 ///
@@ -244,6 +325,12 @@ enum struct heuristic_type {
     sah,
     /// surface area heuristic (binned for speed)
     binned_sah,
+    /// linear bvh from sorted morton codes (fastest build, slower traversal)
+    morton,
+    /// surface area heuristic with spatial splits that duplicate primitives,
+    /// for shapes with large or thin triangles (slowest build); scene bvhs
+    /// use binned_sah instead
+    sbvh,
     /// total number of strategies
     htype_max
 };
@@ -270,6 +357,67 @@ YBVH_API void build_bvh(scene* scn, heuristic_type htype = heuristic_type::def,
 YBVH_API void build_bvh(
     scene* scn, int sid, heuristic_type htype = heuristic_type::def);
 
+///
+/// Parameters for bvh build.
+///
+struct build_params {
+    /// heuristic used to build the bvh
+    heuristic_type htype = heuristic_type::def;
+    /// node width used for ray traversal: 2 for binary nodes, 4 or 8 for
+    /// wide nodes that store their children bounds as SIMD lanes
+    int width = 2;
+    /// build shapes bvhs together with the scene one
+    bool do_shapes = true;
+    /// number of threads used for the build (0 for the hardware threads);
+    /// the resulting bvh does not depend on it
+    int nthreads = 0;
+    /// store shape bvhs with 8-wide nodes whose children bounds are
+    /// quantized to 8 bits and with primitive indices inline, to save memory;
+    /// compressed shapes support ray and point queries, but are skipped by
+    /// overlap_verts(); call build_bvh() on single shapes to compress only
+    /// some of them
+    bool compressed = false;
+    /// store triangles in leaf order with precomputed edges, in packs of 4 or
+    /// 8 intersected with SIMD instructions (0 to disable); uses more memory
+    /// and applies only to triangle shapes that are not compressed
+    int triangle_packs = 0;
+    /// max fraction of extra primitive references created by spatial splits
+    /// (sbvh only)
+    float split_budget = 0.3f;
+    /// number of passes that restructure small treelets of the tree after
+    /// the build to lower its sah cost (0 to disable); pairs well with fast
+    /// heuristics like morton or equalnum
+    int treelet_passes = 0;
+    /// time budget in seconds for the treelet passes (0 for no limit);
+    /// treelets left when it runs out are kept as built, so the resulting
+    /// bvh depends on timing
+    float treelet_time = 0;
+    /// max number of pieces each line of line shapes is split into, so that
+    /// diagonal lines, like hair strands, are bounded by several small boxes
+    /// instead of a large and mostly empty one (0 or 1 to disable); pieces
+    /// are references to the whole line, so refits bound whole lines again
+    int line_pieces = 0;
+};
+
+///
+/// Builds a scene BVH.
+///
+/// - parameters:
+///   - scn: object to build the bvh for
+///   - params: build parameters
+///
+YBVH_API void build_bvh(scene* scn, const build_params& params);
+
+///
+/// Builds a shape BVH.
+///
+/// - parameters:
+///   - scn: object to build the bvh for
+///   - sid: required shape
+///   - params: build parameters (do_shapes is ignored)
+///
+YBVH_API void build_bvh(scene* scn, int sid, const build_params& params);
+
 ///
 /// Refit the bounds of each shape for moving objects. Use this only to avoid
 /// a rebuild, but note that queries are likely slow if objects move a lot.
@@ -292,18 +440,150 @@ YBVH_API void refit_bvh(scene* scn, bool do_shapes = false);
 ///
 YBVH_API void refit_bvh(scene* scn, int sid);
 
+///
+/// Updates the scene bvh after shapes moved with set_shape_frame() or were
+/// refit with refit_bvh(scn, sid). Only the nodes on the paths from the moved
+/// shapes to the root are refit, bottom up and in parallel. If the sah cost
+/// of the tree grows past rebuild_ratio times the one at build, the scene
+/// bvh is rebuilt with the same build params, without rebuilding shapes.
+///
+/// - parameters:
+///   - scn: scene to update
+///   - rebuild_ratio: sah cost ratio that triggers a rebuild (0 to never
+///     rebuild)
+/// - returns:
+///   - whether the scene bvh was rebuilt
+///
+YBVH_API bool update_bvh(scene* scn, float rebuild_ratio = 2);
+
+///
+/// Computes a hash of the shape elements and vertices, and of the build
+/// parameters that change the shape bvh. Used as key of bvh cache files.
+///
+/// - parameters:
+///   - scn: scene
+///   - sid: shape id
+///   - params: build parameters
+/// - returns:
+///   - 64 bits hash
+///
+YBVH_API uint64_t hash_shape(
+    const scene* scn, int sid, const build_params& params);
+
+///
+/// Saves a shape bvh to a binary cache file keyed by hash_shape().
+/// The bvh should have been built with the same parameters.
+///
+/// - parameters:
+///   - scn: scene
+///   - sid: shape id
+///   - params: build parameters used to build the shape bvh
+///   - filename: cache filename
+/// - returns:
+///   - whether the file was written
+///
+YBVH_API bool save_bvh(const scene* scn, int sid, const build_params& params,
+    const std::string& filename);
+
+///
+/// Loads a shape bvh from a cache file written by save_bvh(), replacing the
+/// current one, if the file key matches the hash of the shape data and params.
+/// The file is memory-mapped where supported, and the bvh is used in place
+/// without copies. Build the scene bvh with do_shapes=false after loading.
+/// Files are specific to the machine that wrote them.
+///
+/// - parameters:
+///   - scn: scene
+///   - sid: shape id
+///   - params: build parameters
+///   - filename: cache filename
+/// - returns:
+///   - whether the bvh was loaded (false for missing or stale files)
+///
+YBVH_API bool load_bvh(scene* scn, int sid, const build_params& params,
+    const std::string& filename);
+
+///
+/// Saves a shape to a shape file, that is a bvh cache file that also stores
+/// the shape elements and vertices, so that it can be used by
+/// set_lazy_shape() without the shape data. The bvh should be built.
+///
+/// - parameters:
+///   - scn: scene
+///   - sid: shape id
+///   - params: build parameters used to build the shape bvh
+///   - filename: shape filename
+/// - returns:
+///   - whether the file was written
+///
+YBVH_API bool save_shape(const scene* scn, int sid, const build_params& params,
+    const std::string& filename);
+
+///
+/// Set a lazy shape, whose elements, vertices and bvh are loaded from a shape
+/// file written by save_shape() when a query first reaches its bounds, and
+/// may be evicted to stay within the scene budget. Only the file header is
+/// read here, so the scene bvh can be built from the shape bounds. Lazy shapes
+/// support ray and point queries, which skip them if their file can no
+/// longer be read, but are skipped by overlap_verts() and bvh stats. Shape
+/// files are mapped in memory where supported.
+///
+/// - parameters:
+///   - scn: scene
+///   - sid: shape id
+///   - frame: shape transform
+///   - filename: shape filename
+/// - returns:
+///   - whether the file header was read
+///
+YBVH_API bool set_lazy_shape(scene* scn, int sid, const float3x4& frame,
+    const std::string& filename);
+
+///
+/// Sets the max number of bytes of the lazy shapes of a scene loaded at
+/// once (0 for no limit, the default). When a load exceeds it, the least
+/// recently used shapes are evicted; shapes in use by running queries are
+/// freed when these finish. A shape larger than the budget is still loaded.
+///
+/// - parameters:
+///   - scn: scene
+///   - budget: memory budget in bytes
+///
+YBVH_API void set_lazy_budget(scene* scn, size_t budget);
+
+///
+/// Lazy shapes statistics of a scene.
+///
+struct lazy_stats {
+    /// number of bytes of the loaded shapes
+    size_t resident = 0;
+    /// number of shape loads
+    uint64_t nloads = 0;
+    /// number of shape evictions
+    uint64_t nevictions = 0;
+};
+
+///
+/// Gets the lazy shapes statistics of a scene.
+///
+YBVH_API lazy_stats get_lazy_stats(const scene* scn);
+
 ///
 /// BVH intersection.
 ///
 struct point {
     /// distance
     float dist = 0;
-    /// shape index
+    /// shape index, in the prototype scene for instances
     int sid = -1;
     /// element index
     int eid = -1;
     /// element baricentric coordinates
     float4 euv = {0, 0, 0, 0};
+    /// instance index in the scene queried (-1 if not instanced); for nested
+    /// instances, this is the outermost one, so copies of an element reached
+    /// through different inner instances have the same sid, eid and iid
+    int iid = -1;
 
     /// Check whether it was a hit.
     operator bool() const { return eid >= 0; }
@@ -327,6 +607,73 @@ YBVH_API point intersect_ray(const scene* scn, const float3& ray_o,
 YBVH_API point intersect_ray(const scene* scn, int sid, const float3& ray_o,
     const float3& ray_d, float ray_tmin, float ray_tmax, bool early_exit);
 
+///
+/// Intersect the scene with a ray at a time in [0,1], for motion blur. Shapes
+/// with motion keys are intersected at their frame at that time, while the
+/// other queries use the first key.
+///
+/// - parameters:
+///   - scn: scene to intersect
+///   - sid: shape id
+///   - ray: ray
+///   - ray_time: ray time
+///   - early_exit: whether to stop at the first found hit
+///
+/// - Returns:
+///   - intersection point
+///
+YBVH_API point intersect_ray(const scene* scn, const float3& ray_o,
+    const float3& ray_d, float ray_tmin, float ray_tmax, float ray_time,
+    bool early_exit);
+YBVH_API point intersect_ray(const scene* scn, int sid, const float3& ray_o,
+    const float3& ray_d, float ray_tmin, float ray_tmax, float ray_time,
+    bool early_exit);
+
+///
+/// Intersect the scene with an array of rays. Find any interstion if
+/// early_exit, otherwise find first intersection. Rays are traversed together
+/// in packets, so this is faster than intersect_ray() for coherent rays, like
+/// camera or shadow rays. Incoherent streams are grouped by direction octant
+/// first, and packets whose rays diverge are traced one ray at a time.
+///
+/// - parameters:
+///   - scn: scene to intersect
+///   - sid: shape id
+///   - nrays: number of rays
+///   - ray_o, ray_d: ray origins and directions
+///   - ray_tmin, ray_tmax: ray ranges
+///   - early_exit: whether to stop at the first found hit (any hit queries)
+///
+/// - out parameters:
+///   - hits: intersection points (nrays elements)
+///
+YBVH_API void intersect_rays(const scene* scn, int nrays, const float3* ray_o,
+    const float3* ray_d, const float* ray_tmin, const float* ray_tmax,
+    bool early_exit, point* hits);
+YBVH_API void intersect_rays(const scene* scn, int sid, int nrays,
+    const float3* ray_o, const float3* ray_d, const float* ray_tmin,
+    const float* ray_tmax, bool early_exit, point* hits);
+
+///
+/// Intersect the scene with an array of rays at times in [0,1], for motion
+/// blur. Like the function above, but shapes with motion keys are intersected
+/// at their frame at the time of each ray.
+///
+/// - parameters:
+///   - ray_time: ray times (null for the first key)
+///   - others as above
+///
+/// - out parameters:
+///   - hits: intersection points (nrays elements)
+///
+YBVH_API void intersect_rays(const scene* scn, int nrays, const float3* ray_o,
+    const float3* ray_d, const float* ray_tmin, const float* ray_tmax,
+    const float* ray_time, bool early_exit, point* hits);
+YBVH_API void intersect_rays(const scene* scn, int sid, int nrays,
+    const float3* ray_o, const float3* ray_d, const float* ray_tmin,
+    const float* ray_tmax, const float* ray_time, bool early_exit,
+    point* hits);
+
 ///
 /// Returns a list of shape pairs that can possibly overlap by checking only
 /// they axis aligned bouds. This is only a conservative check useful for
@@ -403,6 +750,87 @@ YBVH_API void overlap_verts(const scene* scn1, const scene* scn2, int sid1,
 YBVH_API point overlap_point(
     const scene* scn, const float3& pt, float max_dist, bool early_exit);
 
+///
+/// Finds the k elements closest to a point within a given radius. Elements
+/// are reported once, with their closest point, like in overlap_point().
+///
+/// - parameters:
+///   - scn: scene to check
+///   - pos: query point
+///   - k: max number of elements
+///   - max_dist: max point distance
+/// - out parameters:
+///   - out: closest elements sorted by distance (array of k points)
+/// - returns:
+///   - number of elements found
+///
+YBVH_API int knn_query(const scene* scn, const float3& pos, int k,
+    float max_dist, point* out);
+
+///
+/// Finds all elements within a given radius of a point, calling callback
+/// for each of them with its closest point, in no particular order.
+/// Elements are reported once, like in knn_query().
+///
+/// - parameters:
+///   - scn: scene to check
+///   - pos: query point
+///   - radius: max point distance
+///   - callback: called for each element found
+///
+YBVH_API void radius_query(const scene* scn, const float3& pos, float radius,
+    const std::function<void(const point&)>& callback);
+
+///
+/// Batched knn_query() for many query points, run in parallel.
+///
+/// - parameters:
+///   - scn: scene to check
+///   - nqueries: number of query points
+///   - pos: query points
+///   - k: max number of elements for each query
+///   - max_dist: max point distance
+/// - out parameters:
+///   - out: closest elements of each query (array of nqueries * k points,
+///     where missing elements are empty points)
+///   - nfound: number of elements found for each query (can be null)
+///
+YBVH_API void knn_queries(const scene* scn, int nqueries, const float3* pos,
+    int k, float max_dist, point* out, int* nfound);
+
+///
+/// Batched radius_query() for many query points, run in parallel. Callbacks
+/// for one query come from one thread, while different queries may call
+/// it concurrently.
+///
+/// - parameters:
+///   - scn: scene to check
+///   - nqueries: number of query points
+///   - pos: query points
+///   - radius: max point distance
+///   - callback: called with the query index and each element found
+///
+YBVH_API void radius_queries(const scene* scn, int nqueries,
+    const float3* pos, float radius,
+    const std::function<void(int, const point&)>& callback);
+
+///
+/// Batched overlap_point() without early exit, for many query points. Queries
+/// are sorted for coherence and run in parallel, while triangles in packs
+/// are tested together.
+///
+/// - parameters:
+///   - scn: scene to check
+///   - npoints: number of query points
+///   - pos: query points
+///   - max_dist: max point distance
+/// - out parameters:
+///   - out: closest element of each query (array of npoints points, empty
+///     when nothing is found)
+///
+YBVH_API void overlap_points(const scene* scn, int npoints,
+    const float3* pos, float max_dist, point* out);
+
 ///
 /// Finds the closest element that overlaps a point within a given radius.
 ///
@@ -429,6 +857,54 @@ YBVH_API void compute_bvh_stats(const scene* scn, bool include_shapes,
     int& nprims, int& ninternals, int& nleaves, int& min_depth, int& max_depth,
     int req_shape = -1);
 
+///
+/// Ray traversal statistics of intersect_ray() and intersect_rays(). Packets
+/// count each node they visit once for all their rays.
+///
+struct ray_stats {
+    /// number of rays
+    uint64_t nrays = 0;
+    /// number of nodes visited, including leaves
+    uint64_t nnodes = 0;
+    /// number of leaves visited
+    uint64_t nleaves = 0;
+    /// number of point tests
+    uint64_t npoint_tests = 0;
+    /// number of line tests
+    uint64_t nline_tests = 0;
+    /// number of triangle tests
+    uint64_t ntriangle_tests = 0;
+    /// number of tetrahedra tests
+    uint64_t ntetra_tests = 0;
+    /// number of rays transformed to shape or instance frames
+    uint64_t ntransforms = 0;
+};
+
+///
+/// Enables or disables the collection of ray traversal statistics. Each
+/// thread counts its own, so collection does not add contention, and when
+/// disabled queries only check a flag once per ray.
+///
+YBVH_API void enable_ray_stats(bool enabled);
+
+///
+/// Gets the ray statistics of all threads since the last reset, including
+/// threads that have exited.
+///
+YBVH_API ray_stats get_ray_stats();
+
+///
+/// Gets the ray statistics of the calling thread since the last reset. Use
+/// the difference before and after a query to get its cost.
+///
+YBVH_API ray_stats get_thread_ray_stats();
+
+///
+/// Resets the ray statistics of all threads. Call it while no queries run,
+/// since counts added concurrently may be lost.
+///
+YBVH_API void reset_ray_stats();
+
 }  // namespace ybvh
 
 // -----------------------------------------------------------------------------
@@ -1765,7 +1765,7 @@ struct frame {
     /// element constructor
     constexpr frame(const M& m, const V& t) {
         for (auto i = 0; i < N; i++) v[i] = m[i];
-        v[N + 1] = t;
+        v[N] = t;
     }
 
     /// conversion from std::array
@@ -32,10 +32,10 @@
 //
 // BUG: check recursive pathtraced environment map
 // BUG: check __sample_brdf at if (rnl >= wd && rnl < wd + ws) {
-// TODO: add envmap sampling and maybe use discreet ditributions
 // TODO: check fresnel
 //
 
+#include <algorithm>
 #include <cassert>
 #include <cfloat>
 #include <cstdint>
@@ -90,6 +90,8 @@ struct material {
     bool use_phong = false;  // whether to use phong
 };
 
+struct light;
+
 //
 // Shape
 //
@@ -122,6 +124,7 @@ struct shape {
     // sampling data
     std::vector<float> cdf;  // for shape, cdf of shape elements for sampling
     float area = 0;          // for shape, shape area
+    light* lgt = nullptr;    // for shape, light if emissive
 };
 
 //
@@ -131,6 +134,11 @@ struct environment {
     ym::frame3f frame = ym::identity_frame3f;  // local-to-world rigid transform
     ym::vec3f ke = ym::zero3f;                 // emission
     texture* ke_txt = nullptr;                 // emission texture
+
+    // sampling data
+    std::vector<float> cdf;      // for ke_txt, cdf of texels in each row
+    std::vector<float> row_cdf;  // for ke_txt, cdf of rows
+    light* lgt = nullptr;        // light if emissive
 };
 
 //
@@ -140,6 +148,28 @@ struct environment {
 struct light {
     shape* shp = nullptr;        // shape
     environment* env = nullptr;  // environment
+
+    // selection data
+    ym::bbox3f bbox = ym::invalid_bbox3f;  // for shape, world bounds
+    ym::vec3f axis = {0, 0, 1};            // for shape, normals cone axis
+    float cos_theta_o = -1;                // for shape, normals cone angle
+    float power = 0;                       // for shape, emitted power
+    uint64_t trail = 0;                    // for shape, light bvh path
+};
+
+//
+// Light bvh node, bounding position, normals and power of shape lights to
+// pick lights by their importance at a shading point. Children of internal
+// nodes are stored contiguously at start.
+// This is only used internally and should not be created.
+//
+struct _light_node {
+    ym::bbox3f bbox = ym::invalid_bbox3f;  // bounds
+    ym::vec3f axis = {0, 0, 1};            // normals cone axis
+    float cos_theta_o = -1;                // normals cone angle (-1 for any)
+    float power = 0;                       // total power
+    int start = -1;                        // first child for internal nodes
+    int lid = -1;                          // light index for leaves
 };
 
 //
@@ -150,6 +180,8 @@ struct scene {
     void* intersect_ctx = nullptr;                 // ray intersection context
     intersect_first_cb intersect_first = nullptr;  // ray intersection callback
     intersect_any_cb intersect_any = nullptr;      // ray hit callback
+    intersect_first_batch_cb intersect_first_batch = nullptr;  // rays isec
+    intersect_any_batch_cb intersect_any_batch = nullptr;      // rays hit
 
     // scn data
     std::vector<camera*> cameras;            // camera
@@ -166,8 +198,10 @@ struct scene {
     ~scene();
 
     // [private] light sources
-    std::vector<light*> lights;        // lights [private]
-    bool shadow_transmission = false;  // wheter to test transmission
+    std::vector<light*> lights;            // lights [private]
+    std::vector<light*> env_lights;        // env lights [private]
+    std::vector<_light_node> light_nodes;  // shape lights bvh [private]
+    bool shadow_transmission = false;      // wheter to test transmission
 };
 
 //
@@ -379,10 +413,14 @@ YTRACE_API void set_vert_material(scene* scn, int sid, const float3* ke,
 // Sets the intersection callbacks
 //
 YTRACE_API void set_intersection_callbacks(scene* scn, void* ctx,
-    intersect_first_cb intersect_first, intersect_any_cb intersect_any) {
+    intersect_first_cb intersect_first, intersect_any_cb intersect_any,
+    intersect_first_batch_cb intersect_first_batch,
+    intersect_any_batch_cb intersect_any_batch) {
     scn->intersect_ctx = ctx;
     scn->intersect_first = intersect_first;
     scn->intersect_any = intersect_any;
+    scn->intersect_first_batch = intersect_first_batch;
+    scn->intersect_any_batch = intersect_any_batch;
 }
 
 //
@@ -436,6 +474,200 @@ static inline std::vector<float> _compute_weight_cdf(int nelems, const T* elem,
     return cdf;
 }
 
+//
+// Compute environment texel cdfs for importance sampling. The texture is
+// split in cells between adjacent texels, weighted by the max luminance of
+// their corners, so that the pdf is positive wherever the bilinearly
+// interpolated emission is, and by the solid angle of their row.
+//
+static inline void _compute_env_cdf(environment* env) {
+    auto txt = env->ke_txt;
+    auto w = txt->width, h = txt->height;
+    auto lum = std::vector<float>(w * h);
+    for (auto j = 0; j < h; j++) {
+        for (auto i = 0; i < w; i++) {
+            auto v = ym::zero4f;
+            if (txt->ldr) {
+                v = ym::srgb_to_linear(ym::image_lookup(
+                    w, h, txt->ncomp, txt->ldr, i, j, (unsigned char)255));
+            } else {
+                v = ym::image_lookup(w, h, txt->ncomp, txt->hdr, i, j, 1.0f);
+            }
+            auto ke = ym::lerp(env->ke, {v[0], v[1], v[2]}, v[3]);
+            lum[j * w + i] = (ke[0] + ke[1] + ke[2]) / 3;
+        }
+    }
+    env->cdf.assign(w * h, 0);
+    env->row_cdf.assign(h, 0);
+    auto total = 0.0f;
+    for (auto j = 0; j < h; j++) {
+        auto sin_theta = std::sin((j + 0.5f) * ym::pif / h);
+        auto row = &env->cdf[j * w];
+        auto row_total = 0.0f;
+        for (auto i = 0; i < w; i++) {
+            auto i1 = (i + 1) % w, j1 = (j + 1) % h;
+            auto l = std::max(std::max(lum[j * w + i], lum[j * w + i1]),
+                std::max(lum[j1 * w + i], lum[j1 * w + i1]));
+            row_total += std::max(l, 0.0f) * sin_theta;
+            row[i] = row_total;
+        }
+        for (auto i = 0; i < w; i++)
+            row[i] = (row_total > 0) ? row[i] / row_total : (i + 1) / (float)w;
+        total += row_total;
+        env->row_cdf[j] = total;
+    }
+    for (auto& c : env->row_cdf) c = (total > 0) ? c / total : 0;
+    if (total <= 0) {
+        env->cdf.clear();
+        env->row_cdf.clear();
+    }
+}
+
+//
+// Bounds the normals cones of two light nodes. Follows the cone union of
+// pbrt-v4. A cosine of -1 means any direction.
+//
+static inline void _union_cones(const ym::vec3f& axis_a, float cos_a,
+    const ym::vec3f& axis_b, float cos_b, ym::vec3f& axis, float& cos_o) {
+    auto theta_a = std::acos(ym::clamp(cos_a, -1.0f, 1.0f));
+    auto theta_b = std::acos(ym::clamp(cos_b, -1.0f, 1.0f));
+    auto theta_d =
+        std::acos(ym::clamp(ym::dot(axis_a, axis_b), -1.0f, 1.0f));
+    if (std::min(theta_d + theta_b, ym::pif) <= theta_a) {
+        axis = axis_a;
+        cos_o = cos_a;
+        return;
+    }
+    if (std::min(theta_d + theta_a, ym::pif) <= theta_b) {
+        axis = axis_b;
+        cos_o = cos_b;
+        return;
+    }
+    auto theta_o = (theta_a + theta_d + theta_b) / 2;
+    auto wr = ym::cross(axis_a, axis_b);
+    if (theta_o >= ym::pif || ym::length(wr) < 1e-6f) {
+        axis = axis_a;
+        cos_o = -1;
+        return;
+    }
+    // rotate axis_a towards axis_b, in their plane
+    auto theta_r = theta_o - theta_a;
+    auto wp = ym::normalize(ym::cross(ym::normalize(wr), axis_a));
+    axis = ym::normalize(axis_a * std::cos(theta_r) + wp * std::sin(theta_r));
+    cos_o = std::cos(theta_o);
+}
+
+//
+// Computes the bounds, normals cone and power of a shape light. Triangles
+// emit on the side of their shading normals, so the cone bounds both face
+// and vertex normals. Points, lines and normal mapped triangles emit in any
+// direction.
+//
+static inline void _compute_light_bounds(light* lgt) {
+    auto shp = lgt->shp;
+    lgt->bbox = ym::invalid_bbox3f;
+    for (auto i = 0; i < shp->nverts; i++) {
+        auto p = ym::transform_point(shp->frame, shp->pos[i]);
+        auto r = (shp->radius) ? shp->radius[i][0] : 0.0f;
+        lgt->bbox = ym::expand(lgt->bbox, p - ym::vec3f{r, r, r});
+        lgt->bbox = ym::expand(lgt->bbox, p + ym::vec3f{r, r, r});
+    }
+    auto& ke = shp->mat->ke;
+    lgt->power = (ke[0] + ke[1] + ke[2]) / 3 * shp->area;
+    lgt->axis = {0, 0, 1};
+    lgt->cos_theta_o = -1;
+    if (!shp->triangles || shp->mat->norm_txt) return;
+    auto normals = std::vector<ym::vec3f>();
+    auto axis = ym::zero3f;
+    for (auto i = 0; i < shp->nelems; i++) {
+        auto& t = shp->triangles[i];
+        auto n = ym::cross(shp->pos[t[1]] - shp->pos[t[0]],
+            shp->pos[t[2]] - shp->pos[t[0]]);
+        if (n == ym::zero3f) continue;
+        axis += n;
+        normals.push_back(ym::normalize(n));
+    }
+    if (shp->norm) {
+        for (auto i = 0; i < shp->nverts; i++)
+            normals.push_back(ym::normalize(shp->norm[i]));
+    }
+    if (ym::length(axis) < 1e-6f) return;
+    axis = ym::normalize(axis);
+    auto cos_o = 1.0f;
+    for (auto& n : normals) cos_o = std::min(cos_o, ym::dot(axis, n));
+    lgt->axis = ym::transform_direction(shp->frame, axis);
+    lgt->cos_theta_o = cos_o;
+}
+
+//
+// Builds the light bvh node nid over the lights lids[start, end), by
+// splitting at the median light along the largest axis of their centers.
+// Leaves record their path from the root in their light trail.
+//
+static inline void _build_light_node(scene* scn, int nid,
+    std::vector<int>& lids, int start, int end, uint64_t trail, int depth) {
+    if (end - start == 1) {
+        auto lgt = scn->lights[lids[start]];
+        auto& node = scn->light_nodes[nid];
+        node.bbox = lgt->bbox;
+        node.axis = lgt->axis;
+        node.cos_theta_o = lgt->cos_theta_o;
+        node.power = lgt->power;
+        node.lid = lids[start];
+        lgt->trail = trail;
+        return;
+    }
+
+    // split along the largest axis of the light centers
+    auto cbbox = ym::invalid_bbox3f;
+    for (auto i = start; i < end; i++)
+        cbbox = ym::expand(cbbox, ym::center(scn->lights[lids[i]]->bbox));
+    auto size = ym::diagonal(cbbox);
+    auto axis = (size[0] >= size[1] && size[0] >= size[2]) ?
+                    0 :
+                    ((size[1] >= size[2]) ? 1 : 2);
+    auto mid = (start + end) / 2;
+    std::nth_element(lids.begin() + start, lids.begin() + mid,
+        lids.begin() + end, [scn, axis](int a, int b) {
+            return ym::center(scn->lights[a]->bbox)[axis] <
+                   ym::center(scn->lights[b]->bbox)[axis];
+        });
+
+    // build children
+    auto cid = (int)scn->light_nodes.size();
+    scn->light_nodes.resize(cid + 2);
+    scn->light_nodes[nid].start = cid;
+    _build_light_node(scn, cid, lids, start, mid, trail, depth + 1);
+    _build_light_node(scn, cid + 1, lids, mid, end,
+        trail | ((uint64_t)1 << depth), depth + 1);
+
+    // bound children
+    auto& node = scn->light_nodes[nid];
+    auto& left = scn->light_nodes[cid];
+    auto& right = scn->light_nodes[cid + 1];
+    node.bbox = ym::expand(left.bbox, right.bbox);
+    node.power = left.power + right.power;
+    _union_cones(left.axis, left.cos_theta_o, right.axis, right.cos_theta_o,
+        node.axis, node.cos_theta_o);
+}
+
+//
+// Builds the light bvh of shape lights.
+//
+static inline void _build_light_bvh(scene* scn) {
+    scn->light_nodes.clear();
+    auto lids = std::vector<int>();
+    for (auto lid = 0; lid < (int)scn->lights.size(); lid++) {
+        if (!scn->lights[lid]->shp) continue;
+        _compute_light_bounds(scn->lights[lid]);
+        lids.push_back(lid);
+    }
+    if (lids.empty()) return;
+    scn->light_nodes.reserve(2 * lids.size() - 1);
+    scn->light_nodes.resize(1);
+    _build_light_node(scn, 0, lids, 0, (int)lids.size(), 0, 0);
+}
+
 //
 // Init lights. Public API, see above.
 //
@@ -444,13 +676,16 @@ YTRACE_API void init_lights(scene* scn) {
     // clear old lights
     for (auto lgt : scn->lights) delete lgt;
     scn->lights.clear();
+    scn->env_lights.clear();
     scn->shadow_transmission = false;
 
     for (auto shp : scn->shapes) {
+        shp->lgt = nullptr;
         if (shp->mat->kt != ym::zero3f) scn->shadow_transmission = true;
         if (shp->mat->ke == ym::zero3f) continue;
         auto lgt = new light();
         lgt->shp = shp;
+        shp->lgt = lgt;
         if (shp->points) {
             shp->cdf = _compute_weight_cdf(shp->nelems, shp->points, &shp->area,
                 [shp](auto e) { return 1; });
@@ -470,11 +705,19 @@ YTRACE_API void init_lights(scene* scn) {
     }
 
     for (auto env : scn->environments) {
+        env->cdf.clear();
+        env->row_cdf.clear();
+        env->lgt = nullptr;
         if (env->ke == ym::zero3f) continue;
         auto lgt = new light();
         lgt->env = env;
+        env->lgt = lgt;
+        if (env->ke_txt) _compute_env_cdf(env);
         scn->lights.push_back(lgt);
+        scn->env_lights.push_back(lgt);
     }
+
+    _build_light_bvh(scn);
 }
 
 // -----------------------------------------------------------------------------
@@ -1266,7 +1509,24 @@ static inline point _eval_shapepoint(
 static inline float _weight_light(const point& lpt, const point& pt) {
     switch (lpt.ptype) {
         case point::type::env: {
-            return 4 * ym::pif;
+            auto env = lpt.env;
+            if (env->row_cdf.empty()) return 4 * ym::pif;
+            // cell of the direction and its probability
+            auto w = ym::transform_direction(ym::inverse(env->frame), -lpt.wo);
+            auto cos_theta = ym::clamp(w[1], (float)-1, (float)1);
+            auto wh = ym::vec2i{env->ke_txt->width, env->ke_txt->height};
+            auto u = std::atan2(w[2], w[0]) / (2 * ym::pif);
+            auto v = std::acos(cos_theta) / ym::pif;
+            if (u < 0) u += 1;
+            auto i = ym::clamp((int)(u * wh[0]), 0, wh[0] - 1);
+            auto j = ym::clamp((int)(v * wh[1]), 0, wh[1] - 1);
+            auto row = &env->cdf[j * wh[0]];
+            auto prob = (env->row_cdf[j] - ((j) ? env->row_cdf[j - 1] : 0)) *
+                        (row[i] - ((i) ? row[i - 1] : 0));
+            if (prob <= 0) return 0;
+            // convert the texture pdf to solid angle
+            auto sin_theta = std::sqrt(1 - cos_theta * cos_theta);
+            return 2 * ym::pif * ym::pif * sin_theta / (prob * wh[0] * wh[1]);
         } break;
         case point::type::point: {
             auto d = ym::dist(lpt.frame[3], pt.frame[3]);
@@ -1313,6 +1573,28 @@ static inline point _sample_light(
         auto lpt = _eval_shapepoint(lgt->shp, eid, euv, ym::zero3f);
         lpt.wo = ym::normalize(pt.frame[3] - lpt.frame[3]);
         return lpt;
+    } else if (lgt->env && !lgt->env->row_cdf.empty()) {
+        // pick a texture cell from the cdfs, then a point in it
+        auto env = lgt->env;
+        auto wh = ym::vec2i{env->ke_txt->width, env->ke_txt->height};
+        auto j = (int)(lower_bound(env->row_cdf.begin(), env->row_cdf.end(),
+                           rn[1]) -
+                       env->row_cdf.begin());
+        j = ym::min(j, wh[1] - 1);
+        auto row = env->cdf.begin() + j * wh[0];
+        auto i = (int)(lower_bound(row, row + wh[0], rn[0]) - row);
+        i = ym::min(i, wh[0] - 1);
+        auto row_min = (j) ? env->row_cdf[j - 1] : 0.0f;
+        auto col_min = (i) ? row[i - 1] : 0.0f;
+        auto rv = ym::clamp((rn[1] - row_min) / (env->row_cdf[j] - row_min),
+            (float)0, (float)1);
+        auto ru = ym::clamp(
+            (rn[0] - col_min) / (row[i] - col_min), (float)0, (float)1);
+        auto theta = (j + rv) / wh[1] * ym::pif;
+        auto phi = (i + ru) / wh[0] * 2 * ym::pif;
+        auto w = ym::vec3f{std::cos(phi) * std::sin(theta), std::cos(theta),
+            std::sin(phi) * std::sin(theta)};
+        return _eval_envpoint(env, -ym::transform_direction(env->frame, w));
     } else if (lgt->env) {
         auto z = -1 + 2 * rn[1];
         auto rr = std::sqrt(ym::clamp(1 - z * z, (float)0, (float)1));
@@ -1326,6 +1608,132 @@ static inline point _sample_light(
     }
 }
 
+//
+// Cosine of the difference of two angles, clamped to 1 if negative.
+//
+static inline float _cos_sub_clamped(
+    float sin_a, float cos_a, float sin_b, float cos_b) {
+    if (cos_a > cos_b) return 1;
+    return cos_a * cos_b + sin_a * sin_b;
+}
+
+//
+// Importance of the lights in a light bvh node for a shading point. Bounds
+// the distance and the angles to the emitters and to the shading normal
+// over the node, as in pbrt-v4, so that it is zero only if all node lights
+// face away from the point.
+//
+static inline float _light_importance(
+    const _light_node& node, const point& pt) {
+    auto p = pt.frame[3];
+    auto pc = ym::center(node.bbox);
+    auto radius = ym::length(ym::diagonal(node.bbox)) / 2;
+    auto dist2 = ym::distsqr(p, pc);
+    auto d2 = std::max(std::max(dist2, radius), 1e-12f);
+
+    // angle subtended by the bounds
+    auto cos_b = -1.0f;
+    if (!ym::contains(node.bbox, p) && dist2 > radius * radius)
+        cos_b = std::sqrt(1 - radius * radius / dist2);
+    auto sin_b = std::sqrt(std::max(0.0f, 1 - cos_b * cos_b));
+
+    // angle between the normals cone and the point
+    auto wi = (dist2 > 0) ? (p - pc) / std::sqrt(dist2) : ym::vec3f{0, 0, 1};
+    auto cos_w = ym::dot(node.axis, wi);
+    auto sin_w = std::sqrt(std::max(0.0f, 1 - cos_w * cos_w));
+    auto cos_o = node.cos_theta_o;
+    auto sin_o = std::sqrt(std::max(0.0f, 1 - cos_o * cos_o));
+    auto cos_x = _cos_sub_clamped(sin_w, cos_w, sin_o, cos_o);
+    auto sin_x = std::sqrt(std::max(0.0f, 1 - cos_x * cos_x));
+    auto cos_p = _cos_sub_clamped(sin_x, cos_x, sin_b, cos_b);
+    if (cos_p <= 0) return 0;
+
+    // angle between the shading normal and the node
+    auto cos_i = 1.0f;
+    if (pt.ptype == point::type::triangle) {
+        auto cos_n = std::abs(ym::dot(wi, pt.frame[2]));
+        auto sin_n = std::sqrt(std::max(0.0f, 1 - cos_n * cos_n));
+        cos_i = _cos_sub_clamped(sin_n, cos_n, sin_b, cos_b);
+    }
+
+    return node.power * cos_p * std::max(cos_i, 0.0f) / d2;
+}
+
+//
+// Picks a light for a shading point, returning its probability in pdf.
+// Environments and the shape lights bvh are picked uniformly, then the
+// bvh is traversed by the importance of its nodes. Returns nullptr if no
+// light can illuminate the point.
+//
+static inline const light* _sample_lights(
+    const scene* scn, const point& pt, float rn, float* pdf) {
+    auto nenvs = (int)scn->env_lights.size();
+    auto nsel = nenvs + ((scn->light_nodes.empty()) ? 0 : 1);
+    if (!nsel) return nullptr;
+    auto sel = ym::min((int)(rn * nsel), nsel - 1);
+    *pdf = 1 / (float)nsel;
+    if (sel < nenvs) return scn->env_lights[sel];
+    rn = std::min(rn * nsel - sel, 1 - FLT_EPSILON);
+    auto nid = 0;
+    while (scn->light_nodes[nid].lid < 0) {
+        auto start = scn->light_nodes[nid].start;
+        auto il = _light_importance(scn->light_nodes[start], pt);
+        auto ir = _light_importance(scn->light_nodes[start + 1], pt);
+        if (il + ir <= 0) return nullptr;
+        auto pl = il / (il + ir);
+        if (rn < pl) {
+            *pdf *= pl;
+            rn = std::min(rn / pl, 1 - FLT_EPSILON);
+            nid = start;
+        } else {
+            *pdf *= ir / (il + ir);
+            rn = std::min((rn - pl) / (1 - pl), 1 - FLT_EPSILON);
+            nid = start + 1;
+        }
+    }
+    return scn->lights[scn->light_nodes[nid].lid];
+}
+
+//
+// Probability of picking a light with _sample_lights for a shading point.
+//
+static inline float _pdf_lights(
+    const scene* scn, const light* lgt, const point& pt) {
+    auto nenvs = (int)scn->env_lights.size();
+    auto nsel = nenvs + ((scn->light_nodes.empty()) ? 0 : 1);
+    if (!nsel) return 0;
+    auto pdf = 1 / (float)nsel;
+    if (lgt->env) return pdf;
+    auto nid = 0;
+    auto trail = lgt->trail;
+    while (scn->light_nodes[nid].lid < 0) {
+        auto start = scn->light_nodes[nid].start;
+        auto il = _light_importance(scn->light_nodes[start], pt);
+        auto ir = _light_importance(scn->light_nodes[start + 1], pt);
+        if (il + ir <= 0) return 0;
+        if (trail & 1) {
+            pdf *= ir / (il + ir);
+            nid = start + 1;
+        } else {
+            pdf *= il / (il + ir);
+            nid = start;
+        }
+        trail >>= 1;
+    }
+    return pdf;
+}
+
+//
+// Sample weight for a light point, including the probability of picking
+// its light. Zero for points that cannot be sampled.
+//
+static inline float _weight_lights(
+    const scene* scn, const point& lpt, const point& pt) {
+    auto lgt = (lpt.shp) ? lpt.shp->lgt : ((lpt.env) ? lpt.env->lgt : nullptr);
+    auto pdf = (lgt) ? _pdf_lights(scn, lgt, pt) : 0.0f;
+    return (pdf > 0) ? _weight_light(lpt, pt) / pdf : 0.0f;
+}
+
 //
 // Offsets a ray origin to avoid self-intersection.
 //
@@ -1353,11 +1761,10 @@ static inline ym::ray3f _offset_ray(
 }
 
 //
-// Intersects a ray with the scn and return the point (or env point).
+// Evaluates the point (or env point) of a ray intersection.
 //
-static inline point _intersect_scene(const scene* scn, const ym::ray3f& ray) {
-    auto isec = scn->intersect_first(
-        scn->intersect_ctx, ray.o, ray.d, ray.tmin, ray.tmax);
+static inline point _eval_intersection(
+    const scene* scn, const intersect_point& isec, const ym::ray3f& ray) {
     if (isec) {
         return _eval_shapepoint(
             scn->shapes[isec.sid], isec.eid, isec.euv, -ray.d);
@@ -1368,6 +1775,15 @@ static inline point _intersect_scene(const scene* scn, const ym::ray3f& ray) {
     }
 }
 
+//
+// Intersects a ray with the scn and return the point (or env point).
+//
+static inline point _intersect_scene(const scene* scn, const ym::ray3f& ray) {
+    auto isec = scn->intersect_first(
+        scn->intersect_ctx, ray.o, ray.d, ray.tmin, ray.tmax);
+    return _eval_intersection(scn, isec, ray);
+}
+
 //
 // Intersects a scene and offsets the ray
 //
@@ -1422,6 +1838,30 @@ static inline float _weight_mis(float w0, float w1) {
     return (1 / w0) / (1 / w0 + 1 / w1);
 }
 
+//
+// Mis weight for a light sample. Points and lines are sampled as delta lights,
+// so their light samples are not mis weighted.
+//
+static inline float _weight_light_mis(
+    const point& lpt, const point& pt, float lw) {
+    if (lpt.ptype == point::type::point || lpt.ptype == point::type::line)
+        return 1;
+    return _weight_mis(lw, _weight_brdfcos(pt, -lpt.wo));
+}
+
+//
+// Mis weight for a brdf sample. Brdf samples can hit points and lines, that
+// have a radius, but their light samples already count all their emission,
+// so these hits are weighted zero.
+//
+static inline float _weight_brdf_mis(
+    const scene* scn, const point& bpt, const point& pt) {
+    if (bpt.ptype == point::type::point || bpt.ptype == point::type::line)
+        return 0;
+    return _weight_mis(
+        _weight_brdfcos(pt, -bpt.wo), _weight_lights(scn, bpt, pt));
+}
+
 //
 // Recursive path tracing.
 //
@@ -1457,13 +1897,17 @@ static inline ym::vec4f _shade_pathtrace(const scene* scn, const ym::ray3f& ray,
         if (emission) l += weight * _eval_emission(pt);
 
         // direct – light
-        auto lgt = scn->lights[_sample_next1i(smp, scn->lights.size())];
-        auto lpt =
-            _sample_light(lgt, pt, _sample_next1f(smp), _sample_next2f(smp));
-        auto lld = _eval_emission(lpt) * _eval_brdfcos(pt, -lpt.wo) *
-                   _weight_light(lpt, pt) * (float)scn->lights.size();
-        if (lld != ym::zero3f) {
-            l += weight * lld * _eval_transmission(scn, pt, lpt, params);
+        auto lpdf = 0.0f;
+        auto lgt = _sample_lights(scn, pt, _sample_next1f(smp), &lpdf);
+        if (lgt) {
+            auto lpt = _sample_light(
+                lgt, pt, _sample_next1f(smp), _sample_next2f(smp));
+            auto lw = _weight_light(lpt, pt) / lpdf;
+            auto lld = _eval_emission(lpt) * _eval_brdfcos(pt, -lpt.wo) * lw *
+                       _weight_light_mis(lpt, pt, lw);
+            if (lld != ym::zero3f) {
+                l += weight * lld * _eval_transmission(scn, pt, lpt, params);
+            }
         }
 
         // direct – brdf
@@ -1473,9 +1917,7 @@ static inline ym::vec4f _shade_pathtrace(const scene* scn, const ym::ray3f& ray,
         auto bld = _eval_emission(bpt) * _eval_brdfcos(pt, -bpt.wo) *
                    _weight_brdfcos(pt, -bpt.wo);
         if (bld != ym::zero3f) {
-            l += weight * bld *
-                 _weight_mis(
-                     _weight_brdfcos(pt, -bpt.wo), _weight_light(bpt, pt));
+            l += weight * bld * _weight_brdf_mis(scn, bpt, pt);
         }
 
         // skip recursion if path ends
@@ -1721,6 +2163,457 @@ static inline ym::vec4f _shade_eyelight(const scene* scn, const ym::ray3f& ray,
     return {l[0], l[1], l[2], 1};
 }
 
+//
+// Number of paths advanced together by the wavefront integrator.
+//
+#define YTRACE__WAVEFRONT_SIZE 16384
+
+//
+// Stage of a path in the wavefront integrator, i.e. what the ray traced
+// for the path was sampled for.
+//
+enum struct _path_stage {
+    camera,       // camera ray
+    transparent,  // continuation ray through a transparent surface
+    brdf,         // brdf sampled ray
+    done,         // path terminated
+};
+
+//
+// Path state for the wavefront integrator. Stored as a structure of arrays
+// indexed by path, so that each stage runs over the active paths.
+//
+struct _path_queue {
+    std::vector<_path_stage> stage;     // path stage
+    std::vector<_sampler> smp;          // path random numbers
+    std::vector<ym::ray3f> ray;         // next ray to trace
+    std::vector<intersect_point> isec;  // ray intersection
+    std::vector<point> pt;              // current path vertex
+    std::vector<ym::vec3f> weight;      // path throughput
+    std::vector<ym::vec3f> l;           // path radiance
+    std::vector<float> alpha;           // path alpha
+    std::vector<int> bounce;            // path bounce
+    std::vector<uint8_t> emission;      // whether to add vertex emission
+    std::vector<int> active;            // indices of paths not done
+
+    // batch of rays for the batch intersection callbacks
+    std::vector<float3> batch_o;              // ray origins
+    std::vector<float3> batch_d;              // ray directions
+    std::vector<float> batch_tmin;            // ray min distances
+    std::vector<float> batch_tmax;            // ray max distances
+    std::vector<intersect_point> batch_isec;  // ray intersections
+};
+
+//
+// Shadow ray for direct lighting in the wavefront integrator.
+//
+struct _shadow_record {
+    int path;      // path index
+    point lpt;     // light point
+    ym::vec3f ld;  // unoccluded contribution
+};
+
+//
+// Advances a path from its current vertex, handling transparency, emission
+// and direct lighting, and sampling the next ray. Mirrors the body of the
+// bounce loop in _shade_pathtrace.
+//
+static inline void _continue_path(const scene* scn, _path_queue& q, int p,
+    std::vector<_shadow_record>& shadows, const render_params& params) {
+    auto& pt = q.pt[p];
+    auto smp = &q.smp[p];
+
+    // end path
+    if (q.bounce[p] >= params.max_depth) {
+        q.stage[p] = _path_stage::done;
+        return;
+    }
+
+    // handle transparency
+    auto kt = _eval_transparency(pt);
+    if (kt != ym::zero3f) {
+        auto tprob = ym::max_element_val(kt);
+        if (_sample_next1f(smp) < tprob) {
+            q.weight[p] *= kt;
+            q.ray[p] = _offset_ray(pt, -pt.wo, params);
+            q.bounce[p] += 1;
+            q.stage[p] = _path_stage::transparent;
+            return;
+        }
+    }
+
+    // emission
+    if (q.emission[p]) q.l[p] += q.weight[p] * _eval_emission(pt);
+
+    // direct – light
+    auto lpdf = 0.0f;
+    auto lgt = _sample_lights(scn, pt, _sample_next1f(smp), &lpdf);
+    if (lgt) {
+        auto lpt =
+            _sample_light(lgt, pt, _sample_next1f(smp), _sample_next2f(smp));
+        auto lw = _weight_light(lpt, pt) / lpdf;
+        auto lld = _eval_emission(lpt) * _eval_brdfcos(pt, -lpt.wo) * lw *
+                   _weight_light_mis(lpt, pt, lw);
+        if (lld != ym::zero3f) shadows.push_back({p, lpt, q.weight[p] * lld});
+    }
+
+    // direct – brdf
+    q.ray[p] = _offset_ray(pt,
+        _sample_brdfcos(pt, _sample_next1f(smp), _sample_next2f(smp)),
+        params);
+    q.stage[p] = _path_stage::brdf;
+}
+
+//
+// Shades the intersection of the ray traced for a path.
+//
+static inline void _shade_path(const scene* scn, _path_queue& q, int p,
+    std::vector<_shadow_record>& shadows, const render_params& params) {
+    auto hpt = _eval_intersection(scn, q.isec[p], q.ray[p]);
+    switch (q.stage[p]) {
+        case _path_stage::camera: {
+            if (hpt.ptype == point::type::none ||
+                (hpt.ptype == point::type::env && params.envmap_invisible)) {
+                q.stage[p] = _path_stage::done;
+                return;
+            }
+            q.l[p] = _eval_emission(hpt);
+            q.alpha[p] = 1;
+            if (hpt.emission_only() || scn->lights.empty()) {
+                q.stage[p] = _path_stage::done;
+                return;
+            }
+            q.pt[p] = hpt;
+        } break;
+        case _path_stage::transparent: {
+            q.pt[p] = hpt;
+            q.emission[p] = true;
+        } break;
+        case _path_stage::brdf: {
+            auto& pt = q.pt[p];
+            auto& bpt = hpt;
+            auto bld = _eval_emission(bpt) * _eval_brdfcos(pt, -bpt.wo) *
+                       _weight_brdfcos(pt, -bpt.wo);
+            if (bld != ym::zero3f) {
+                q.l[p] += q.weight[p] * bld * _weight_brdf_mis(scn, bpt, pt);
+            }
+
+            // skip recursion if path ends
+            if (q.bounce[p] == params.max_depth - 1 || bpt.emission_only()) {
+                q.stage[p] = _path_stage::done;
+                return;
+            }
+
+            // continue path
+            q.weight[p] *=
+                _eval_brdfcos(pt, -bpt.wo) * _weight_brdfcos(pt, -bpt.wo);
+            if (q.weight[p] == ym::zero3f) {
+                q.stage[p] = _path_stage::done;
+                return;
+            }
+
+            // roussian roulette
+            if (q.bounce[p] > 2) {
+                auto rho = pt.kd + pt.ks;
+                auto rrprob =
+                    1.0f -
+                    std::min(std::max(std::max(rho[0], rho[1]), rho[2]), 0.95f);
+                if (_sample_next1f(&q.smp[p]) < rrprob) {
+                    q.stage[p] = _path_stage::done;
+                    return;
+                }
+                q.weight[p] *= 1 / (1 - rrprob);
+            }
+
+            // continue path
+            pt = bpt;
+            q.emission[p] = false;
+            q.bounce[p] += 1;
+        } break;
+        default: assert(false); return;
+    }
+    _continue_path(scn, q, p, shadows, params);
+}
+
+//
+// Clears the ray batch of the path queue.
+//
+static inline void _clear_batch(_path_queue& q) {
+    q.batch_o.clear();
+    q.batch_d.clear();
+    q.batch_tmin.clear();
+    q.batch_tmax.clear();
+}
+
+//
+// Adds a ray to the ray batch of the path queue.
+//
+static inline void _add_batch_ray(_path_queue& q, const ym::ray3f& ray) {
+    q.batch_o.push_back(ray.o);
+    q.batch_d.push_back(ray.d);
+    q.batch_tmin.push_back(ray.tmin);
+    q.batch_tmax.push_back(ray.tmax);
+}
+
+//
+// Intersects the rays of all active paths.
+//
+static inline void _intersect_paths(const scene* scn, _path_queue& q) {
+    if (scn->intersect_first_batch) {
+        _clear_batch(q);
+        for (auto p : q.active) _add_batch_ray(q, q.ray[p]);
+        q.batch_isec.resize(q.active.size());
+        scn->intersect_first_batch(scn->intersect_ctx, (int)q.active.size(),
+            q.batch_o.data(), q.batch_d.data(), q.batch_tmin.data(),
+            q.batch_tmax.data(), q.batch_isec.data());
+        for (auto idx = 0; idx < (int)q.active.size(); idx++)
+            q.isec[q.active[idx]] = q.batch_isec[idx];
+    } else {
+        for (auto p : q.active) {
+            auto& ray = q.ray[p];
+            q.isec[p] = scn->intersect_first(
+                scn->intersect_ctx, ray.o, ray.d, ray.tmin, ray.tmax);
+        }
+    }
+}
+
+//
+// Traces shadow rays through transparent surfaces, one segment at a time for
+// all shadows, like _eval_transmission() does for one shadow. Each batch
+// holds the shadows whose last segment hit a surface that transmits light.
+//
+static inline void _trace_shadows_transmission(const scene* scn,
+    _path_queue& q, const std::vector<_shadow_record>& shadows,
+    const render_params& params) {
+    auto cpt = std::vector<point>();
+    auto weight = std::vector<ym::vec3f>(shadows.size(), {1, 1, 1});
+    auto pending = std::vector<int>();
+    cpt.reserve(shadows.size());
+    for (auto idx = 0; idx < (int)shadows.size(); idx++) {
+        cpt.push_back(q.pt[shadows[idx].path]);
+        pending.push_back(idx);
+    }
+    auto rays = std::vector<ym::ray3f>();
+    for (auto bounce = 0; bounce < params.max_depth && !pending.empty();
+         bounce++) {
+        // intersect the next segment of the pending shadows
+        rays.clear();
+        for (auto s : pending)
+            rays.push_back(_offset_ray(cpt[s], shadows[s].lpt, params));
+        q.batch_isec.resize(pending.size());
+        if (scn->intersect_first_batch) {
+            _clear_batch(q);
+            for (auto& ray : rays) _add_batch_ray(q, ray);
+            scn->intersect_first_batch(scn->intersect_ctx,
+                (int)pending.size(), q.batch_o.data(), q.batch_d.data(),
+                q.batch_tmin.data(), q.batch_tmax.data(),
+                q.batch_isec.data());
+        } else {
+            for (auto idx = 0; idx < (int)pending.size(); idx++) {
+                auto& ray = rays[idx];
+                q.batch_isec[idx] = scn->intersect_first(
+                    scn->intersect_ctx, ray.o, ray.d, ray.tmin, ray.tmax);
+            }
+        }
+
+        // attenuate the shadows that hit a surface, keeping the ones that
+        // still transmit light
+        auto npending = 0;
+        for (auto idx = 0; idx < (int)pending.size(); idx++) {
+            auto s = pending[idx];
+            if (!q.batch_isec[idx]) continue;
+            cpt[s] = _eval_intersection(scn, q.batch_isec[idx], rays[idx]);
+            weight[s] *= _eval_transparency(cpt[s]);
+            if (weight[s] != ym::zero3f) pending[npending++] = s;
+        }
+        pending.resize(npending);
+    }
+
+    // add the transmitted direct lighting
+    for (auto idx = 0; idx < (int)shadows.size(); idx++)
+        q.l[shadows[idx].path] += shadows[idx].ld * weight[idx];
+}
+
+//
+// Traces shadow rays and adds the unoccluded direct lighting to the paths.
+//
+static inline void _trace_shadows(const scene* scn, _path_queue& q,
+    const std::vector<_shadow_record>& shadows, const render_params& params) {
+    if (shadows.empty()) return;
+    if (scn->shadow_transmission) {
+        _trace_shadows_transmission(scn, q, shadows, params);
+    } else if (scn->intersect_any_batch) {
+        _clear_batch(q);
+        for (auto& shadow : shadows) {
+            _add_batch_ray(
+                q, _offset_ray(q.pt[shadow.path], shadow.lpt, params));
+        }
+        q.batch_isec.resize(shadows.size());
+        scn->intersect_any_batch(scn->intersect_ctx, (int)shadows.size(),
+            q.batch_o.data(), q.batch_d.data(), q.batch_tmin.data(),
+            q.batch_tmax.data(), q.batch_isec.data());
+        for (auto idx = 0; idx < (int)shadows.size(); idx++) {
+            if (!q.batch_isec[idx]) q.l[shadows[idx].path] += shadows[idx].ld;
+        }
+    } else {
+        for (auto& shadow : shadows) {
+            auto ray = _offset_ray(q.pt[shadow.path], shadow.lpt, params);
+            if (!scn->intersect_any(
+                    scn->intersect_ctx, ray.o, ray.d, ray.tmin, ray.tmax))
+                q.l[shadow.path] += shadow.ld;
+        }
+    }
+}
+
+//
+// Checks whether a pixel has converged. Public API, see above.
+//
+YTRACE_API bool is_pixel_converged(
+    const pixel_stats& stats, const render_params& params) {
+    if (params.adaptive_threshold <= 0) return false;
+    if (stats.nsamples < std::max(params.adaptive_min_samples, 2)) return false;
+    auto var = stats.m2 / (stats.nsamples - 1);
+    auto ci = 1.96f * std::sqrt(var / stats.nsamples);
+    return ci <= params.adaptive_threshold * std::max(stats.mean, 1e-3f);
+}
+
+//
+// Lists the pixels of a block to trace, skipping converged ones if stats
+// are given.
+//
+static inline void _block_pixels(int width, const pixel_stats* stats,
+    int block_x, int block_y, int block_width, int block_height,
+    const render_params& params, std::vector<ym::vec2i>& pixels) {
+    pixels.clear();
+    for (auto j = block_y; j < block_y + block_height; j++) {
+        for (auto i = block_x; i < block_x + block_width; i++) {
+            if (stats && is_pixel_converged(stats[j * width + i], params))
+                continue;
+            pixels.push_back({i, j});
+        }
+    }
+}
+
+//
+// Stores the samples of a pixel, skipping invalid ones and clamping them.
+// If stats are given, updates the running mean and variance of the sample
+// luminance and stores the mean of all pixel samples.
+//
+static inline void _store_pixel(const scene* scn, int width, ym::vec4f* img,
+    pixel_stats* stats, const ym::vec2i& ij, const ym::vec4f* samples,
+    int samples_min, int samples_max, const render_params& params) {
+    auto idx = ij[1] * width + ij[0];
+    auto nold = (stats) ? stats[idx].nsamples : 0;
+    auto lp = ym::zero4f;
+    for (auto s = 0; s < samples_max - samples_min; s++) {
+        auto l = samples[s];
+        if (!std::isfinite(l[0]) || !std::isfinite(l[1]) ||
+            !std::isfinite(l[2])) {
+            _log(scn, 2, "NaN detected");
+            l = ym::zero4f;
+        }
+        if (params.pixel_clamp > 0)
+            *(ym::vec3f*)&l = ym::clamplen(*(ym::vec3f*)&l, params.pixel_clamp);
+        lp += l;
+        if (stats) {
+            // Welford's running variance
+            auto& st = stats[idx];
+            auto y = (l[0] + l[1] + l[2]) / 3;
+            st.nsamples += 1;
+            auto delta = y - st.mean;
+            st.mean += delta / st.nsamples;
+            st.m2 += delta * (y - st.mean);
+        }
+    }
+    if (stats) {
+        img[idx] = (img[idx] * (float)nold + lp) /
+                   (float)(nold + samples_max - samples_min);
+    } else if (params.progressive && samples_min > 0) {
+        img[idx] = (img[idx] * (float)samples_min + lp) / (float)samples_max;
+    } else {
+        img[idx] = lp / (float)(samples_max - samples_min);
+    }
+}
+
+//
+// Renders a block of pixels with the wavefront path tracer. Paths are
+// processed in chunks of whole pixels. Each round intersects all rays,
+// shades the hits sorted by shape, then traces all shadow rays. Random
+// numbers are drawn in the same order as _shade_pathtrace, so the images
+// match the recursive path tracer.
+//
+static inline int _trace_block_wavefront(const scene* scn, int width,
+    int height, ym::vec4f* img, pixel_stats* stats, int block_x, int block_y,
+    int block_width, int block_height, int samples_min, int samples_max,
+    const render_params& params) {
+    auto cam = scn->cameras[params.camera_id];
+    auto ns = samples_max - samples_min;
+    if (ns <= 0) return 0;
+    auto pixels = std::vector<ym::vec2i>();
+    _block_pixels(width, stats, block_x, block_y, block_width, block_height,
+        params, pixels);
+    auto npixels = (int)pixels.size();
+    auto chunk_pixels = std::max(1, YTRACE__WAVEFRONT_SIZE / ns);
+    auto q = _path_queue();
+    auto shadows = std::vector<_shadow_record>();
+    auto samples = std::vector<ym::vec4f>(ns);
+    for (auto chunk = 0; chunk < npixels; chunk += chunk_pixels) {
+        auto nchunk = std::min(chunk_pixels, npixels - chunk);
+        auto npaths = nchunk * ns;
+
+        // initialize paths
+        q.stage.assign(npaths, _path_stage::camera);
+        q.smp.resize(npaths);
+        q.ray.assign(npaths, {ym::zero3f, ym::vec3f{0, 0, 1}});
+        q.isec.resize(npaths);
+        q.pt.resize(npaths);
+        q.weight.assign(npaths, ym::vec3f{1, 1, 1});
+        q.l.assign(npaths, ym::zero3f);
+        q.alpha.assign(npaths, 0);
+        q.bounce.assign(npaths, 0);
+        q.emission.assign(npaths, false);
+        q.active.resize(npaths);
+        for (auto p = 0; p < npaths; p++) {
+            auto i = pixels[chunk + p / ns][0];
+            auto j = pixels[chunk + p / ns][1];
+            auto s = samples_min + p % ns;
+            q.smp[p] = _make_sampler(i, j, s, params.nsamples, params.rtype);
+            auto rn = _sample_next2f(&q.smp[p]);
+            auto uv = ym::vec2f{(i + rn[0]) / width, 1 - (j + rn[1]) / height};
+            q.ray[p] = _eval_camera(cam, uv, _sample_next2f(&q.smp[p]));
+            q.active[p] = p;
+        }
+
+        // advance all paths one bounce at a time
+        while (!q.active.empty()) {
+            _intersect_paths(scn, q);
+            std::sort(q.active.begin(), q.active.end(), [&q](int a, int b) {
+                return q.isec[a].sid < q.isec[b].sid ||
+                       (q.isec[a].sid == q.isec[b].sid && a < b);
+            });
+            shadows.clear();
+            for (auto p : q.active) _shade_path(scn, q, p, shadows, params);
+            _trace_shadows(scn, q, shadows, params);
+            q.active.erase(std::remove_if(q.active.begin(), q.active.end(),
+                               [&q](int p) {
+                                   return q.stage[p] == _path_stage::done;
+                               }),
+                q.active.end());
+        }
+
+        // accumulate samples in order
+        for (auto pid = 0; pid < nchunk; pid++) {
+            for (auto s = 0; s < ns; s++) {
+                auto& l = q.l[pid * ns + s];
+                samples[s] = {l[0], l[1], l[2], q.alpha[pid * ns + s]};
+            }
+            _store_pixel(scn, width, img, stats, pixels[chunk + pid],
+                samples.data(), samples_min, samples_max, params);
+        }
+    }
+    return npixels;
+}
+
 //
 // Shader function callback.
 //
@@ -1728,11 +2621,18 @@ using shade_fn = ym::vec4f (*)(const scene* scn, const ym::ray3f& ray,
     _sampler* smp, const render_params& params);
 
 //
-// Renders a block of pixels. Public API, see above.
+// Renders a block of pixels, skipping converged pixels if stats are given.
+// Returns the number of pixels traced.
 //
-YTRACE_API void _trace_block(const scene* scn, int width, int height,
-    ym::vec4f* img, int block_x, int block_y, int block_width, int block_height,
-    int samples_min, int samples_max, const render_params& params) {
+static inline int _trace_block(const scene* scn, int width, int height,
+    ym::vec4f* img, pixel_stats* stats, int block_x, int block_y,
+    int block_width, int block_height, int samples_min, int samples_max,
+    const render_params& params) {
+    if (params.stype == shader_type::wavefront) {
+        return _trace_block_wavefront(scn, width, height, img, stats, block_x,
+            block_y, block_width, block_height, samples_min, samples_max,
+            params);
+    }
     auto cam = scn->cameras[params.camera_id];
     shade_fn shade;
     switch (params.stype) {
@@ -1740,38 +2640,26 @@ YTRACE_API void _trace_block(const scene* scn, int width, int height,
         case shader_type::direct: shade = _shade_direct; break;
         case shader_type::def:
         case shader_type::pathtrace: shade = _shade_pathtrace; break;
-        default: assert(false); return;
+        default: assert(false); return 0;
     }
-    for (auto j = block_y; j < block_y + block_height; j++) {
-        for (auto i = block_x; i < block_x + block_width; i++) {
-            auto lp = ym::zero4f;
-            for (auto s = samples_min; s < samples_max; s++) {
-                auto smp =
-                    _make_sampler(i, j, s, params.nsamples, params.rtype);
-                auto rn = _sample_next2f(&smp);
-                auto uv =
-                    ym::vec2f{(i + rn[0]) / width, 1 - (j + rn[1]) / height};
-                auto ray = _eval_camera(cam, uv, _sample_next2f(&smp));
-                auto l = shade(scn, ray, &smp, params);
-                if (!std::isfinite(l[0]) || !std::isfinite(l[1]) ||
-                    !std::isfinite(l[2])) {
-                    _log(scn, 2, "NaN detected");
-                    continue;
-                }
-                if (params.pixel_clamp > 0)
-                    *(ym::vec3f*)&l =
-                        ym::clamplen(*(ym::vec3f*)&l, params.pixel_clamp);
-                lp += l;
-            }
-            if (params.progressive && samples_min > 0) {
-                img[j * width + i] =
-                    (img[j * width + i] * (float)samples_min + lp) /
-                    (float)samples_max;
-            } else {
-                img[j * width + i] = lp / (float)(samples_max - samples_min);
-            }
+    if (samples_max <= samples_min) return 0;
+    auto pixels = std::vector<ym::vec2i>();
+    _block_pixels(width, stats, block_x, block_y, block_width, block_height,
+        params, pixels);
+    auto samples = std::vector<ym::vec4f>(samples_max - samples_min);
+    for (auto& ij : pixels) {
+        auto i = ij[0], j = ij[1];
+        for (auto s = samples_min; s < samples_max; s++) {
+            auto smp = _make_sampler(i, j, s, params.nsamples, params.rtype);
+            auto rn = _sample_next2f(&smp);
+            auto uv = ym::vec2f{(i + rn[0]) / width, 1 - (j + rn[1]) / height};
+            auto ray = _eval_camera(cam, uv, _sample_next2f(&smp));
+            samples[s - samples_min] = shade(scn, ray, &smp, params);
         }
+        _store_pixel(scn, width, img, stats, ij, samples.data(), samples_min,
+            samples_max, params);
     }
+    return (int)pixels.size();
 }
 
 //
@@ -1780,8 +2668,20 @@ YTRACE_API void _trace_block(const scene* scn, int width, int height,
 YTRACE_API void trace_block(const scene* scn, int width, int height,
     float4* pixels, int block_x, int block_y, int block_width, int block_height,
     int samples_min, int samples_max, const render_params& params) {
-    _trace_block(scn, width, height, (ym::vec4f*)pixels, block_x, block_y,
-        block_width, block_height, samples_min, samples_max, params);
+    _trace_block(scn, width, height, (ym::vec4f*)pixels, nullptr, block_x,
+        block_y, block_width, block_height, samples_min, samples_max, params);
+}
+
+//
+// Renders a block of pixels adaptively. Public API, see above.
+//
+YTRACE_API int trace_block(const scene* scn, int width, int height,
+    float4* pixels, pixel_stats* stats, int block_x, int block_y,
+    int block_width, int block_height, int samples_min, int samples_max,
+    const render_params& params) {
+    return _trace_block(scn, width, height, (ym::vec4f*)pixels, stats,
+        block_x, block_y, block_width, block_height, samples_min, samples_max,
+        params);
 }
 
 //
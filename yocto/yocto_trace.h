@@ -28,7 +28,9 @@
 ///
 /// Shapes are indexed meshes and are described by array of vertex indices for
 /// points, lines and triangles, and arrays of vertex data. Only one primitive
-/// type can be non-empty for each shape.
+/// type can be non-empty for each shape. Rays have no time, so shapes do not
+/// move during a frame, and intersection routines that support motion blur,
+/// like yocto_bvh, should intersect shapes at their first motion key.
 ///
 /// Materials are represented as sums of an emission term, a diffuse term and
 /// a specular microfacet term (GGX or Phong). Only opaque for now. We pick
@@ -39,14 +41,21 @@
 /// one can also add an environment map. But even if you can, you might want to
 /// add a large triangle mesh with inward normals instead. The latter is more
 /// general (you can even more an arbitrary shape sun). For now only the first
-/// env is used.
+/// env is used. Textured environments are importance sampled proportionally
+/// to their texel luminance. In the path tracers, each light sample picks one
+/// light from a light bvh built in init_lights(), with probability based on
+/// light power, distance and orientation at the shading point.
 ///
 /// We generate our own random numbers guarantying that there is one random
 /// sequence per path. This means you can rul the path tracer in any order
 /// serially or in parallel.
 ///
 /// For now, we support a straightforward path tracer with explicit direct
-/// illumination using MIS.
+/// illumination using MIS. The same path tracer is also available as a
+/// wavefront integrator, that advances all paths of a block one bounce at a
+/// time, tracing rays in batches and shading hits grouped by shape. It
+/// produces the same images as the recursive path tracer. Batches are
+/// traced with the batch intersection callbacks, if set.
 ///
 ///
 /// COMPILATION:
@@ -58,6 +67,11 @@
 ///
 ///
 /// HISTORY:
+/// - v 1.19: light bvh for many-light sampling
+/// - v 1.18: environment importance sampling and light sample MIS
+/// - v 1.17: adaptive sampling
+/// - v 1.16: batched intersection callbacks
+/// - v 1.15: wavefront path tracing
 /// - v 1.14: normal mapping
 /// - v 1.13: simpler Fresnel handling
 /// - v 1.12: significantly better path tracing
@@ -365,10 +379,48 @@ using intersect_any_cb = bool (*)(
     void* ctx, const float3& o, const float3& d, float tmin, float tmax);
 
 ///
-/// Sets the intersection callbacks
+/// Ray-scene closest intersection callback for arrays of rays.
+///
+/// Parameters:
+/// - ctx: context
+/// - nrays: number of rays
+/// - o: ray origins
+/// - d: ray directions
+/// - tmin/tmax: ray min/max distances
+///
+/// Out Parameters:
+/// - isecs: intersection points (nrays elements)
+///
+using intersect_first_batch_cb = void (*)(void* ctx, int nrays,
+    const float3* o, const float3* d, const float* tmin, const float* tmax,
+    intersect_point* isecs);
+
+///
+/// Ray-scene intersection callback for arrays of rays. Only whether each
+/// intersection point is a hit is used, so any hit can be returned.
+///
+/// Parameters:
+/// - ctx: context
+/// - nrays: number of rays
+/// - o: ray origins
+/// - d: ray directions
+/// - tmin/tmax: ray min/max distances
+///
+/// Out Parameters:
+/// - isecs: intersection points (nrays elements)
+///
+using intersect_any_batch_cb = void (*)(void* ctx, int nrays, const float3* o,
+    const float3* d, const float* tmin, const float* tmax,
+    intersect_point* isecs);
+
+///
+/// Sets the intersection callbacks. The batch callbacks are optional and,
+/// when set, are used to trace the rays of many paths at once.
 ///
 YTRACE_API void set_intersection_callbacks(scene* scn, void* ctx,
-    intersect_first_cb intersect_first, intersect_any_cb intersect_any);
+    intersect_first_cb intersect_first, intersect_any_cb intersect_any,
+    intersect_first_batch_cb intersect_first_batch = nullptr,
+    intersect_any_batch_cb intersect_any_batch = nullptr);
 
 ///
 /// Logger callback
@@ -404,6 +456,8 @@ enum struct shader_type {
     direct_ao,
     /// pathtrace
     pathtrace,
+    /// pathtrace with a wavefront pipeline
+    wavefront,
 };
 
 ///
@@ -446,6 +500,23 @@ struct render_params {
     float pixel_clamp = 10;
     /// ray intersection epsilon
     float ray_eps = 1e-4f;
+    /// adaptive sampling threshold, as the 95% confidence interval of the
+    /// pixel luminance relative to its mean (0 to disable)
+    float adaptive_threshold = 0;
+    /// minimum number of pixel samples before stopping adaptive sampling
+    int adaptive_min_samples = 16;
+};
+
+///
+/// Running statistics of the samples of a pixel, for adaptive sampling.
+///
+struct pixel_stats {
+    /// number of samples
+    int nsamples = 0;
+    /// mean of the sample luminance
+    float mean = 0;
+    /// sum of squared differences from the mean of the sample luminance
+    float m2 = 0;
 };
 
 ///
@@ -472,6 +543,32 @@ YTRACE_API void trace_block(const scene* scn, int width, int height,
     float4* img, int block_x, int block_y, int block_width, int block_height,
     int samples_min, int samples_max, const render_params& params);
 
+///
+/// Renders a block of samples adaptively. Like the function above, but skips
+/// the pixels that have converged and updates the running luminance mean and
+/// variance of the others in stats. Pixels store the mean of all their
+/// samples, regardless of progressive.
+///
+/// Parameters:
+/// - stats: pixel statistics (width * height elements, initially default)
+/// - others as above
+///
+/// Return:
+/// - number of pixels traced
+///
+YTRACE_API int trace_block(const scene* scn, int width, int height,
+    float4* img, pixel_stats* stats, int block_x, int block_y,
+    int block_width, int block_height, int samples_min, int samples_max,
+    const render_params& params);
+
+///
+/// Checks whether a pixel has converged, i.e. has at least
+/// adaptive_min_samples samples and a luminance confidence interval within
+/// adaptive_threshold of its mean. Always false if adaptive_threshold is 0.
+///
+YTRACE_API bool is_pixel_converged(
+    const pixel_stats& stats, const render_params& params);
+
 ///
 /// Convenience function to call trace_block with all sample at once.
 ///